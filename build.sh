@@ -24,6 +24,18 @@ i386-elf-ld -m elf_i386 -T linker.ld -o build/kernel.elf build/*.o
 # Create GRUB bootable ISO to load the kernel
 cp build/kernel.elf iso/boot/kernel.elf
 cp grub.cfg iso/boot/grub/grub.cfg
+
+# --- FAT32 image for the RAM disk, loaded by GRUB as a boot module ---
+dd if=/dev/zero of=iso/boot/ramdisk.img bs=1M count=40
+mkfs.vfat -F 32 iso/boot/ramdisk.img
+
+mkdir -p mnt0
+sudo mount iso/boot/ramdisk.img mnt0
+sudo cp -r filesystem_data1/* mnt0/ || true
+sync
+sudo umount mnt0
+rmdir mnt0
+
 grub-mkrescue -o os_image.iso iso
 
 # --- Create first FAT32 disk image (ATA) ---
@@ -4,6 +4,10 @@
 #include "port_io.h"
 #include "print.h"
 #include "mem.h"
+#include "pci.h"
+#include "interrupts.h"
+#include "timer.h"
+#include "dma.h"
 
 #define HBA_PORT_DEV_PRESENT 0x3
 #define HBA_PORT_IPM_ACTIVE  0x1
@@ -15,10 +19,57 @@
 
 #define ATA_CMD_READ_DMA_EXT  0x25
 #define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_READ_DMA      0xC8
+#define ATA_CMD_WRITE_DMA     0xCA
+#define ATA_CMD_IDENTIFY      0xEC
+#define ATA_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define ATA_CMD_FLUSH_CACHE   0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+#define ATA_CMD_DSM           0x06
+#define ATA_DSM_TRIM          0x01
+
+// DATA SET MANAGEMENT payload: 64 eight-byte range entries per 512-byte
+// block, each a 48-bit LBA and a 16-bit length.
+#define AHCI_TRIM_BLOCKS      8
+#define AHCI_TRIM_ENTRIES     (AHCI_TRIM_BLOCKS * 64)
+#define AHCI_TRIM_MAX_LEN     0xFFFF
 
-#define AHCI_BASE     0x400000
 #define SECTOR_SIZE   512
 #define MAX_PORTS     32
+#define AHCI_CMD_SLOTS 32
+#define AHCI_SPIN_TIMEOUT 1000000
+#define AHCI_CMD_TIMEOUT_MS 5000
+
+// Hybrid completion: commands of at most AHCI_HYBRID_MAX_SECTORS are
+// busy-polled for about 1.5x the recent average small-command latency
+// (never more than AHCI_HYBRID_MAX_SPIN_US) before sleeping on the IRQ.
+#define AHCI_HYBRID_MAX_SECTORS 16
+#define AHCI_HYBRID_MAX_SPIN_US 200
+
+// Each port with a device gets its own DMA structures from the DMA pool:
+// command list (1 KiB), received FIS area (256 bytes) and one command
+// table per slot. Command tables hold AHCI_MAX_PRDT entries (16 KiB
+// each), enough to scatter ~4 MiB of 4 KiB pages in one command; PRDTL
+// itself allows up to 65535.
+#define AHCI_MAX_PRDT      1016
+#define AHCI_CMD_TBL_SIZE  (0x80 + AHCI_MAX_PRDT * 16)
+#define AHCI_CLB_SIZE      1024
+#define AHCI_FB_SIZE       256
+#define AHCI_CTBA_ALIGN    128
+
+#define AHCI_PRD_MAX_BYTES 0x400000             // 22-bit byte count
+#define AHCI_CMD_MAX_SECTORS 0xFFFF                 // 16-bit sector count
+
+#define HBA_CAP_SNCQ  (1u << 30)
+#define HBA_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1)
+
+#define HBA_GHC_IE    (1 << 1)
+#define HBA_PxIS_TFES (1 << 30)
+#define HBA_PxIE_DEFAULT 0x7800003F     // D2H/PIO/DMA/SDB/UFIS/PRD done + error bits
+#define ATA_DEV_BUSY  0x80
+#define ATA_DEV_DRQ   0x08
 
 #define ALIGN_4K(addr) (((uintptr_t)(addr) + 0xFFF) & ~0xFFF)
 
@@ -45,20 +96,19 @@ typedef struct {
 } FIS_REG_H2D;
 
 typedef struct {
-    uint8_t  cfis[64];
-    uint8_t  acmd[16];
-    uint8_t  rsv[48];
-    uint8_t  prdt_entry[8];
-} HBA_CMD_TBL;
-
-typedef struct {
-    uint16_t flags;
-    uint16_t prdbc;
     uint32_t dba;
     uint32_t dbau;
     uint32_t rsv0;
+    uint32_t dbc;       // byte count - 1 (bits 0-21), bit 31 = interrupt on completion
 } HBA_PRDT_ENTRY;
 
+typedef struct {
+    uint8_t  cfis[64];
+    uint8_t  acmd[16];
+    uint8_t  rsv[48];
+    HBA_PRDT_ENTRY prdt_entry[];    // PRDTL entries, up to AHCI_MAX_PRDT
+} HBA_CMD_TBL;
+
 typedef struct {
     uint16_t flags;
     uint16_t prdtl;
@@ -109,37 +159,170 @@ typedef volatile struct {
 
 static HBA_MEM* abar = 0;
 
-void ahci_port_rebase(HBA_PORT* port, int port_num) {
+typedef struct {
+    HBA_PORT* regs;
+    HBA_CMD_HEADER* cmd_list;
+    HBA_CMD_TBL* cmd_tables[AHCI_CMD_SLOTS];
+    DMA_BUFFER cmd_list_dma;
+    DMA_BUFFER fis_dma;
+    DMA_BUFFER cmd_table_dma[AHCI_CMD_SLOTS];
+    int started;
+    int ncq;                // port issues READ/WRITE FPDMA QUEUED
+    uint32_t slot_mask;     // slots implemented by the HBA
+    uint32_t busy;          // slots handed out and not yet collected
+    uint32_t queued;        // busy slots that were issued as NCQ commands
+    uint32_t finished;      // busy slots the HBA has completed
+    uint32_t failed;        // finished slots that completed with an error
+    uint32_t slot_sectors[AHCI_CMD_SLOTS];
+    uint64_t slot_start[AHCI_CMD_SLOTS];    // TSC at issue
+    uint32_t small_lat_us;  // running average latency of small commands
+    AHCI_REQUEST* slot_req[AHCI_CMD_SLOTS];
+    AHCI_REQUEST* pending;  // requests with data not yet issued, FIFO
+    AHCI_REQUEST* pending_tail;
+    ATA_DEVICE_INFO info;   // from IDENTIFY DEVICE
+    uint32_t sector_size;
+    uint32_t max_bytes;     // largest transfer one command may carry
+    BLOCK_DEVICE blockdev;
+    uint8_t slot_op[AHCI_CMD_SLOTS];
+    IO_STATS stats;         // per command, as the HBA sees them
+} AHCI_PORT_STATE;
+
+// Position in a scatter-gather list while it is split into commands.
+typedef struct {
+    const AHCI_SG_ENTRY* sg;
+    uint32_t count;
+    uint32_t index;
+    uint32_t offset;
+} AHCI_SG_CURSOR;
+
+static AHCI_PORT_STATE ahci_ports[MAX_PORTS];
+static uint32_t ahci_slot_mask = 1;
+static int ahci_ncq = 0;
+static int ahci_irq = -1;
+static int ahci_wait_mode = AHCI_WAIT_HYBRID;
+
+static void ahci_stop_cmd(HBA_PORT* port) {
     port->cmd &= ~HBA_PxCMD_ST;
+    port->cmd &= ~HBA_PxCMD_FRE;
     while (port->cmd & (HBA_PxCMD_FR | HBA_PxCMD_CR));
+}
 
-    port->cmd &= ~HBA_PxCMD_FRE;
+static void ahci_start_cmd(HBA_PORT* port) {
+    while (port->cmd & HBA_PxCMD_CR);
+    port->cmd |= HBA_PxCMD_FRE;
+    port->cmd |= HBA_PxCMD_ST;
+}
 
-    uint64_t base = AHCI_BASE + (port_num * 0x1000);
+static void ahci_port_free(AHCI_PORT_STATE* state) {
+    dma_free(&state->cmd_list_dma);
+    dma_free(&state->fis_dma);
+    for (int slot = 0; slot < AHCI_CMD_SLOTS; slot++) dma_free(&state->cmd_table_dma[slot]);
+}
 
-    port->clb = (uint32_t)(base);
-    port->clbu = 0;
-    memset((void*)(uintptr_t)port->clb, 0, 1024);
+static int ahci_port_alloc(AHCI_PORT_STATE* state) {
+    int ok = dma_alloc(&state->cmd_list_dma, AHCI_CLB_SIZE, AHCI_CLB_SIZE) == 0 &&
+             dma_alloc(&state->fis_dma, AHCI_FB_SIZE, AHCI_FB_SIZE) == 0;
+    for (int slot = 0; ok && slot < AHCI_CMD_SLOTS; slot++) {
+        ok = dma_alloc(&state->cmd_table_dma[slot], AHCI_CMD_TBL_SIZE, AHCI_CTBA_ALIGN) == 0;
+    }
+    if (ok) return 0;
+
+    ahci_port_free(state);
+    return -1;
+}
+
+void ahci_port_rebase(HBA_PORT* port, int port_num) {
+    AHCI_PORT_STATE* state = &ahci_ports[port_num];
+
+    ahci_stop_cmd(port);
+
+    // Allocated once per port; a rebase after reset reuses them.
+    if (!state->cmd_list_dma.virt && ahci_port_alloc(state) != 0) {
+        print("AHCI: out of DMA memory\n");
+        return;
+    }
+
+    state->regs = port;
+    state->cmd_list = (HBA_CMD_HEADER*)state->cmd_list_dma.virt;
+    memset(state->cmd_list_dma.virt, 0, AHCI_CLB_SIZE);
+    memset(state->fis_dma.virt, 0, AHCI_FB_SIZE);
 
-    port->fb = (uint32_t)(base + 0x800);
+    port->clb = state->cmd_list_dma.phys;
+    port->clbu = 0;
+    port->fb = state->fis_dma.phys;
     port->fbu = 0;
-    memset((void*)(uintptr_t)port->fb, 0, 256);
 
-    port->cmd |= HBA_PxCMD_FRE;
-    port->cmd |= HBA_PxCMD_ST;
+    // Command headers are set up once; issuing a command only rewrites
+    // the table contents and the per-command header fields.
+    for (int slot = 0; slot < AHCI_CMD_SLOTS; slot++) {
+        DMA_BUFFER* tbl = &state->cmd_table_dma[slot];
+        state->cmd_tables[slot] = (HBA_CMD_TBL*)tbl->virt;
+        state->cmd_list[slot].ctba = tbl->phys;
+        state->cmd_list[slot].ctbau = 0;
+        memset(tbl->virt, 0, sizeof(HBA_CMD_TBL));
+    }
+
+    port->serr = 0xFFFFFFFF;
+    port->is = 0xFFFFFFFF;
+    port->ie = (ahci_irq >= 0) ? HBA_PxIE_DEFAULT : 0;
+
+    ahci_start_cmd(port);
+
+    state->small_lat_us = AHCI_HYBRID_MAX_SPIN_US / 2;
+    state->slot_mask = ahci_slot_mask;
+    state->busy = 0;
+    state->queued = 0;
+    state->finished = 0;
+    state->failed = 0;
+    state->pending = 0;
+    state->pending_tail = 0;
+    memset(state->slot_req, 0, sizeof(state->slot_req));
+
+    // Until IDENTIFY says otherwise: LBA48, 512-byte sectors, no NCQ.
+    memset(&state->info, 0, sizeof(state->info));
+    state->info.lba48 = 1;
+    state->info.logical_sector_size = SECTOR_SIZE;
+    state->info.max_sectors_per_cmd = AHCI_CMD_MAX_SECTORS;
+    state->sector_size = SECTOR_SIZE;
+    state->max_bytes = AHCI_CMD_MAX_SECTORS * SECTOR_SIZE;
+    state->ncq = 0;
+    state->started = 1;
 }
 
 
+static void ahci_irq_handler(uint8_t irq);
+static void ahci_identify_port(AHCI_PORT_STATE* state, int port_num);
+
 void ahci_init(uint32_t abar_phys) {
+    PCI_DEVICE pci;
+    int have_pci = pci_find_device(0x01, 0x06, 0x01, 0, &pci);
+
+    // A zero base means "use the first AHCI controller on the PCI bus".
+    if (abar_phys == 0 && have_pci) abar_phys = pci_read_bar(&pci, 5);
+    if (have_pci) pci_enable_bus_master(&pci);
+
     abar = (HBA_MEM*)(uintptr_t)(abar_phys & ~0xF);
 
     print("AHCI base address: ");
     print_hex32((uint32_t)(uintptr_t)abar);
     print("\n");
 
-    abar->ghc &= ~0x2;  // disable interrupts
+    abar->ghc &= ~HBA_GHC_IE;   // no interrupts while ports are set up
     abar->ghc |= (1 << 31); // enable AHCI mode
 
+    ahci_irq = -1;
+    if (have_pci && pci.irq_line < IRQ_COUNT && ahci_wait_mode != AHCI_WAIT_POLL) {
+        ahci_irq = pci.irq_line;
+    }
+
+    uint32_t nslots = HBA_CAP_NCS(abar->cap);
+    ahci_slot_mask = (nslots >= 32) ? 0xFFFFFFFF : ((1u << nslots) - 1);
+    ahci_ncq = (abar->cap & HBA_CAP_SNCQ) != 0;
+
+    print("AHCI command slots: ");
+    print_uint(nslots);
+    print(ahci_ncq ? " (NCQ)\n" : "\n");
+
     for (int i = 0; i < MAX_PORTS; i++) {
         if (abar->pi & (1 << i)) {
             HBA_PORT* port = &abar->ports[i];
@@ -155,35 +338,209 @@ void ahci_init(uint32_t abar_phys) {
         }
     }
 
+    if (ahci_irq >= 0) {
+        abar->is = 0xFFFFFFFF;
+        irq_register_handler(ahci_irq, ahci_irq_handler);
+        abar->ghc |= HBA_GHC_IE;
+
+        print("AHCI using IRQ ");
+        print_uint(ahci_irq);
+        print("\n");
+    }
+
+    for (int i = 0; i < MAX_PORTS; i++) {
+        if (ahci_ports[i].started) ahci_identify_port(&ahci_ports[i], i);
+    }
 }
 
-static int issue_ahci_cmd(HBA_PORT* port, uint8_t cmd, uint64_t lba, uint32_t sector_count, uint8_t* buf) {
-    port->cmd &= ~HBA_PxCMD_ST;
-    while (port->cmd & (HBA_PxCMD_FR | HBA_PxCMD_CR));
-    port->cmd &= ~HBA_PxCMD_FRE;
+// Error recovery: a task file error halts the command engine and, with
+// NCQ, aborts every outstanding command. Restart the engine and fail
+// everything that was in flight.
+static void ahci_port_recover(AHCI_PORT_STATE* state) {
+    HBA_PORT* port = state->regs;
+
+    ahci_stop_cmd(port);
+    port->serr = 0xFFFFFFFF;
+    port->is = 0xFFFFFFFF;
+    ahci_start_cmd(port);
 
-    HBA_CMD_HEADER* cmd_header = (HBA_CMD_HEADER*)(uintptr_t)(port->clb);
-    memset(cmd_header, 0, sizeof(HBA_CMD_HEADER) * 32);
+    uint32_t outstanding = state->busy & ~state->finished;
+    state->finished |= outstanding;
+    state->failed |= outstanding;
+}
+
+// Move slots the HBA has cleared from PxCI/PxSACT into the finished set,
+// given the PxIS bits the caller has just read and acknowledged. Runs
+// from the IRQ handler or with interrupts disabled.
+static void ahci_update(AHCI_PORT_STATE* state, uint32_t pis) {
+    HBA_PORT* port = state->regs;
+
+    if (pis & HBA_PxIS_TFES) {
+        print("AHCI command failed or timed out\n");
+        ahci_port_recover(state);
+        return;
+    }
+
+    uint32_t active = port->ci | port->sact;
+    state->finished |= state->busy & ~state->finished & ~active;
+}
+
+static uint32_t ahci_reap(AHCI_PORT_STATE* state) {
+    uint32_t flags = irq_save();
+    uint32_t pis = state->regs->is;
+    if (pis) state->regs->is = pis;
+    ahci_update(state, pis);
+    uint32_t finished = state->finished;
+    irq_restore(flags);
+    return finished;
+}
+
+static void ahci_irq_handler(uint8_t irq) {
+    (void)irq;
+    if (!abar) return;
+
+    uint32_t pending = abar->is;
+    if (!pending) return;   // shared line, not ours
+
+    for (int i = 0; i < MAX_PORTS; i++) {
+        if (!(pending & (1u << i)) || !ahci_ports[i].started) continue;
+        AHCI_PORT_STATE* state = &ahci_ports[i];
+        uint32_t pis = state->regs->is;
+        state->regs->is = pis;
+        ahci_update(state, pis);
+    }
+    abar->is = pending;
+}
+
+static int ahci_alloc_slot(AHCI_PORT_STATE* state, int queued) {
+    // Non-queued commands cannot overlap anything else on the link, and
+    // queued commands cannot be issued while a non-queued one is active.
+    if (!queued || !state->ncq) {
+        if (state->busy) return -1;
+    } else if (state->busy & ~state->queued) {
+        return -1;
+    }
+
+    uint32_t active = state->regs->ci | state->regs->sact;
+    uint32_t free = state->slot_mask & ~(state->busy | active);
+    if (!free) return -1;
+
+    int slot = 0;
+    while (!(free & (1u << slot))) slot++;
+    return slot;
+}
+
+static void ahci_sg_rewind(AHCI_SG_CURSOR* cur, uint32_t bytes) {
+    while (bytes) {
+        if (cur->offset == 0) {
+            cur->index--;
+            cur->offset = cur->sg[cur->index].length;
+        }
+        uint32_t step = bytes < cur->offset ? bytes : cur->offset;
+        cur->offset -= step;
+        bytes -= step;
+    }
+}
+
+// Fill the PRDT from the cursor with at most one command's worth of data,
+// splitting segments larger than 4 MiB, and trim the result back to a
+// whole number of sectors. Returns the byte count and sets *prd_count.
+static uint32_t ahci_build_prdt(HBA_CMD_TBL* tbl, AHCI_SG_CURSOR* cur, uint32_t max_bytes, uint32_t sector_size, uint16_t* prd_count) {
+    uint32_t bytes = 0;
+    int prds = 0;
+
+    while (cur->index < cur->count && prds < AHCI_MAX_PRDT && bytes < max_bytes) {
+        const AHCI_SG_ENTRY* seg = &cur->sg[cur->index];
+        uint32_t len = seg->length - cur->offset;
+        if (len > AHCI_PRD_MAX_BYTES) len = AHCI_PRD_MAX_BYTES;
+        if (len > max_bytes - bytes) len = max_bytes - bytes;
+
+        if (len) {
+            HBA_PRDT_ENTRY* prd = &tbl->prdt_entry[prds++];
+            prd->dba = dma_phys((uint8_t*)seg->buffer + cur->offset);
+            prd->dbau = 0;
+            prd->rsv0 = 0;
+            prd->dbc = len - 1;
+            bytes += len;
+            cur->offset += len;
+        }
+
+        if (cur->offset == seg->length) {
+            cur->index++;
+            cur->offset = 0;
+        }
+    }
+
+    uint32_t extra = bytes % sector_size;
+    if (bytes > extra) {
+        ahci_sg_rewind(cur, extra);
+        bytes -= extra;
+        while (extra) {
+            HBA_PRDT_ENTRY* prd = &tbl->prdt_entry[prds - 1];
+            uint32_t len = (prd->dbc & 0x3FFFFF) + 1;
+            if (len <= extra) {
+                prds--;
+                extra -= len;
+            } else {
+                prd->dbc = len - extra - 1;
+                extra = 0;
+            }
+        }
+    }
+
+    *prd_count = prds;
+    return bytes;
+}
 
-    cmd_header[0].prdtl = 1;
-    cmd_header[0].flags = (5 << 16);
-    cmd_header[0].ctba = (uint32_t)(uintptr_t)(AHCI_BASE + 0x6000);
-    cmd_header[0].ctbau = 0;
+// Build and issue one command from the cursor, which is advanced past the
+// data the command covers. Returns the slot, or -1 if no slot is free.
+static int issue_ahci_cmd(AHCI_PORT_STATE* state, uint8_t op, uint64_t lba, AHCI_SG_CURSOR* cur, uint32_t* sectors_out) {
+    HBA_PORT* port = state->regs;
+    int write = (op == AHCI_OP_WRITE || op == AHCI_OP_WRITE_FUA || op == AHCI_OP_TRIM);
+    int queued = state->ncq && (op == AHCI_OP_READ || op == AHCI_OP_WRITE || op == AHCI_OP_WRITE_FUA);
+    int slot = ahci_alloc_slot(state, queued);
+    if (slot < 0) return -1;
 
-    HBA_CMD_TBL* cmd_tbl = (HBA_CMD_TBL*)(uintptr_t)(AHCI_BASE + 0x6000);
+    if (!queued) {
+        // Wait for the device to accept a new command; the engine stays running.
+        for (int i = 0; i < AHCI_SPIN_TIMEOUT; i++) {
+            if (!(port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ))) break;
+        }
+    }
+
+    HBA_CMD_TBL* cmd_tbl = state->cmd_tables[slot];
     memset(cmd_tbl, 0, sizeof(HBA_CMD_TBL));
 
-    HBA_PRDT_ENTRY* prdt = (HBA_PRDT_ENTRY*)(&cmd_tbl->prdt_entry);
-    prdt->dba = (uint32_t)(uintptr_t)buf;
-    prdt->dbau = 0;
-    prdt->rsv0 = 0;
-    prdt->prdbc = 0;
-    prdt->flags = (sector_count * SECTOR_SIZE) - 1;
+    HBA_CMD_HEADER* cmd_header = &state->cmd_list[slot];
+    cmd_header->flags = (sizeof(FIS_REG_H2D) / sizeof(uint32_t)) | (write ? (1 << 6) : 0);
+    cmd_header->prdbc = 0;
+
+    // IDENTIFY and DSM payloads are 512-byte blocks, whatever the sector size.
+    uint32_t unit = state->sector_size;
+    uint32_t max_bytes = state->max_bytes;
+    if (op == AHCI_OP_IDENTIFY) {
+        unit = max_bytes = SECTOR_SIZE;
+    } else if (op == AHCI_OP_TRIM) {
+        unit = SECTOR_SIZE;
+        max_bytes = AHCI_TRIM_BLOCKS * SECTOR_SIZE;
+    }
+
+    uint32_t sector_count = 0;
+    if (op == AHCI_OP_FLUSH) {
+        cmd_header->prdtl = 0;
+    } else {
+        AHCI_SG_CURSOR start = *cur;
+        sector_count = ahci_build_prdt(cmd_tbl, cur, max_bytes, unit, &cmd_header->prdtl) / unit;
+        if (sector_count == 0) {
+            *cur = start;
+            return -1;
+        }
+    }
+    *sectors_out = sector_count;
 
     FIS_REG_H2D* fis = (FIS_REG_H2D*)(&cmd_tbl->cfis);
     fis->fis_type = 0x27;
     fis->c = 1;
-    fis->command = cmd;
 
     fis->lba0 = (uint8_t)(lba);
     fis->lba1 = (uint8_t)(lba >> 8);
@@ -192,32 +549,562 @@ static int issue_ahci_cmd(HBA_PORT* port, uint8_t cmd, uint64_t lba, uint32_t se
     fis->lba3 = (uint8_t)(lba >> 24);
     fis->lba4 = (uint8_t)(lba >> 32);
     fis->lba5 = (uint8_t)(lba >> 40);
-    fis->countl = sector_count & 0xFF;
-    fis->counth = (sector_count >> 8) & 0xFF;
 
-    port->cmd |= HBA_PxCMD_FRE;
-    port->cmd |= HBA_PxCMD_ST;
+    if (op == AHCI_OP_IDENTIFY || op == AHCI_OP_FLUSH) {
+        memset(fis, 0, sizeof(FIS_REG_H2D));
+        fis->fis_type = 0x27;
+        fis->c = 1;
+        if (op == AHCI_OP_IDENTIFY) fis->command = ATA_CMD_IDENTIFY;
+        else fis->command = state->info.flush_ext ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE;
+    } else if (op == AHCI_OP_TRIM) {
+        memset(fis, 0, sizeof(FIS_REG_H2D));
+        fis->fis_type = 0x27;
+        fis->c = 1;
+        fis->command = ATA_CMD_DSM;
+        fis->featurel = ATA_DSM_TRIM;
+        fis->device = 1 << 6;
+        fis->countl = sector_count & 0xFF;     // payload blocks
+        fis->counth = (sector_count >> 8) & 0xFF;
+    } else if (queued) {
+        // FPDMA QUEUED: sector count moves to the feature field, the count
+        // field carries the command tag and FUA is bit 7 of the device byte.
+        fis->command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+        fis->featurel = sector_count & 0xFF;
+        fis->featureh = (sector_count >> 8) & 0xFF;
+        fis->countl = slot << 3;
+        fis->counth = 0;
+        if (op == AHCI_OP_WRITE_FUA) fis->device |= 0x80;
+    } else if (state->info.lba48) {
+        if (op == AHCI_OP_WRITE_FUA) fis->command = ATA_CMD_WRITE_DMA_FUA_EXT;
+        else fis->command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        fis->countl = sector_count & 0xFF;
+        fis->counth = (sector_count >> 8) & 0xFF;
+    } else {
+        // 28-bit READ/WRITE DMA: LBA bits 24-27 live in the device register
+        // and a count of 0 means 256 sectors.
+        fis->command = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+        fis->device = 0xE0 | ((lba >> 24) & 0x0F);
+        fis->lba3 = fis->lba4 = fis->lba5 = 0;
+        fis->countl = sector_count & 0xFF;
+        fis->counth = 0;
+    }
+
+    state->slot_sectors[slot] = sector_count;
+    state->slot_op[slot] = op;
+    state->slot_start[slot] = timer_rdtsc();
+    iostat_queue_enter(&state->stats);
 
-    port->ci = 1;
+    // The IRQ handler treats busy slots missing from PxCI as finished, so
+    // marking the slot busy and issuing it must not be split by it.
+    uint32_t flags = irq_save();
+    state->busy |= 1u << slot;
+    state->finished &= ~(1u << slot);
+    state->failed &= ~(1u << slot);
+    if (queued) state->queued |= 1u << slot;
+    else state->queued &= ~(1u << slot);
 
-    for (int i = 0; i < 1000000; i++) {
-        if (!(port->ci & 1)) break;
+    asm volatile ("" ::: "memory");
+    if (queued) port->sact = 1u << slot;
+    port->ci = 1u << slot;
+    irq_restore(flags);
+
+    return slot;
+}
+
+static uint32_t ahci_elapsed_us(uint64_t start) {
+    return timer_elapsed_us(start);
+}
+
+static int ahci_collect_slot(AHCI_PORT_STATE* state, int slot) {
+    uint32_t bit = 1u << slot;
+
+    uint32_t flags = irq_save();
+    int status = (state->failed & bit) ? -1 : 0;
+    state->busy &= ~bit;
+    state->queued &= ~bit;
+    state->finished &= ~bit;
+    state->failed &= ~bit;
+    irq_restore(flags);
+
+    if (status == 0 && state->slot_sectors[slot] <= AHCI_HYBRID_MAX_SECTORS) {
+        uint32_t lat = ahci_elapsed_us(state->slot_start[slot]);
+        state->small_lat_us = (state->small_lat_us * 7 + lat) / 8;
     }
 
-    if (port->ci & 1 || port->tfd & (1 << 7)) {
-        print("AHCI command failed or timed out\n");
+    iostat_queue_leave(&state->stats);
+    int op = -1;
+    switch (state->slot_op[slot]) {
+        case AHCI_OP_READ:      op = IOSTAT_READ; break;
+        case AHCI_OP_WRITE:
+        case AHCI_OP_WRITE_FUA: op = IOSTAT_WRITE; break;
+        case AHCI_OP_FLUSH:     op = IOSTAT_FLUSH; break;
+    }
+    if (op >= 0) iostat_account(&state->stats, op, state->slot_sectors[slot], state->slot_start[slot], status != 0);
+    else if (status != 0) state->stats.errors++;
+    return status;
+}
+
+// How long to busy-poll a slot before sleeping on the interrupt.
+static uint32_t ahci_spin_budget_us(AHCI_PORT_STATE* state, int slot) {
+    if (ahci_irq < 0 || ahci_wait_mode == AHCI_WAIT_POLL) return 0xFFFFFFFF;
+    if (ahci_wait_mode == AHCI_WAIT_IRQ) return 0;
+    if (state->slot_sectors[slot] > AHCI_HYBRID_MAX_SECTORS) return 0;
+
+    uint32_t budget = state->small_lat_us + state->small_lat_us / 2;
+    if (budget > AHCI_HYBRID_MAX_SPIN_US) return 0;  // slow device: just sleep
+    return budget;
+}
+
+// Wait until at least one slot in mask has finished. On timeout the port
+// is recovered, which fails (and so finishes) everything in flight.
+static void ahci_wait_finished(AHCI_PORT_STATE* state, uint32_t mask) {
+    int first = 0;
+    while (first < AHCI_CMD_SLOTS - 1 && !(mask & (1u << first))) first++;
+
+    uint32_t budget = ahci_spin_budget_us(state, first);
+    uint32_t start_ms = timer_ms();
+    uint32_t spins = 0;
+
+    while (1) {
+        uint32_t flags = irq_save();
+        uint32_t pis = state->regs->is;
+        if (pis) state->regs->is = pis;
+        ahci_update(state, pis);
+
+        if (state->finished & mask) {
+            irq_restore(flags);
+            return;
+        }
+
+        // Sleep only if interrupts were on; irq_wait re-enables them
+        // atomically with hlt so the completion cannot be missed.
+        if ((flags & (1 << 9)) && ahci_elapsed_us(state->slot_start[first]) >= budget) {
+            irq_wait();
+        } else {
+            irq_restore(flags);
+        }
+
+        if (timer_running() ? (timer_ms() - start_ms > AHCI_CMD_TIMEOUT_MS) : (++spins > AHCI_SPIN_TIMEOUT)) {
+            break;
+        }
+    }
+
+    print("AHCI command failed or timed out\n");
+    state->stats.timeouts++;
+    uint32_t flags = irq_save();
+    ahci_port_recover(state);
+    irq_restore(flags);
+}
+
+static AHCI_PORT_STATE* ahci_port_state(uint32_t port) {
+    if (!abar || port >= MAX_PORTS) return 0;
+    if (!ahci_ports[port].started) return 0;
+    return &ahci_ports[port];
+}
+
+static void ahci_finish_request(AHCI_REQUEST* req) {
+    if (req->error) req->status = -1;
+    else if (req->cancelled) req->status = AHCI_REQ_CANCELLED;
+    else req->status = 0;
+
+    if (req->callback) req->callback(req);
+}
+
+static void ahci_dequeue_request(AHCI_PORT_STATE* state, AHCI_REQUEST* req) {
+    AHCI_REQUEST** link = &state->pending;
+    while (*link && *link != req) link = &(*link)->next;
+    if (!*link) return;
+
+    *link = req->next;
+    if (state->pending_tail == req) {
+        state->pending_tail = 0;
+        for (AHCI_REQUEST* r = state->pending; r; r = r->next) state->pending_tail = r;
+    }
+    req->next = 0;
+    req->queued = 0;
+}
+
+// Issue commands for queued requests, in order, until the port runs out
+// of slots. A request leaves the queue once all of its data is issued.
+static void ahci_kick(AHCI_PORT_STATE* state) {
+    while (state->pending) {
+        AHCI_REQUEST* req = state->pending;
+        AHCI_SG_CURSOR cur = { req->sg, req->sg_count, req->sg_index, req->sg_offset };
+        int stalled = 0;
+
+        if (req->op == AHCI_OP_FLUSH) {
+            // No data: a single command. Being non-queued, it only starts
+            // once every earlier command on the port has completed.
+            uint32_t unused;
+            int slot = issue_ahci_cmd(state, req->op, 0, &cur, &unused);
+            if (slot < 0) {
+                stalled = 1;
+            } else {
+                state->slot_req[slot] = req;
+                req->inflight |= 1u << slot;
+            }
+        }
+
+        while (req->op != AHCI_OP_FLUSH && cur.index < cur.count) {
+            uint32_t sectors = 0;
+            int slot = issue_ahci_cmd(state, req->op, req->next_lba, &cur, &sectors);
+            if (slot < 0) {
+                if (state->busy) {      // port full: resume on completion
+                    stalled = 1;
+                    break;
+                }
+
+                // Nothing in flight and still no command: unusable vector.
+                req->error = 1;
+                cur.index = cur.count;
+                break;
+            }
+            state->slot_req[slot] = req;
+            req->inflight |= 1u << slot;
+            req->next_lba += sectors;
+        }
+
+        if (stalled) {
+            req->sg_index = cur.index;
+            req->sg_offset = cur.offset;
+            return;
+        }
+
+        ahci_dequeue_request(state, req);
+        if (!req->inflight) ahci_finish_request(req);
+    }
+}
+
+// Collect finished slots, complete requests whose last command is done
+// and refill the freed slots. Returns the number of completed requests.
+static int ahci_poll_state(AHCI_PORT_STATE* state) {
+    uint32_t finished = ahci_reap(state);
+    int completed = 0;
+
+    for (int slot = 0; slot < AHCI_CMD_SLOTS; slot++) {
+        if (!(finished & (1u << slot))) continue;
+
+        AHCI_REQUEST* req = state->slot_req[slot];
+        state->slot_req[slot] = 0;
+        if (ahci_collect_slot(state, slot) != 0 && req) req->error = 1;
+        if (!req) continue;
+
+        req->inflight &= ~(1u << slot);
+        if (!req->inflight && !req->queued) {
+            ahci_finish_request(req);
+            completed++;
+        }
+    }
+
+    ahci_kick(state);
+    return completed;
+}
+
+int ahci_submit(AHCI_REQUEST* req) {
+    AHCI_PORT_STATE* state = ahci_port_state(req->port);
+    if (!state || (req->sg_count == 0 && req->op != AHCI_OP_FLUSH)) {
+        req->status = -1;
         return -1;
     }
 
+    req->status = AHCI_REQ_PENDING;
+    req->sg_index = 0;
+    req->sg_offset = 0;
+    req->next_lba = req->lba;
+    req->inflight = 0;
+    req->error = 0;
+    req->cancelled = 0;
+    req->queued = 1;
+    req->next = 0;
+
+    // Without a volatile write cache every completed write is already durable.
+    if (req->op == AHCI_OP_FLUSH && state->info.present && !state->info.write_cache) {
+        req->queued = 0;
+        ahci_finish_request(req);
+        return 0;
+    }
+
+    if (state->pending_tail) state->pending_tail->next = req;
+    else state->pending = req;
+    state->pending_tail = req;
+
+    ahci_kick(state);
     return 0;
 }
 
+int ahci_poll(uint32_t port) {
+    AHCI_PORT_STATE* state = ahci_port_state(port);
+    if (!state) return 0;
+    return ahci_poll_state(state);
+}
+
+int ahci_wait(AHCI_REQUEST* req) {
+    AHCI_PORT_STATE* state = ahci_port_state(req->port);
+    if (!state) return -1;
+
+    while (req->status == AHCI_REQ_PENDING) {
+        uint32_t mask = req->inflight ? req->inflight : state->busy;
+        if (mask) ahci_wait_finished(state, mask);
+        ahci_poll_state(state);
+    }
+    return req->status;
+}
+
+int ahci_wait_all(uint32_t port) {
+    AHCI_PORT_STATE* state = ahci_port_state(port);
+    if (!state) return -1;
+
+    while (state->pending || state->busy) {
+        if (state->busy) ahci_wait_finished(state, state->busy);
+        ahci_poll_state(state);
+    }
+    return 0;
+}
+
+int ahci_cancel(AHCI_REQUEST* req) {
+    AHCI_PORT_STATE* state = ahci_port_state(req->port);
+    if (!state || req->status != AHCI_REQ_PENDING) return -1;
+
+    // Commands already handed to the device cannot be pulled back without
+    // resetting the port; only the part still queued is dropped.
+    if (!req->queued) return -1;
+
+    ahci_dequeue_request(state, req);
+    req->cancelled = 1;
+    if (!req->inflight) ahci_finish_request(req);
+    return 0;
+}
+
+void ahci_set_wait_mode(int mode) {
+    ahci_wait_mode = mode;
+}
+
+static int ahci_slot_count(uint32_t mask) {
+    int count = 0;
+    for (int slot = 0; slot < AHCI_CMD_SLOTS; slot++) {
+        if (mask & (1u << slot)) count++;
+    }
+    return count;
+}
+
+int ahci_queue_depth(uint32_t port) {
+    AHCI_PORT_STATE* state = ahci_port_state(port);
+    if (!state) return 0;
+    if (!state->ncq) return 1;
+    return ahci_slot_count(state->slot_mask);
+}
+
+const IO_STATS* ahci_port_stats(uint32_t port) {
+    AHCI_PORT_STATE* state = ahci_port_state(port);
+    return state ? &state->stats : 0;
+}
+
+const ATA_DEVICE_INFO* ahci_device_info(uint32_t port) {
+    AHCI_PORT_STATE* state = ahci_port_state(port);
+    if (!state || !state->info.present) return 0;
+    return &state->info;
+}
+
+static int ahci_transfer(uint32_t port, uint8_t op, uint64_t lba, const AHCI_SG_ENTRY* sg, uint32_t sg_count) {
+    AHCI_REQUEST req;
+    memset(&req, 0, sizeof(req));
+    req.port = port;
+    req.op = op;
+    req.lba = lba;
+    req.sg = sg;
+    req.sg_count = sg_count;
+
+    if (ahci_submit(&req) != 0) return -1;
+    return ahci_wait(&req);
+}
+
 int sata_ahci_read(uint32_t port, uint64_t start_lba, uint32_t sector_count, uint8_t* buf) {
-    if (!abar || port >= MAX_PORTS) return -1;
-    return issue_ahci_cmd(&abar->ports[port], ATA_CMD_READ_DMA_EXT, start_lba, sector_count, buf);
+    AHCI_PORT_STATE* state = ahci_port_state(port);
+    if (!state) return -1;
+    AHCI_SG_ENTRY seg = { buf, sector_count * state->sector_size };
+    return ahci_transfer(port, AHCI_OP_READ, start_lba, &seg, 1);
 }
 
 int sata_ahci_write(uint32_t port, uint64_t start_lba, uint32_t sector_count, const uint8_t* buf) {
-    if (!abar || port >= MAX_PORTS) return -1;
-    return issue_ahci_cmd(&abar->ports[port], ATA_CMD_WRITE_DMA_EXT, start_lba, sector_count, (uint8_t*)buf);
+    AHCI_PORT_STATE* state = ahci_port_state(port);
+    if (!state) return -1;
+    AHCI_SG_ENTRY seg = { (uint8_t*)buf, sector_count * state->sector_size };
+    return ahci_transfer(port, AHCI_OP_WRITE, start_lba, &seg, 1);
+}
+
+int sata_ahci_flush(uint32_t port) {
+    return ahci_transfer(port, AHCI_OP_FLUSH, 0, 0, 0);
+}
+
+int ahci_supports_fua(uint32_t port) {
+    AHCI_PORT_STATE* state = ahci_port_state(port);
+    if (!state) return 0;
+    // NCQ writes carry a FUA bit; otherwise it takes WRITE DMA FUA EXT.
+    return state->ncq || (state->info.fua && state->info.lba48);
+}
+
+int sata_ahci_write_fua(uint32_t port, uint64_t start_lba, uint32_t sector_count, const uint8_t* buf) {
+    AHCI_PORT_STATE* state = ahci_port_state(port);
+    if (!state) return -1;
+    AHCI_SG_ENTRY seg = { (uint8_t*)buf, sector_count * state->sector_size };
+
+    if (ahci_supports_fua(port)) {
+        return ahci_transfer(port, AHCI_OP_WRITE_FUA, start_lba, &seg, 1);
+    }
+
+    // With the write cache off every write is durable on completion.
+    if (state->info.present && !state->info.write_cache) {
+        return ahci_transfer(port, AHCI_OP_WRITE, start_lba, &seg, 1);
+    }
+
+    // No FUA command: write, then flush the cache behind it.
+    if (ahci_transfer(port, AHCI_OP_WRITE, start_lba, &seg, 1) != 0) return -1;
+    return sata_ahci_flush(port);
+}
+
+static DMA_BUFFER ahci_trim_dma;
+static uint64_t* ahci_trim_payload;
+
+static int ahci_issue_trim(uint32_t port, uint32_t used) {
+    // Unused entries must be zero; round up to whole blocks.
+    uint32_t blocks = (used + 63) / 64;
+    memset(&ahci_trim_payload[used], 0, (blocks * 64 - used) * sizeof(uint64_t));
+
+    AHCI_SG_ENTRY seg = { ahci_trim_payload, blocks * SECTOR_SIZE };
+    return ahci_transfer(port, AHCI_OP_TRIM, 0, &seg, 1);
+}
+
+// Pack ranges into DSM payload blocks, splitting lengths over 65535, and
+// issue one TRIM command per payload the drive accepts.
+int sata_ahci_trim(uint32_t port, const AHCI_TRIM_RANGE* ranges, uint32_t range_count) {
+    AHCI_PORT_STATE* state = ahci_port_state(port);
+    if (!state) return -1;
+    if (!state->info.trim) return 0;    // advisory: nothing to do
+
+    if (!ahci_trim_payload) {
+        if (dma_alloc(&ahci_trim_dma, AHCI_TRIM_ENTRIES * sizeof(uint64_t), SECTOR_SIZE) != 0) return -1;
+        ahci_trim_payload = ahci_trim_dma.virt;
+    }
+
+    uint32_t max_blocks = state->info.trim_max_blocks;
+    if (max_blocks == 0 || max_blocks > AHCI_TRIM_BLOCKS) max_blocks = AHCI_TRIM_BLOCKS;
+    uint32_t max_entries = max_blocks * 64;
+
+    uint32_t used = 0;
+    int status = 0;
+
+    for (uint32_t i = 0; i < range_count; i++) {
+        uint64_t lba = ranges[i].lba;
+        uint32_t left = ranges[i].count;
+
+        while (left) {
+            uint32_t len = left > AHCI_TRIM_MAX_LEN ? AHCI_TRIM_MAX_LEN : left;
+            ahci_trim_payload[used++] = (lba & 0xFFFFFFFFFFFFULL) | ((uint64_t)len << 48);
+            lba += len;
+            left -= len;
+
+            if (used == max_entries) {
+                if (ahci_issue_trim(port, used) != 0) status = -1;
+                used = 0;
+            }
+        }
+    }
+
+    if (used && ahci_issue_trim(port, used) != 0) status = -1;
+    return status;
+}
+
+int sata_ahci_readv(uint32_t port, uint64_t start_lba, const AHCI_SG_ENTRY* sg, uint32_t sg_count) {
+    return ahci_transfer(port, AHCI_OP_READ, start_lba, sg, sg_count);
+}
+
+int sata_ahci_writev(uint32_t port, uint64_t start_lba, const AHCI_SG_ENTRY* sg, uint32_t sg_count) {
+    return ahci_transfer(port, AHCI_OP_WRITE, start_lba, sg, sg_count);
+}
+
+static int ahci_blk_read(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, void* buffer) {
+    return sata_ahci_read(dev->unit, lba, count, buffer);
+}
+
+static int ahci_blk_write(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    return sata_ahci_write(dev->unit, lba, count, buffer);
+}
+
+static int ahci_blk_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    return sata_ahci_readv(dev->unit, lba, segs, seg_count);
+}
+
+static int ahci_blk_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    return sata_ahci_writev(dev->unit, lba, segs, seg_count);
+}
+
+static int ahci_blk_flush(BLOCK_DEVICE* dev) {
+    return sata_ahci_flush(dev->unit);
+}
+
+static int ahci_blk_write_fua(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    return sata_ahci_write_fua(dev->unit, lba, count, buffer);
+}
+
+static int ahci_blk_discard(BLOCK_DEVICE* dev, const BLOCK_RANGE* ranges, uint32_t range_count) {
+    return sata_ahci_trim(dev->unit, ranges, range_count);
+}
+
+static const BLOCK_DEVICE_OPS ahci_blk_ops = {
+    ahci_blk_read,
+    ahci_blk_write,
+    ahci_blk_readv,
+    ahci_blk_writev,
+    ahci_blk_flush,
+    ahci_blk_write_fua,
+    ahci_blk_discard,
+};
+
+// Read IDENTIFY DEVICE and size the port's commands from it: sector
+// size, per-command limit, 28- vs 48-bit commands and NCQ depth.
+static void ahci_identify_port(AHCI_PORT_STATE* state, int port_num) {
+    DMA_BUFFER id_dma;
+    if (dma_alloc(&id_dma, 512, SECTOR_SIZE) != 0) return;
+    uint16_t* id = id_dma.virt;
+
+    AHCI_SG_ENTRY seg = { id, 512 };
+    if (ahci_transfer(port_num, AHCI_OP_IDENTIFY, 0, &seg, 1) != 0) {
+        print("AHCI IDENTIFY failed on port ");
+        print_uint(port_num);
+        print("\n");
+        dma_free(&id_dma);
+        return;
+    }
+
+    ata_parse_identify(id, &state->info);
+    dma_free(&id_dma);
+    state->sector_size = state->info.logical_sector_size;
+
+    uint32_t max_sectors = state->info.max_sectors_per_cmd;
+    if (max_sectors > AHCI_CMD_MAX_SECTORS) max_sectors = AHCI_CMD_MAX_SECTORS;
+    state->max_bytes = max_sectors * state->sector_size;
+
+    state->ncq = ahci_ncq && state->info.ncq_depth > 0;
+    if (state->ncq && state->info.ncq_depth < 32) {
+        state->slot_mask &= (1u << state->info.ncq_depth) - 1;
+    }
+
+    print("Port ");
+    print_uint(port_num);
+    print(": ");
+    print(state->info.model);
+    print(", ");
+    print_uint((uint32_t)((state->info.sector_count * state->sector_size) >> 20));
+    print(" MiB, queue depth ");
+    print_uint(ahci_queue_depth(port_num));
+    print("\n");
+
+    BLOCK_DEVICE* dev = &state->blockdev;
+    blockdev_set_name(dev, "ahci", port_num);
+    dev->ops = &ahci_blk_ops;
+    dev->unit = port_num;
+    dev->sector_size = state->sector_size;
+    dev->sector_count = state->info.sector_count;
+    dev->max_sectors = 0;   // requests are split into commands internally
+    blockdev_register(dev);
 }
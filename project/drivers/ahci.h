@@ -4,9 +4,100 @@
 #define AHCI_H
 
 #include <stdint.h>
+#include "drive_tools.h"
+#include "blockdev.h"
 
+// One physically contiguous piece of a scatter-gather transfer. Lengths
+// must be even; the whole list must add up to a multiple of 512 bytes.
+typedef BLOCK_SEGMENT AHCI_SG_ENTRY;
+
+// An LBA range the filesystem no longer uses.
+typedef BLOCK_RANGE AHCI_TRIM_RANGE;
+
+// How callers wait for command completion. POLL spins on PxCI; IRQ sleeps
+// until the controller's PCI interrupt fires; HYBRID busy-polls briefly
+// for small commands and then sleeps. IRQ/HYBRID fall back to POLL when
+// no interrupt line is available. Set before ahci_init.
+#define AHCI_WAIT_POLL   0
+#define AHCI_WAIT_IRQ    1
+#define AHCI_WAIT_HYBRID 2
+
+// abar may be 0 to use BAR5 of the first AHCI controller found on PCI.
+// Every identified port is registered as block device "ahci<port>".
 void ahci_init(uint32_t abar);
+void ahci_set_wait_mode(int mode);
 int sata_ahci_read(uint32_t port, uint64_t lba, uint32_t sector_count, uint8_t* buffer);
 int sata_ahci_write(uint32_t port, uint64_t lba, uint32_t sector_count, const uint8_t* buffer);
 
+// Write barrier: returns once everything written before it is on media.
+int sata_ahci_flush(uint32_t port);
+
+// Write that is durable on completion (FUA). Drives without a FUA command
+// get a plain write if their write cache is off, otherwise write + flush.
+int sata_ahci_write_fua(uint32_t port, uint64_t lba, uint32_t sector_count, const uint8_t* buffer);
+int ahci_supports_fua(uint32_t port);
+
+// Tell the drive the ranges are free (DATA SET MANAGEMENT / TRIM), with as
+// many ranges per command as the drive accepts. No-op without TRIM support.
+int sata_ahci_trim(uint32_t port, const AHCI_TRIM_RANGE* ranges, uint32_t range_count);
+
+// Vectored I/O: the segments are transferred with as few commands as the
+// PRDT allows (one command for up to AHCI_MAX_PRDT segments).
+int sata_ahci_readv(uint32_t port, uint64_t lba, const AHCI_SG_ENTRY* sg, uint32_t sg_count);
+int sata_ahci_writev(uint32_t port, uint64_t lba, const AHCI_SG_ENTRY* sg, uint32_t sg_count);
+
+// Asynchronous requests. ahci_submit returns immediately; the request is
+// split into as many commands as needed and kept in flight alongside other
+// requests (up to 32 commands per port with NCQ). Completion is reported
+// through req->status and the optional callback, which runs from
+// ahci_poll/ahci_wait/ahci_wait_all in the caller's context. The request
+// and its segment list must stay valid until it completes.
+#define AHCI_OP_READ     0
+#define AHCI_OP_WRITE    1
+#define AHCI_OP_IDENTIFY 2      // 512 bytes of IDENTIFY DEVICE data
+#define AHCI_OP_FLUSH    3      // no data; starts after all earlier commands
+#define AHCI_OP_WRITE_FUA 4     // only if ahci_supports_fua()
+#define AHCI_OP_TRIM     5      // sg carries DSM range blocks
+
+#define AHCI_REQ_PENDING    1
+#define AHCI_REQ_CANCELLED  (-2)
+
+typedef struct AHCI_REQUEST AHCI_REQUEST;
+typedef void (*ahci_callback_t)(AHCI_REQUEST* req);
+
+struct AHCI_REQUEST {
+    uint32_t port;
+    uint8_t op;
+    uint64_t lba;
+    const AHCI_SG_ENTRY* sg;
+    uint32_t sg_count;
+    ahci_callback_t callback;
+    void* context;
+    volatile int status;    // AHCI_REQ_PENDING, 0, -1 or AHCI_REQ_CANCELLED
+
+    // Driver bookkeeping
+    uint32_t sg_index;
+    uint32_t sg_offset;
+    uint64_t next_lba;
+    uint32_t inflight;      // command slots carrying this request
+    int error;
+    int cancelled;
+    int queued;
+    AHCI_REQUEST* next;
+};
+
+int ahci_submit(AHCI_REQUEST* req);
+int ahci_poll(uint32_t port);           // returns the number of requests completed
+int ahci_wait(AHCI_REQUEST* req);       // returns the final status
+int ahci_wait_all(uint32_t port);
+int ahci_cancel(AHCI_REQUEST* req);     // drops the part not yet issued
+
+int ahci_queue_depth(uint32_t port);
+
+// Per-port command counters and latencies; 0 if the port is not in use.
+const IO_STATS* ahci_port_stats(uint32_t port);
+
+// IDENTIFY DEVICE results for the drive on a port, or 0.
+const ATA_DEVICE_INFO* ahci_device_info(uint32_t port);
+
 #endif
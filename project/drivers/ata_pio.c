@@ -1,5 +1,9 @@
 #include "port_io.h"
 #include "stdint.h"
+#include "drive_tools.h"
+#include "ata_pio.h"
+#include "ide_dma.h"
+#include "blockdev.h"
 
 #define ATA_PRIMARY_IO  0x1F0
 #define ATA_PRIMARY_CTRL 0x3F6
@@ -15,63 +19,222 @@
 #define ATA_REG_STATUS     0x07
 
 #define ATA_CMD_READ_PIO   0x20
+#define ATA_CMD_READ_PIO_EXT 0x24
 #define ATA_SR_BSY         0x80
 #define ATA_SR_DRQ         0x08
+#define ATA_SR_ERR         0x01
+
+#define ATA_CMD_FLUSH_CACHE     0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+
+// Wait for BSY to clear without expecting data (non-data commands).
+static int ata_wait_idle(void) {
+    int timeout = 100000;
+    uint8_t status;
+    while (((status = inb(ATA_PRIMARY_IO + ATA_REG_STATUS)) & ATA_SR_BSY) && --timeout);
+    return timeout && !(status & ATA_SR_ERR);
+}
+
+// Wait until the drive is ready to move the next data block.
+static int ata_wait_drq(void) {
+    // 400ns for the status register to become valid after a command or block.
+    for (int i = 0; i < 4; i++) inb(ATA_PRIMARY_CTRL);
 
-void ata_wait() {
     int timeout = 100000;
-    while ((inb(ATA_PRIMARY_IO + ATA_REG_STATUS) & ATA_SR_BSY) && --timeout);
+    uint8_t status;
+    while (((status = inb(ATA_PRIMARY_IO + ATA_REG_STATUS)) & ATA_SR_BSY) && --timeout);
+    if (!timeout || (status & ATA_SR_ERR)) return 0;
+
     timeout = 100000;
-    while (!(inb(ATA_PRIMARY_IO + ATA_REG_STATUS) & ATA_SR_DRQ) && --timeout);
+    while (!((status = inb(ATA_PRIMARY_IO + ATA_REG_STATUS)) & ATA_SR_DRQ) && --timeout) {
+        if (status & ATA_SR_ERR) return 0;
+    }
+    return timeout != 0;
 }
 
 
-int ata_pio_read(uint32_t lba, uint8_t* buffer) {
-    outb(ATA_PRIMARY_IO + ATA_REG_HDDEVSEL, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT0, 1);
+// Primary master as described by IDENTIFY; plain 28-bit, 512-byte
+// sectors if the drive could not be identified.
+static uint32_t ata_sector_words(void) {
+    const ATA_DEVICE_INFO* info = ata_get_device_info(0);
+    return info ? info->logical_sector_size / 2 : 256;
+}
+
+static int ata_use_lba48(uint32_t lba, uint32_t count) {
+    const ATA_DEVICE_INFO* info = ata_get_device_info(0);
+    return info && info->lba48 && lba + count > (1u << 28);
+}
+
+// Program the task file for a transfer of `count` (1-256) sectors, using
+// the 48-bit register layout (high bytes first) when the LBA needs it.
+static void ata_setup_lba(uint32_t lba, uint32_t count, int lba48) {
+    if (lba48) {
+        outb(ATA_PRIMARY_IO + ATA_REG_HDDEVSEL, 0x40);
+        outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT0, (uint8_t)(count >> 8));
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA0, (uint8_t)(lba >> 24));
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA1, 0);
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA2, 0);
+    } else {
+        outb(ATA_PRIMARY_IO + ATA_REG_HDDEVSEL, 0xE0 | ((lba >> 24) & 0x0F));
+    }
+    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT0, (uint8_t)count); // 256 is sent as 0
     outb(ATA_PRIMARY_IO + ATA_REG_LBA0, (uint8_t)(lba));
     outb(ATA_PRIMARY_IO + ATA_REG_LBA1, (uint8_t)(lba >> 8));
     outb(ATA_PRIMARY_IO + ATA_REG_LBA2, (uint8_t)(lba >> 16));
-    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
+}
+
+#define ATA_CMD_WRITE_PIO 0x30
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_READ_MULTIPLE      0xC4
+#define ATA_CMD_WRITE_MULTIPLE     0xC5
+#define ATA_CMD_SET_MULTIPLE       0xC6
+#define ATA_CMD_READ_MULTIPLE_EXT  0x29
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+
+// Sectors per DRQ block: 1 until SET MULTIPLE MODE has succeeded.
+static int ata_multiple = -1;
+
+static uint32_t ata_block_sectors(void) {
+    if (ata_multiple < 0) {
+        const ATA_DEVICE_INFO* info = ata_get_device_info(0);
+        ata_multiple = 1;
+        if (info && info->multiple_sectors > 1) {
+            outb(ATA_PRIMARY_IO + ATA_REG_HDDEVSEL, 0xE0);
+            outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT0, (uint8_t)info->multiple_sectors);
+            outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+            if (ata_wait_idle()) ata_multiple = info->multiple_sectors;
+        }
+    }
+    return (uint32_t)ata_multiple;
+}
+
+static uint8_t ata_rw_command(int write, int lba48, int multiple) {
+    if (multiple) {
+        if (write) return lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
+        return lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+    }
+    if (write) return lba48 ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO;
+    return lba48 ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO;
+}
+
+// One command for the whole run; the data moves a DRQ block at a time
+// (one sector, or the READ/WRITE MULTIPLE block size).
+static int ata_pio_transfer(uint32_t lba, uint32_t count, uint8_t* buffer, int write) {
+    if (count == 0 || count > ATA_PIO_MAX_SECTORS) return 0;
+
+    int lba48 = ata_use_lba48(lba, count);
+    uint32_t words = ata_sector_words();
+    uint32_t block = ata_block_sectors();
+
+    ata_setup_lba(lba, count, lba48);
+    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, ata_rw_command(write, lba48, block > 1));
 
-    ata_wait();
+    while (count) {
+        uint32_t n = count < block ? count : block;
+        if (!ata_wait_drq()) return 0;
 
-    for (int i = 0; i < 256; i++) {
-        uint16_t data = inw(ATA_PRIMARY_IO + ATA_REG_DATA);
-        buffer[i * 2] = (uint8_t)data;
-        buffer[i * 2 + 1] = (uint8_t)(data >> 8);
+        if (write) outsw(ATA_PRIMARY_IO + ATA_REG_DATA, buffer, n * words);
+        else insw(ATA_PRIMARY_IO + ATA_REG_DATA, buffer, n * words);
+
+        buffer += n * words * 2;
+        count -= n;
     }
 
+    // Writes complete when BSY drops after the last block. The write cache
+    // is flushed by ata_pio_flush, once per batch.
+    if (write && !ata_wait_idle()) return 0;
+
     return 1; // success
 }
 
-#define ATA_CMD_WRITE_PIO 0x30
+int ata_pio_read_sectors(uint32_t lba, uint32_t count, uint8_t* buffer) {
+    return ata_pio_transfer(lba, count, buffer, 0);
+}
+
+int ata_pio_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    return ata_pio_transfer(lba, count, (uint8_t*)buffer, 1);
+}
+
+int ata_pio_read(uint32_t lba, uint8_t* buffer) {
+    return ata_pio_read_sectors(lba, 1, buffer);
+}
 
 int ata_pio_write(uint32_t lba, const uint8_t* buffer) {
-    // Select drive and high LBA bits
-    outb(ATA_PRIMARY_IO + ATA_REG_HDDEVSEL, 0xE0 | ((lba >> 24) & 0x0F));
+    return ata_pio_write_sectors(lba, 1, buffer);
+}
 
-    // Send sector count and LBA low/mid/high
-    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT0, 1); // 1 sector
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA0, (uint8_t)(lba));
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA1, (uint8_t)(lba >> 8));
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA2, (uint8_t)(lba >> 16));
+int ata_pio_flush(void) {
+    const ATA_DEVICE_INFO* info = ata_get_device_info(0);
+    if (info && !info->write_cache) return 1;
+
+    outb(ATA_PRIMARY_IO + ATA_REG_HDDEVSEL, 0xE0);
+    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND,
+         (info && info->flush_ext) ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+
+    return ata_wait_idle(); // FLUSH CACHE can take a while on a full cache
+}
 
-    // Send write command
-    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO);
+// Block devices for the legacy positions: bus-master DMA when the IDE
+// controller provides it, otherwise PIO (primary master only).
+static BLOCK_DEVICE ata_blockdevs[ATA_DRIVE_COUNT];
 
-    // Wait for BSY clear and DRQ set
-    ata_wait();
+static int ata_blk_read(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, void* buffer) {
+    if (ide_dma_available(dev->unit)) return ide_dma_read(dev->unit, lba, count, buffer) ? 0 : -1;
 
-    // Write 256 words (512 bytes)
-    for (int i = 0; i < 256; i++) {
-        uint16_t data = buffer[i * 2] | (buffer[i * 2 + 1] << 8);
-        outw(ATA_PRIMARY_IO + ATA_REG_DATA, data);
+    uint8_t* buf = buffer;
+    while (count) {
+        uint32_t n = count < ATA_PIO_MAX_SECTORS ? count : ATA_PIO_MAX_SECTORS;
+        if (!ata_pio_read_sectors(lba, n, buf)) return -1;
+        lba += n;
+        count -= n;
+        buf += n * dev->sector_size;
     }
+    return 0;
+}
 
-    // Flush the cache (send cache flush command if needed)
-    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, 0xE7); // FLUSH CACHE
-    ata_wait();
+static int ata_blk_write(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    if (ide_dma_available(dev->unit)) return ide_dma_write(dev->unit, lba, count, buffer) ? 0 : -1;
 
-    return 1; // success
+    const uint8_t* buf = buffer;
+    while (count) {
+        uint32_t n = count < ATA_PIO_MAX_SECTORS ? count : ATA_PIO_MAX_SECTORS;
+        if (!ata_pio_write_sectors(lba, n, buf)) return -1;
+        lba += n;
+        count -= n;
+        buf += n * dev->sector_size;
+    }
+    return 0;
+}
+
+static int ata_blk_flush(BLOCK_DEVICE* dev) {
+    if (ide_dma_available(dev->unit)) return ide_dma_flush(dev->unit) ? 0 : -1;
+    return ata_pio_flush() ? 0 : -1;    // PIO devices are the primary master only
+}
+
+static const BLOCK_DEVICE_OPS ata_blk_ops = {
+    ata_blk_read,
+    ata_blk_write,
+    0,
+    0,
+    ata_blk_flush,
+    0,
+    0,
+};
+
+void ata_register_block_devices(void) {
+    for (int i = 0; i < ATA_DRIVE_COUNT; i++) {
+        const ATA_DEVICE_INFO* info = ata_get_device_info(i);
+        if (!info) continue;
+        if (i != 0 && !ide_dma_available(i)) continue;
+
+        BLOCK_DEVICE* dev = &ata_blockdevs[i];
+        blockdev_set_name(dev, "ata", i);
+        dev->ops = &ata_blk_ops;
+        dev->unit = i;
+        dev->sector_size = info->logical_sector_size;
+        // The PIO and DMA paths take 32-bit LBAs; don't offer more.
+        dev->sector_count = info->sector_count > 0xFFFFFFFF ? 0xFFFFFFFF : info->sector_count;
+        dev->max_sectors = ide_dma_available(i) ? ide_dma_max_sectors(i) : ATA_PIO_MAX_SECTORS;
+        blockdev_register(dev);
+    }
 }
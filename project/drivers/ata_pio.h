@@ -3,7 +3,20 @@
 
 #include "stdint.h"
 
+#define ATA_PIO_MAX_SECTORS 256
+
+// Primary master, 1..ATA_PIO_MAX_SECTORS sectors per command. Return 1 on success.
+int ata_pio_read_sectors(uint32_t lba, uint32_t count, uint8_t* buffer);
+int ata_pio_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer);
+
 int ata_pio_read(uint32_t lba, uint8_t* buffer);
 int ata_pio_write(uint32_t lba, const uint8_t* buffer);
 
+// Write barrier: returns 1 once all completed writes are on media.
+int ata_pio_flush(void);
+
+// Register every present legacy drive as block device "ata<drive>",
+// using bus-master DMA where ide_dma_init found a controller.
+void ata_register_block_devices(void);
+
 #endif
@@ -0,0 +1,354 @@
+// bcache.c
+
+#include "bcache.h"
+#include "mem.h"
+#include "dma.h"
+
+static BCACHE_BUFFER bcache_buffers[BCACHE_BUFFERS] __attribute__((aligned(16)));
+static BCACHE_BUFFER* bcache_hash[BCACHE_HASH_BUCKETS];
+static BCACHE_BUFFER* lru_head = 0;     // most recently used
+static BCACHE_BUFFER* lru_tail = 0;
+static int bcache_ready = 0;
+static BCACHE_STATS bcache_stats;
+static uint32_t bcache_dirty_count = 0;
+
+static DMA_BUFFER bcache_data;
+
+// Block data comes from the DMA pool so drivers can hand it to the
+// device directly. Without it nothing is cached.
+static int bcache_setup(void) {
+    if (dma_alloc(&bcache_data, BCACHE_BUFFERS * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE) != 0) return -1;
+
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        BCACHE_BUFFER* buf = &bcache_buffers[i];
+        buf->data = (uint8_t*)bcache_data.virt + i * BCACHE_BLOCK_SIZE;
+        buf->flags = 0;
+        buf->pins = 0;
+        buf->lru_prev = i ? &bcache_buffers[i - 1] : 0;
+        buf->lru_next = (i + 1 < BCACHE_BUFFERS) ? &bcache_buffers[i + 1] : 0;
+    }
+    lru_head = &bcache_buffers[0];
+    lru_tail = &bcache_buffers[BCACHE_BUFFERS - 1];
+    bcache_ready = 1;
+    return 0;
+}
+
+int bcache_cacheable(BLOCK_DEVICE* dev) {
+    if (!dev || dev->sector_size != BCACHE_BLOCK_SIZE || (dev->flags & BLOCKDEV_NOCACHE)) return 0;
+    return bcache_ready || bcache_setup() == 0;
+}
+
+static uint32_t bcache_bucket(BLOCK_DEVICE* dev, uint64_t lba) {
+    uint32_t h = (uint32_t)lba ^ (uint32_t)(lba >> 32) ^ ((uint32_t)(uintptr_t)dev >> 4);
+    h ^= h >> 8;
+    return h & (BCACHE_HASH_BUCKETS - 1);
+}
+
+static BCACHE_BUFFER* bcache_lookup(BLOCK_DEVICE* dev, uint64_t lba) {
+    for (BCACHE_BUFFER* buf = bcache_hash[bcache_bucket(dev, lba)]; buf; buf = buf->hash_next) {
+        if (buf->dev == dev && buf->lba == lba) return buf;
+    }
+    return 0;
+}
+
+static void bcache_hash_insert(BCACHE_BUFFER* buf) {
+    BCACHE_BUFFER** head = &bcache_hash[bcache_bucket(buf->dev, buf->lba)];
+    buf->hash_next = *head;
+    *head = buf;
+}
+
+static void bcache_hash_remove(BCACHE_BUFFER* buf) {
+    BCACHE_BUFFER** link = &bcache_hash[bcache_bucket(buf->dev, buf->lba)];
+    while (*link && *link != buf) link = &(*link)->hash_next;
+    if (*link) *link = buf->hash_next;
+    buf->hash_next = 0;
+}
+
+static void bcache_lru_unlink(BCACHE_BUFFER* buf) {
+    if (buf->lru_prev) buf->lru_prev->lru_next = buf->lru_next;
+    else lru_head = buf->lru_next;
+    if (buf->lru_next) buf->lru_next->lru_prev = buf->lru_prev;
+    else lru_tail = buf->lru_prev;
+}
+
+static void bcache_lru_touch(BCACHE_BUFFER* buf) {
+    if (lru_head == buf) return;
+    bcache_lru_unlink(buf);
+    buf->lru_prev = 0;
+    buf->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = buf;
+    lru_head = buf;
+    if (!lru_tail) lru_tail = buf;
+}
+
+static void bcache_set_dirty(BCACHE_BUFFER* buf) {
+    if (!(buf->flags & BCACHE_DIRTY)) bcache_dirty_count++;
+    buf->flags |= BCACHE_DIRTY;
+}
+
+static void bcache_clear_dirty(BCACHE_BUFFER* buf) {
+    if (buf->flags & BCACHE_DIRTY) bcache_dirty_count--;
+    buf->flags &= ~BCACHE_DIRTY;
+}
+
+// Synchronous write-back of one block, for eviction.
+static int bcache_writeback(BCACHE_BUFFER* buf) {
+    BLOCK_SEGMENT seg = { buf->data, BCACHE_BLOCK_SIZE };
+    if (iosched_transfer(buf->dev, 1, IOPRIO_INTERACTIVE, buf->lba, &seg, 1) != 0) return -1;
+    bcache_clear_dirty(buf);
+    bcache_stats.writebacks++;
+    return 0;
+}
+
+static void bcache_writeback_done(IO_REQUEST* req) {
+    BCACHE_BUFFER* buf = req->context;
+    buf->flags &= ~BCACHE_WRITEBACK;
+    buf->pins--;
+    if (req->status == 0) {
+        // Dispatch is synchronous, so nothing can have changed the buffer
+        // between the transfer and now.
+        bcache_clear_dirty(buf);
+        bcache_stats.writebacks++;
+    }
+}
+
+// Queue a dirty block for background write-back. It stays dirty (and
+// keeps absorbing writes) until the transfer completes.
+static void bcache_start_writeback(BCACHE_BUFFER* buf) {
+    if (!(buf->flags & BCACHE_DIRTY) || (buf->flags & BCACHE_WRITEBACK)) return;
+
+    buf->io_seg.buffer = buf->data;
+    buf->io_seg.length = BCACHE_BLOCK_SIZE;
+    buf->io.dev = buf->dev;
+    buf->io.write = 1;
+    buf->io.prio = IOPRIO_BACKGROUND;
+    buf->io.lba = buf->lba;
+    buf->io.segs = &buf->io_seg;
+    buf->io.seg_count = 1;
+    buf->io.callback = bcache_writeback_done;
+    buf->io.context = buf;
+
+    buf->flags |= BCACHE_WRITEBACK;
+    buf->pins++;
+    if (iosched_submit(&buf->io) != 0) {
+        buf->flags &= ~BCACHE_WRITEBACK;
+        buf->pins--;
+    }
+}
+
+static void bcache_write_behind(void) {
+    if (bcache_dirty_count <= BCACHE_DIRTY_HIGH) return;
+    for (int i = 0; i < BCACHE_BUFFERS; i++) bcache_start_writeback(&bcache_buffers[i]);
+}
+
+// Take the least recently used unpinned buffer, writing it back first if
+// it is dirty. A buffer that cannot be written back is skipped.
+static BCACHE_BUFFER* bcache_evict(void) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (BCACHE_BUFFER* buf = lru_tail; buf; buf = buf->lru_prev) {
+            if (buf->pins) continue;
+            if ((buf->flags & BCACHE_DIRTY) && bcache_writeback(buf) != 0) continue;
+
+            if (buf->flags & BCACHE_VALID) {
+                bcache_hash_remove(buf);
+                bcache_stats.evictions++;
+            }
+            buf->flags = 0;
+            return buf;
+        }
+
+        // Everything pinned: let queued write-back finish and retry.
+        iosched_run(0);
+    }
+    return 0;
+}
+
+// Find or allocate the buffer for a block and pin it. With fill set a
+// missing block is read from the device; otherwise the caller is about
+// to overwrite all of it.
+static BCACHE_BUFFER* bcache_pin(BLOCK_DEVICE* dev, uint64_t lba, int fill) {
+
+    BCACHE_BUFFER* buf = bcache_lookup(dev, lba);
+    if (buf) {
+        if (fill) bcache_stats.hits++;
+        buf->pins++;
+        bcache_lru_touch(buf);
+        return buf;
+    }
+
+    if (fill) bcache_stats.misses++;
+    buf = bcache_evict();
+    if (!buf) return 0;
+
+    buf->dev = dev;
+    buf->lba = lba;
+    if (fill) {
+        BLOCK_SEGMENT seg = { buf->data, BCACHE_BLOCK_SIZE };
+        if (iosched_transfer(dev, 0, IOPRIO_INTERACTIVE, lba, &seg, 1) != 0) return 0;
+    }
+
+    buf->flags = BCACHE_VALID;
+    buf->pins = 1;
+    bcache_hash_insert(buf);
+    bcache_lru_touch(buf);
+    return buf;
+}
+
+BCACHE_BUFFER* bcache_get(BLOCK_DEVICE* dev, uint64_t lba) {
+    if (!bcache_cacheable(dev)) return 0;
+    return bcache_pin(dev, lba, 1);
+}
+
+void bcache_mark_dirty(BCACHE_BUFFER* buf) {
+    bcache_set_dirty(buf);
+    bcache_write_behind();
+}
+
+void bcache_release(BCACHE_BUFFER* buf) {
+    if (buf && buf->pins) buf->pins--;
+}
+
+// Copy one block between a cache buffer and byte offset off of a
+// segment list, crossing segment boundaries as needed.
+static void bcache_seg_copy(const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t off, uint8_t* block, int to_segs) {
+    uint32_t i = 0;
+    while (i < seg_count && off >= segs[i].length) off -= segs[i++].length;
+
+    uint32_t done = 0;
+    while (i < seg_count && done < BCACHE_BLOCK_SIZE) {
+        uint32_t len = segs[i].length - off;
+        if (len > BCACHE_BLOCK_SIZE - done) len = BCACHE_BLOCK_SIZE - done;
+
+        uint8_t* p = (uint8_t*)segs[i].buffer + off;
+        if (to_segs) memcpy(p, block + done, len);
+        else memcpy(block + done, p, len);
+
+        done += len;
+        off = 0;
+        i++;
+    }
+}
+
+int bcache_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t sectors) {
+    for (uint32_t i = 0; i < sectors; i++) {
+        BCACHE_BUFFER* buf = bcache_pin(dev, lba + i, 1);
+        if (!buf) return -1;
+        bcache_seg_copy(segs, seg_count, i * BCACHE_BLOCK_SIZE, buf->data, 1);
+        bcache_release(buf);
+    }
+    return 0;
+}
+
+int bcache_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t sectors) {
+    for (uint32_t i = 0; i < sectors; i++) {
+        BCACHE_BUFFER* buf = bcache_pin(dev, lba + i, 0);
+        if (!buf) return -1;
+        bcache_seg_copy(segs, seg_count, i * BCACHE_BLOCK_SIZE, buf->data, 0);
+        bcache_set_dirty(buf);
+        bcache_release(buf);
+    }
+    bcache_write_behind();
+    return 0;
+}
+
+void bcache_overlay_dirty(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t sectors) {
+    if (!bcache_ready) return;
+    for (uint32_t i = 0; i < sectors; i++) {
+        BCACHE_BUFFER* buf = bcache_lookup(dev, lba + i);
+        if (buf && (buf->flags & BCACHE_DIRTY)) {
+            bcache_seg_copy(segs, seg_count, i * BCACHE_BLOCK_SIZE, buf->data, 1);
+        }
+    }
+}
+
+void bcache_update(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t sectors) {
+    if (!bcache_ready) return;
+    for (uint32_t i = 0; i < sectors; i++) {
+        BCACHE_BUFFER* buf = bcache_lookup(dev, lba + i);
+        if (buf) {
+            bcache_seg_copy(segs, seg_count, i * BCACHE_BLOCK_SIZE, buf->data, 0);
+            if (!(buf->flags & BCACHE_WRITEBACK)) bcache_clear_dirty(buf);
+        }
+    }
+}
+
+int bcache_prefetch(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count) {
+    if (!bcache_cacheable(dev)) return 0;
+
+    uint32_t i = 0;
+    while (i < count) {
+        if (bcache_lookup(dev, lba + i)) {
+            i++;
+            continue;
+        }
+
+        // Claim buffers for the missing run; they stay out of the hash
+        // (and pinned) until the read has succeeded.
+        BCACHE_BUFFER* run[BCACHE_PREFETCH_MAX];
+        BLOCK_SEGMENT segs[BCACHE_PREFETCH_MAX];
+        uint32_t n = 0;
+        while (i + n < count && n < BCACHE_PREFETCH_MAX && !bcache_lookup(dev, lba + i + n)) {
+            BCACHE_BUFFER* buf = bcache_evict();
+            if (!buf) break;
+            buf->pins = 1;
+            run[n] = buf;
+            segs[n].buffer = buf->data;
+            segs[n].length = BCACHE_BLOCK_SIZE;
+            n++;
+        }
+        if (n == 0) return -1;
+
+        int status = iosched_transfer(dev, 0, IOPRIO_INTERACTIVE, lba + i, segs, n);
+        for (uint32_t k = 0; k < n; k++) {
+            BCACHE_BUFFER* buf = run[k];
+            buf->pins = 0;
+            if (status != 0) continue;
+
+            buf->dev = dev;
+            buf->lba = lba + i + k;
+            buf->flags = BCACHE_VALID;
+            bcache_hash_insert(buf);
+            bcache_lru_touch(buf);
+        }
+        if (status != 0) return -1;
+
+        bcache_stats.prefetched += n;
+        i += n;
+    }
+    return 0;
+}
+
+int bcache_sync(BLOCK_DEVICE* dev) {
+    if (!bcache_ready) return 0;
+
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        BCACHE_BUFFER* buf = &bcache_buffers[i];
+        if (dev && buf->dev != dev) continue;
+        bcache_start_writeback(buf);
+    }
+    iosched_run(dev);
+
+    // Anything still dirty failed to write.
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        BCACHE_BUFFER* buf = &bcache_buffers[i];
+        if ((buf->flags & BCACHE_DIRTY) && (!dev || buf->dev == dev)) return -1;
+    }
+    return 0;
+}
+
+void bcache_invalidate(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count) {
+    if (!bcache_ready) return;
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        BCACHE_BUFFER* buf = &bcache_buffers[i];
+        if (!(buf->flags & BCACHE_VALID) || buf->dev != dev || buf->pins) continue;
+        if (buf->lba < lba || buf->lba >= lba + count) continue;
+
+        bcache_clear_dirty(buf);
+        bcache_hash_remove(buf);
+        buf->flags = 0;
+    }
+}
+
+void bcache_get_stats(BCACHE_STATS* out) {
+    *out = bcache_stats;
+}
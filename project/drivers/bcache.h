@@ -0,0 +1,88 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include "blockdev.h"
+#include "iosched.h"
+
+// Buffer cache for 512-byte sectors, keyed by (device, LBA). The
+// blockdev_* calls go through it, so every driver is cached. Small
+// transfers are served from cached blocks and writes are held dirty until
+// eviction or sync; large transfers go straight to the device and are
+// kept coherent with whatever is cached. Devices with other sector sizes
+// are not cached.
+
+#define BCACHE_BLOCK_SIZE   512
+#define BCACHE_BUFFERS      512
+#define BCACHE_HASH_BUCKETS 256
+
+// Transfers above this many sectors bypass the cache.
+#define BCACHE_MAX_CACHED   16
+
+// Largest single readahead command, in sectors.
+#define BCACHE_PREFETCH_MAX 128
+
+// Once more than this many blocks are dirty, all of them are queued for
+// background write-back; the scheduler sends them when no foreground I/O
+// is waiting, or when their deadline passes.
+#define BCACHE_DIRTY_HIGH   (BCACHE_BUFFERS / 4)
+
+#define BCACHE_VALID     0x1
+#define BCACHE_DIRTY     0x2
+#define BCACHE_WRITEBACK 0x4    // queued for write-back, pinned until done
+
+typedef struct BCACHE_BUFFER BCACHE_BUFFER;
+
+struct BCACHE_BUFFER {
+    uint8_t* data;              // BCACHE_BLOCK_SIZE bytes, DMA-capable
+    BLOCK_DEVICE* dev;
+    uint64_t lba;
+    uint32_t flags;
+    uint32_t pins;
+    BCACHE_BUFFER* hash_next;
+    BCACHE_BUFFER* lru_prev;    // towards most recently used
+    BCACHE_BUFFER* lru_next;
+    IO_REQUEST io;              // background write-back
+    BLOCK_SEGMENT io_seg;
+};
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t writebacks;    // dirty blocks written to the device
+    uint32_t prefetched;    // blocks brought in by readahead
+} BCACHE_STATS;
+
+int bcache_cacheable(BLOCK_DEVICE* dev);
+
+// Pin a block, reading it in if needed. Returns 0 on I/O error or when
+// every buffer is pinned. Modify data in place, then mark dirty and release.
+BCACHE_BUFFER* bcache_get(BLOCK_DEVICE* dev, uint64_t lba);
+void bcache_mark_dirty(BCACHE_BUFFER* buf);
+void bcache_release(BCACHE_BUFFER* buf);
+
+// Small transfers behind blockdev_readv/blockdev_writev.
+int bcache_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t sectors);
+int bcache_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t sectors);
+
+// Coherence for transfers that bypassed the cache: after a device read,
+// copy newer dirty blocks over the data; after a device write, refresh
+// cached copies and mark them clean.
+void bcache_overlay_dirty(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t sectors);
+void bcache_update(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t sectors);
+
+// Readahead: bring the uncached blocks of the range into the cache, each
+// contiguous missing run with one device command.
+int bcache_prefetch(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count);
+
+// Write back every dirty block of dev (all devices if 0) through the
+// scheduler, which sorts and merges adjacent blocks.
+int bcache_sync(BLOCK_DEVICE* dev);
+
+// Drop cached copies, dirty or not (e.g. after a discard).
+void bcache_invalidate(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count);
+
+void bcache_get_stats(BCACHE_STATS* out);
+
+#endif
@@ -0,0 +1,165 @@
+// blockdev.c
+
+#include "blockdev.h"
+#include "bcache.h"
+#include "iosched.h"
+#include "timer.h"
+
+static BLOCK_DEVICE* blockdevs[BLOCKDEV_MAX];
+static int blockdev_total = 0;
+
+void blockdev_set_name(BLOCK_DEVICE* dev, const char* prefix, uint32_t unit) {
+    int n = 0;
+    while (prefix[n] && n < BLOCKDEV_NAME_LEN - 4) {
+        dev->name[n] = prefix[n];
+        n++;
+    }
+
+    char digits[10];
+    int d = 0;
+    do {
+        digits[d++] = '0' + (unit % 10);
+        unit /= 10;
+    } while (unit && d < 3);
+    while (d) dev->name[n++] = digits[--d];
+
+    dev->name[n] = '\0';
+}
+
+int blockdev_register(BLOCK_DEVICE* dev) {
+    if (blockdev_total == BLOCKDEV_MAX) return -1;
+    blockdevs[blockdev_total] = dev;
+    return blockdev_total++;
+}
+
+int blockdev_count(void) {
+    return blockdev_total;
+}
+
+BLOCK_DEVICE* blockdev_get(int index) {
+    if (index < 0 || index >= blockdev_total) return 0;
+    return blockdevs[index];
+}
+
+BLOCK_DEVICE* blockdev_find(const char* name) {
+    for (int i = 0; i < blockdev_total; i++) {
+        const char* a = blockdevs[i]->name;
+        const char* b = name;
+        while (*a && *a == *b) { a++; b++; }
+        if (*a == *b) return blockdevs[i];
+    }
+    return 0;
+}
+
+static int blockdev_in_range(BLOCK_DEVICE* dev, uint64_t lba, uint64_t count) {
+    if (!dev || !dev->ops) return 0;
+    return dev->sector_count == 0 || (lba < dev->sector_count && count <= dev->sector_count - lba);
+}
+
+static uint32_t blockdev_segs_sectors(BLOCK_DEVICE* dev, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    uint32_t bytes = 0;
+    for (uint32_t i = 0; i < seg_count; i++) bytes += segs[i].length;
+    return bytes / dev->sector_size;
+}
+
+// Without native vectored I/O, segments are transferred one by one and
+// must each hold whole sectors.
+int blockdev_raw_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    if (dev->ops->readv) return dev->ops->readv(dev, lba, segs, seg_count);
+
+    for (uint32_t i = 0; i < seg_count; i++) {
+        uint32_t n = segs[i].length / dev->sector_size;
+        if (dev->ops->read(dev, lba, n, segs[i].buffer) != 0) return -1;
+        lba += n;
+    }
+    return 0;
+}
+
+int blockdev_raw_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    if (dev->ops->writev) return dev->ops->writev(dev, lba, segs, seg_count);
+
+    for (uint32_t i = 0; i < seg_count; i++) {
+        uint32_t n = segs[i].length / dev->sector_size;
+        if (dev->ops->write(dev, lba, n, segs[i].buffer) != 0) return -1;
+        lba += n;
+    }
+    return 0;
+}
+
+int blockdev_read(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, void* buffer) {
+    if (!dev) return -1;
+    BLOCK_SEGMENT seg = { buffer, count * dev->sector_size };
+    return blockdev_readv(dev, lba, &seg, 1);
+}
+
+int blockdev_write(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    if (!dev) return -1;
+    BLOCK_SEGMENT seg = { (void*)buffer, count * dev->sector_size };
+    return blockdev_writev(dev, lba, &seg, 1);
+}
+
+// Small transfers are served by the buffer cache; large ones go to the
+// device and are reconciled with it.
+int blockdev_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    if (!dev) return -1;
+    uint32_t sectors = blockdev_segs_sectors(dev, segs, seg_count);
+    if (!blockdev_in_range(dev, lba, sectors)) return -1;
+
+    if (bcache_cacheable(dev) && sectors <= BCACHE_MAX_CACHED) return bcache_readv(dev, lba, segs, seg_count, sectors);
+
+    if (iosched_transfer(dev, 0, IOPRIO_INTERACTIVE, lba, segs, seg_count) != 0) return -1;
+    if (!bcache_cacheable(dev)) return 0;
+    bcache_overlay_dirty(dev, lba, segs, seg_count, sectors);
+    return 0;
+}
+
+int blockdev_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    if (!dev) return -1;
+    uint32_t sectors = blockdev_segs_sectors(dev, segs, seg_count);
+    if (!blockdev_in_range(dev, lba, sectors)) return -1;
+
+    if (bcache_cacheable(dev) && sectors <= BCACHE_MAX_CACHED) return bcache_writev(dev, lba, segs, seg_count, sectors);
+
+    if (iosched_transfer(dev, 1, IOPRIO_INTERACTIVE, lba, segs, seg_count) != 0) return -1;
+    if (!bcache_cacheable(dev)) return 0;
+    bcache_update(dev, lba, segs, seg_count, sectors);
+    return 0;
+}
+
+// Dirty cached blocks and queued writes reach the device before its
+// cache is flushed.
+int blockdev_flush(BLOCK_DEVICE* dev) {
+    if (!dev || !dev->ops) return -1;
+    if (bcache_sync(dev) != 0) return -1;
+    iosched_run(dev);
+    if (!dev->ops->flush) return 0;
+
+    uint64_t start = timer_rdtsc();
+    int status = dev->ops->flush(dev);
+    iostat_account(&dev->stats, IOSTAT_FLUSH, 0, start, status != 0);
+    return status;
+}
+
+// Bypasses write-back: the data is on media when this returns.
+int blockdev_write_fua(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    if (!blockdev_in_range(dev, lba, count)) return -1;
+    BLOCK_SEGMENT seg = { (void*)buffer, count * dev->sector_size };
+
+    if (dev->ops->write_fua) {
+        if (dev->ops->write_fua(dev, lba, count, buffer) != 0) return -1;
+    } else {
+        if (dev->ops->write(dev, lba, count, buffer) != 0) return -1;
+        if (dev->ops->flush && dev->ops->flush(dev) != 0) return -1;
+    }
+
+    if (bcache_cacheable(dev)) bcache_update(dev, lba, &seg, 1, count);
+    return 0;
+}
+
+int blockdev_discard(BLOCK_DEVICE* dev, const BLOCK_RANGE* ranges, uint32_t range_count) {
+    if (!dev || !dev->ops) return -1;
+    for (uint32_t i = 0; i < range_count; i++) {
+        bcache_invalidate(dev, ranges[i].lba, ranges[i].count);
+    }
+    return dev->ops->discard ? dev->ops->discard(dev, ranges, range_count) : 0;
+}
@@ -0,0 +1,90 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdint.h>
+#include "iostat.h"
+
+// Generic block device. Drivers fill one in for every disk they find and
+// register it; filesystems only ever talk to a BLOCK_DEVICE*. All calls
+// return 0 on success and -1 on error, like the AHCI driver.
+
+#define BLOCKDEV_MAX      16
+#define BLOCKDEV_NAME_LEN 16
+
+// BLOCK_DEVICE.flags
+#define BLOCKDEV_NOCACHE  0x1   // memory-backed: bypass the buffer cache
+#define BLOCKDEV_CLAIMED  0x2   // member of a RAID volume (raid.h)
+
+// One physically contiguous piece of a vectored transfer. Lengths must be
+// even; the whole list must add up to a multiple of the sector size.
+typedef struct {
+    void* buffer;
+    uint32_t length;
+} BLOCK_SEGMENT;
+
+// An LBA range the filesystem no longer uses.
+typedef struct {
+    uint64_t lba;
+    uint32_t count;
+} BLOCK_RANGE;
+
+typedef struct BLOCK_DEVICE BLOCK_DEVICE;
+struct IO_REQUEST;
+
+// read and write are required. The rest may be 0: readv/writev then fall
+// back to one call per segment, flush and discard become no-ops and
+// write_fua becomes write + flush.
+typedef struct {
+    int (*read)(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, void* buffer);
+    int (*write)(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer);
+    int (*readv)(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count);
+    int (*writev)(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count);
+    int (*flush)(BLOCK_DEVICE* dev);
+    int (*write_fua)(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer);
+    int (*discard)(BLOCK_DEVICE* dev, const BLOCK_RANGE* ranges, uint32_t range_count);
+} BLOCK_DEVICE_OPS;
+
+struct BLOCK_DEVICE {
+    char name[BLOCKDEV_NAME_LEN];   // "ahci0", "ata0", ...
+    const BLOCK_DEVICE_OPS* ops;
+    uint32_t unit;                  // driver's own index (port, drive)
+    uint32_t flags;                 // BLOCKDEV_*
+    void* driver_data;
+
+    // Geometry
+    uint32_t sector_size;           // bytes per logical sector
+    uint64_t sector_count;
+    uint32_t max_sectors;           // largest single transfer, 0 if unlimited
+
+    // I/O scheduler state (iosched.c)
+    struct IO_REQUEST* io_queue[2]; // per priority class, sorted by LBA
+    uint64_t io_head;               // LBA after the last dispatched transfer
+
+    IO_STATS stats;
+};
+
+// Set dev->name to prefix followed by the decimal unit number.
+void blockdev_set_name(BLOCK_DEVICE* dev, const char* prefix, uint32_t unit);
+
+// Add a device to the table; returns its index or -1 if the table is full.
+int blockdev_register(BLOCK_DEVICE* dev);
+int blockdev_count(void);
+BLOCK_DEVICE* blockdev_get(int index);
+BLOCK_DEVICE* blockdev_find(const char* name);
+
+// All I/O below goes through the buffer cache (bcache.h).
+int blockdev_read(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, void* buffer);
+int blockdev_write(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer);
+int blockdev_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count);
+int blockdev_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count);
+
+// Write barrier: returns once everything written before it is on media.
+int blockdev_flush(BLOCK_DEVICE* dev);
+int blockdev_write_fua(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer);
+int blockdev_discard(BLOCK_DEVICE* dev, const BLOCK_RANGE* ranges, uint32_t range_count);
+
+// Straight to the driver, for the I/O scheduler itself.
+int blockdev_raw_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count);
+int blockdev_raw_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count);
+
+#endif
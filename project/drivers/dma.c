@@ -0,0 +1,106 @@
+// dma.c
+
+#include "dma.h"
+#include "mem.h"
+#include "print.h"
+
+#define DMA_CLASSES (DMA_MAX_SHIFT - DMA_MIN_SHIFT + 1)
+
+// Defined by linker.ld after .bss.
+extern char kernel_end[];
+
+// A free block holds the link to the next one of its size.
+typedef struct DMA_FREE_BLOCK {
+    struct DMA_FREE_BLOCK* next;
+} DMA_FREE_BLOCK;
+
+static DMA_FREE_BLOCK* dma_free_lists[DMA_CLASSES];
+static uintptr_t dma_next = 0;      // start of the uncarved part
+static uintptr_t dma_end = 0;
+
+void dma_init(void) {
+    if (dma_end) return;
+    dma_next = ((uintptr_t)kernel_end + 0xFFF) & ~(uintptr_t)0xFFF;
+    dma_end = DMA_POOL_LIMIT;
+    for (int i = 0; i < DMA_CLASSES; i++) dma_free_lists[i] = 0;
+
+    print("DMA pool: ");
+    print_uint((uint32_t)((dma_end - dma_next) >> 10));
+    print(" KiB at 0x");
+    print_hex32((uint32_t)dma_next);
+    print("\n");
+}
+
+static int dma_class(uint32_t size) {
+    int shift = DMA_MIN_SHIFT;
+    while ((1u << shift) < size) shift++;
+    return shift - DMA_MIN_SHIFT;
+}
+
+// Put [start, end) on the free lists as naturally aligned blocks.
+static void dma_release_range(uintptr_t start, uintptr_t end) {
+    while (end - start >= DMA_MIN_SIZE) {
+        int shift = DMA_MAX_SHIFT;
+        while (shift > DMA_MIN_SHIFT && ((start & ((1u << shift) - 1)) || start + (1u << shift) > end)) shift--;
+
+        DMA_FREE_BLOCK* block = (DMA_FREE_BLOCK*)start;
+        block->next = dma_free_lists[shift - DMA_MIN_SHIFT];
+        dma_free_lists[shift - DMA_MIN_SHIFT] = block;
+        start += 1u << shift;
+    }
+}
+
+int dma_alloc(DMA_BUFFER* buf, uint32_t size, uint32_t align) {
+    if (!dma_end) dma_init();
+
+    if (size < align) size = align;
+    if (size > DMA_MAX_SIZE) return -1;
+    int cls = dma_class(size);
+    uint32_t block_size = 1u << (cls + DMA_MIN_SHIFT);
+
+    uintptr_t addr = 0;
+    if (dma_free_lists[cls]) {
+        addr = (uintptr_t)dma_free_lists[cls];
+        dma_free_lists[cls] = dma_free_lists[cls]->next;
+    } else {
+        // Split a larger free block before carving new memory.
+        for (int c = cls + 1; c < DMA_CLASSES && !addr; c++) {
+            if (!dma_free_lists[c]) continue;
+            addr = (uintptr_t)dma_free_lists[c];
+            dma_free_lists[c] = dma_free_lists[c]->next;
+            dma_release_range(addr + block_size, addr + (1u << (c + DMA_MIN_SHIFT)));
+        }
+        if (!addr) {
+            uintptr_t aligned = (dma_next + block_size - 1) & ~(uintptr_t)(block_size - 1);
+            if (aligned + block_size > dma_end || aligned < dma_next) return -1;
+            dma_release_range(dma_next, aligned);   // the alignment gap stays usable
+            addr = aligned;
+            dma_next = aligned + block_size;
+        }
+    }
+
+    memset((void*)addr, 0, block_size);
+    buf->virt = (void*)addr;
+    buf->phys = dma_phys((void*)addr);
+    buf->size = block_size;
+    return 0;
+}
+
+void dma_free(DMA_BUFFER* buf) {
+    if (!buf->virt) return;
+    DMA_FREE_BLOCK* block = (DMA_FREE_BLOCK*)buf->virt;
+    int cls = dma_class(buf->size);
+    block->next = dma_free_lists[cls];
+    dma_free_lists[cls] = block;
+    buf->virt = 0;
+    buf->phys = 0;
+    buf->size = 0;
+}
+
+uint32_t dma_phys(const void* virt) {
+    return (uint32_t)(uintptr_t)virt;
+}
+
+uint32_t dma_remaining(void) {
+    return (uint32_t)(dma_end - dma_next);
+}
@@ -0,0 +1,42 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <stdint.h>
+
+// Pool of physically contiguous memory for anything a device reads or
+// writes by address: command lists, FIS areas, command tables, queues,
+// PRD/PRP lists and data buffers. It covers the memory between the end of
+// the kernel image and DMA_POOL_LIMIT.
+//
+// Sizes are rounded up to a power of two (at least DMA_MIN_SIZE) and every
+// block is aligned to its own size, which covers the alignment rules of
+// the controllers we drive: a 4 KiB block is page aligned and never
+// crosses a 64 KiB boundary. Freed blocks go onto a free list per size
+// and are handed out again before new memory is carved.
+
+#define DMA_POOL_LIMIT 0x1000000    // the RAM disk starts here (ramdisk.h)
+#define DMA_MIN_SHIFT  5
+#define DMA_MAX_SHIFT  22
+#define DMA_MIN_SIZE   (1u << DMA_MIN_SHIFT)
+#define DMA_MAX_SIZE   (1u << DMA_MAX_SHIFT)
+
+typedef struct {
+    void* virt;                 // for the CPU
+    uint32_t phys;              // for the device
+    uint32_t size;              // as allocated (power of two)
+} DMA_BUFFER;
+
+void dma_init(void);
+
+// Allocate a zeroed block of at least size bytes aligned to align (a power
+// of two). Returns 0 on success, -1 if the pool is exhausted.
+int dma_alloc(DMA_BUFFER* buf, uint32_t size, uint32_t align);
+void dma_free(DMA_BUFFER* buf);
+
+// Memory is identity mapped, so this is where the device has to look.
+uint32_t dma_phys(const void* virt);
+
+// Bytes not yet carved from the pool (not counting free lists).
+uint32_t dma_remaining(void);
+
+#endif
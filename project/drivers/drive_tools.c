@@ -1,5 +1,7 @@
 #include "print.h"
 #include "port_io.h"
+#include "mem.h"
+#include "drive_tools.h"
 #include <stdint.h>
 
 #define ATA_PRIMARY_IO     0x1F0
@@ -25,7 +27,62 @@ int ata_wait_ready(uint16_t io) {
     return 0;
 }
 
-int ata_identify_drive(uint16_t io_base, uint16_t ctrl_base, int slave) {
+static ATA_DEVICE_INFO ata_drives[ATA_DRIVE_COUNT];
+static int ata_probed = 0;
+
+void ata_parse_identify(const uint16_t* id, ATA_DEVICE_INFO* info) {
+    memset(info, 0, sizeof(*info));
+    info->present = 1;
+
+    // Capacity: 48-bit count if the feature set is supported, else 28-bit.
+    info->lba48 = (id[83] & (1 << 10)) != 0;
+    if (info->lba48) {
+        info->sector_count = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                             ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    } else {
+        info->sector_count = (uint32_t)id[60] | ((uint32_t)id[61] << 16);
+    }
+
+    // Sector sizes (word 106 is valid when bit 14 is set and bit 15 clear).
+    info->logical_sector_size = 512;
+    info->physical_sector_size = 512;
+    if ((id[106] & 0xC000) == 0x4000) {
+        if (id[106] & (1 << 12)) {
+            uint32_t words = (uint32_t)id[117] | ((uint32_t)id[118] << 16);
+            if (words >= 256) info->logical_sector_size = words * 2;
+        }
+        info->physical_sector_size = info->logical_sector_size;
+        if (id[106] & (1 << 13)) {
+            info->physical_sector_size = info->logical_sector_size << (id[106] & 0x0F);
+        }
+    }
+
+    info->max_sectors_per_cmd = info->lba48 ? 65535 : 256;
+
+    if (id[76] & (1 << 8)) info->ncq_depth = (id[75] & 0x1F) + 1;
+
+    info->write_cache = (id[82] & (1 << 5)) && (id[85] & (1 << 5));
+    info->flush_ext = (id[83] & (1 << 13)) != 0;
+    info->fua = info->lba48 && (id[84] & (1 << 6));
+    info->trim = (id[169] & 1) != 0;
+    if (info->trim) info->trim_max_blocks = id[105] ? id[105] : 1;
+
+    // READ/WRITE MULTIPLE: word 47 gives the maximum, word 59 the current
+    // setting when bit 8 is set.
+    if (id[47] & 0xFF) {
+        info->multiple_sectors = (id[59] & (1 << 8)) ? (id[59] & 0xFF) : (id[47] & 0xFF);
+    }
+
+    // Model string: 20 words, bytes swapped within each word.
+    for (int i = 0; i < 20; i++) {
+        info->model[i * 2] = (char)(id[27 + i] >> 8);
+        info->model[i * 2 + 1] = (char)(id[27 + i] & 0xFF);
+    }
+    info->model[40] = '\0';
+    for (int i = 39; i >= 0 && info->model[i] == ' '; i--) info->model[i] = '\0';
+}
+
+int ata_identify_drive(uint16_t io_base, uint16_t ctrl_base, int slave, ATA_DEVICE_INFO* info) {
     outb(ctrl_base, 0);  // Disable IRQs
     outb(io_base + ATA_REG_DEVICE, 0xA0 | (slave << 4));  // Select master/slave
     outb(io_base + 2, 0);  // Sector count
@@ -38,13 +95,33 @@ int ata_identify_drive(uint16_t io_base, uint16_t ctrl_base, int slave) {
         return 0;
 
     // Read 256 words (512 bytes) of IDENTIFY response
+    uint16_t id[256];
     for (int i = 0; i < 256; i++) {
-        inw(io_base + ATA_REG_DATA);
+        id[i] = inw(io_base + ATA_REG_DATA);
     }
 
+    if (info) ata_parse_identify(id, info);
     return 1;
 }
 
+void ata_probe_drives(void) {
+    static const uint16_t ios[] = { ATA_PRIMARY_IO, ATA_PRIMARY_IO, ATA_SECONDARY_IO, ATA_SECONDARY_IO };
+    static const uint16_t ctrls[] = { ATA_PRIMARY_CTRL, ATA_PRIMARY_CTRL, ATA_SECONDARY_CTRL, ATA_SECONDARY_CTRL };
+
+    for (int i = 0; i < ATA_DRIVE_COUNT; i++) {
+        if (!ata_identify_drive(ios[i], ctrls[i], i % 2, &ata_drives[i])) {
+            memset(&ata_drives[i], 0, sizeof(ata_drives[i]));
+        }
+    }
+    ata_probed = 1;
+}
+
+const ATA_DEVICE_INFO* ata_get_device_info(int drive) {
+    if (drive < 0 || drive >= ATA_DRIVE_COUNT) return 0;
+    if (!ata_probed) ata_probe_drives();
+    return ata_drives[drive].present ? &ata_drives[drive] : 0;
+}
+
 void list_ata_drives() {
     const char* names[] = {
         "Primary Master",
@@ -53,29 +130,25 @@ void list_ata_drives() {
         "Secondary Slave"
     };
 
-    uint16_t ios[] = {
-        ATA_PRIMARY_IO,
-        ATA_PRIMARY_IO,
-        ATA_SECONDARY_IO,
-        ATA_SECONDARY_IO
-    };
-
-    uint16_t ctrls[] = {
-        ATA_PRIMARY_CTRL,
-        ATA_PRIMARY_CTRL,
-        ATA_SECONDARY_CTRL,
-        ATA_SECONDARY_CTRL
-    };
-
     print("Detecting ATA drives...\n");
+    ata_probe_drives();
 
-    for (int i = 0; i < 4; i++) {
+    for (int i = 0; i < ATA_DRIVE_COUNT; i++) {
         print(" - ");
         print(names[i]);
         print(": ");
 
-        if (ata_identify_drive(ios[i], ctrls[i], i % 2)) {
-            print("Present\n");
+        const ATA_DEVICE_INFO* info = ata_get_device_info(i);
+        if (info) {
+            print("Present, ");
+            print(info->model);
+            print(", ");
+            print_uint((uint32_t)((info->sector_count * info->logical_sector_size) >> 20));
+            print(" MiB");
+            if (info->lba48) print(", LBA48");
+            if (info->ncq_depth) print(", NCQ");
+            if (info->trim) print(", TRIM");
+            print("\n");
         } else {
             print("Not detected\n");
         }
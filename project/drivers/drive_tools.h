@@ -3,11 +3,39 @@
 
 #include <stdint.h>
 
+// What a drive reported in its IDENTIFY DEVICE data. Drivers size their
+// transfers and choose command variants from this.
+typedef struct {
+    int present;
+    int lba48;
+    uint64_t sector_count;          // capacity in logical sectors
+    uint32_t logical_sector_size;   // bytes
+    uint32_t physical_sector_size;  // bytes
+    uint32_t max_sectors_per_cmd;
+    uint32_t ncq_depth;             // 0 if NCQ is not supported
+    int write_cache;                // volatile write cache enabled
+    int flush_ext;                  // FLUSH CACHE EXT supported
+    int fua;                        // WRITE DMA FUA EXT supported
+    int trim;                       // DATA SET MANAGEMENT / TRIM supported
+    uint32_t trim_max_blocks;       // 512-byte DSM range blocks per command
+    uint32_t multiple_sectors;      // READ/WRITE MULTIPLE block size, 0 if unsupported
+    char model[41];
+} ATA_DEVICE_INFO;
+
+#define ATA_DRIVE_COUNT 4           // primary/secondary master/slave
+
 // List all ATA drives (Primary/Secondary Master/Slave)
 void list_ata_drives(void);
 
+// IDENTIFY every legacy ATA position once and remember the results.
+void ata_probe_drives(void);
+const ATA_DEVICE_INFO* ata_get_device_info(int drive);
+
+// Decode 256 words of IDENTIFY DEVICE data.
+void ata_parse_identify(const uint16_t* id, ATA_DEVICE_INFO* info);
+
 // Internal use: sends ATA IDENTIFY command and checks response
-int ata_identify_drive(uint16_t io_base, uint16_t ctrl_base, int slave);
+int ata_identify_drive(uint16_t io_base, uint16_t ctrl_base, int slave, ATA_DEVICE_INFO* info);
 
 // Internal use: waits until the drive is ready (BSY=0 and DRQ=1)
 int ata_wait_ready(uint16_t io_base);
@@ -2,78 +2,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "mem.h"
-#include "ahci.h"
-
-#pragma pack(push, 1)  // Prevent structure padding
-
-typedef struct {
-    uint8_t jumpBoot[3];
-    uint8_t OEMName[8];
-    uint16_t bytesPerSector;
-    uint8_t sectorsPerCluster;
-    uint16_t reservedSectorCount;
-    uint8_t numFATs;
-    uint16_t rootEntryCount;
-    uint16_t totalSectors16;
-    uint8_t media;
-    uint16_t FATSize16;
-    uint16_t sectorsPerTrack;
-    uint16_t numberOfHeads;
-    uint32_t hiddenSectors;
-    uint32_t totalSectors32;
-
-    // Extended Boot Record
-    uint32_t FATSize32;
-    uint16_t extFlags;
-    uint16_t fsVersion;
-    uint32_t rootCluster;
-    uint16_t fsInfo;
-    uint16_t backupBootSector;
-    uint8_t reserved[12];
-    uint8_t driveNumber;
-    uint8_t reserved1;
-    uint8_t bootSignature;
-    uint32_t volumeID;
-    uint8_t volumeLabel[11];
-    uint8_t fileSystemType[8];
-} FAT32_BPB;
-
-typedef struct {
-    uint8_t name[11];
-    uint8_t attr;
-    uint8_t ntres;
-    uint8_t crtTimeTenth;
-    uint16_t crtTime;
-    uint16_t crtDate;
-    uint16_t lstAccDate;
-    uint16_t firstClusterHigh;
-    uint16_t wrtTime;
-    uint16_t wrtDate;
-    uint16_t firstClusterLow;
-    uint32_t fileSize;
-} FAT32_DirectoryEntry;
-
-typedef struct {
-    uint8_t order;
-    uint16_t name1[5];
-    uint8_t attr;
-    uint8_t type;
-    uint8_t checksum;
-    uint16_t name2[6];
-    uint16_t zero;
-    uint16_t name3[2];
-} FAT32_LFNEntry;
-
-#pragma pack(pop)
-
-typedef struct {
-    uint32_t cluster;
-    uint8_t sectorBuffer[512];
-    uint8_t sectorIndex;
-    uint8_t entryIndex;
-    bool end;
-    char lfnBuffer[256];
-} FAT32_DIR;
+#include "blockdev.h"
+#include "bcache.h"
+#include "fat32.h"
+#include "dma.h"
 
 #define FAT_ENTRY_EOC 0x0FFFFFFF
 
@@ -165,18 +97,18 @@ void printf(const char* fmt, ...) {
     va_end(args);
 }
 
-uint32_t get_partition_start_lba(uint32_t port) {
+uint32_t get_partition_start_lba(BLOCK_DEVICE* dev) {
     uint8_t mbr[512];
-    sata_ahci_read(port, 0, 1, mbr);
+    blockdev_read(dev, 0, 1, mbr);
 
     // First partition entry at offset 446
     uint32_t lba = mbr[454] | (mbr[455] << 8) | (mbr[456] << 16) | (mbr[457] << 24);
     return lba;
 }
 
-void dump_sector(uint32_t port, uint32_t lba) {
+void dump_sector(BLOCK_DEVICE* dev, uint32_t lba) {
     uint8_t sector[512];
-    sata_ahci_read(port, lba, 1, sector);
+    blockdev_read(dev, lba, 1, sector);
 
     for (int i = 0; i < 64; i++) {
         printf("%02X ", sector[i]);
@@ -189,28 +121,52 @@ void dump_sector(uint32_t port, uint32_t lba) {
 FAT32_BPB bpb;
 char lfn_buffer[256];
 
-void fat32_init(uint32_t port) {
-    uint32_t fat_start = get_partition_start_lba(port);
+static void fat32_load_free_map(BLOCK_DEVICE* dev);
+static void fat32_clear_free_map(void);
+static void fat32_extent_reset(void);
+static void fat32_dentry_reset(void);
+
+bool fat32_init(BLOCK_DEVICE* dev) {
+    // Nothing is mounted until the boot sector checks out.
+    bpb.sectorsPerCluster = 0;
+    fat32_extent_reset();
+    fat32_dentry_reset();
+    fat32_clear_free_map();
+
+    // Every sector buffer in here is 512 bytes.
+    if (!dev || dev->sector_size != 512) return false;
+
+    uint32_t fat_start = get_partition_start_lba(dev);
     uint8_t sector[512];
-    sata_ahci_read(port, fat_start, 1, sector);
+    if (blockdev_read(dev, fat_start, 1, sector) != 0) return false;
 
     bpb.bytesPerSector      = sector[11] | (sector[12] << 8);
     bpb.sectorsPerCluster   = sector[13];
     bpb.reservedSectorCount = sector[14] | (sector[15] << 8);
     bpb.numFATs             = sector[16];
+    bpb.totalSectors32      = sector[32] | (sector[33] << 8) | (sector[34] << 16) | (sector[35] << 24);
     bpb.FATSize32           = sector[36] | (sector[37] << 8) | (sector[38] << 16) | (sector[39] << 24);
     bpb.rootCluster         = sector[44] | (sector[45] << 8) | (sector[46] << 16) | (sector[47] << 24);
+    bpb.fsInfo              = sector[48] | (sector[49] << 8);
+
+    if (bpb.bytesPerSector != 512 || bpb.sectorsPerCluster == 0) {
+        bpb.sectorsPerCluster = 0;
+        return false;
+    }
 
     printf("Reserved sectors: %u\n", bpb.reservedSectorCount);
     printf("FATs: %u\n", bpb.numFATs);
     printf("FAT size (FATSize32): %u\n", bpb.FATSize32);
     printf("Sectors per cluster: %u\n", bpb.sectorsPerCluster);
     printf("Root cluster: %u\n", bpb.rootCluster);
+
+    fat32_load_free_map(dev);
+    return true;
 }
 
-void print_first_sector(uint32_t port) {
+void print_first_sector(BLOCK_DEVICE* dev) {
     uint8_t sector[512];
-    sata_ahci_read(port, 0, 1, sector);
+    blockdev_read(dev, 0, 1, sector);
 
     for (int i = 0; i < 64; i++) {
         printf("%02X ", sector[i]);
@@ -253,7 +209,9 @@ void append_lfn_part(FAT32_LFNEntry* lfn) {
         lfn_buffer[pos++] = (char)lfn->name3[i];
     }
 
-    lfn_buffer[pos] = '\0';
+    // Parts come last-first; only the last one ends the name, the others
+    // must not cut off what was already filled in behind them.
+    if (lfn->order & 0x40) lfn_buffer[pos] = '\0';
 }
 
 void print_short_name(uint8_t* name) {
@@ -281,33 +239,100 @@ bool fat32_is_dir(const FAT32_DirectoryEntry* entry) {
     return (entry->attr & 0x10) != 0;
 }
 
-bool fat32_opendir(uint32_t port,FAT32_DIR* dir, uint32_t cluster) {
+uint32_t fat32_get_fat_entry(BLOCK_DEVICE* dev, uint32_t cluster);
+
+
+// Read through the buffer cache when the device has one, in pieces small
+// enough for it to serve, so blocks readahead brought in are not read again.
+static int fat32_read_sectors(BLOCK_DEVICE* dev, uint32_t lba, uint32_t count, void* buffer) {
+    if (!bcache_cacheable(dev)) return blockdev_read(dev, lba, count, buffer);
+
+    uint8_t* out = buffer;
+    while (count) {
+        uint32_t n = count < BCACHE_MAX_CACHED ? count : BCACHE_MAX_CACHED;
+        if (blockdev_read(dev, lba, n, out) != 0) return -1;
+        lba += n;
+        out += n * 512;
+        count -= n;
+    }
+    return 0;
+}
+
+// Clusters the iterator buffer holds.
+static uint32_t fat32_dir_buffer_clusters(void) {
+    uint32_t n = FAT32_DIR_READ_SECTORS / bpb.sectorsPerCluster;
+    return n ? n : 1;
+}
+
+// Read the next run of contiguous clusters into the buffer, as far as it
+// reaches. Returns false at the end of the chain or on error.
+static bool fat32_dir_fill(BLOCK_DEVICE* dev, FAT32_DIR* dir) {
+    uint32_t run = 0;
+    uint32_t cluster = fat32_map_cluster(dev, dir->start_cluster, dir->next_index, &run);
+    if (cluster == 0) return false;
+    if (cluster == FAT32_CLUSTER_ERROR) {
+        dir->error = true;
+        return false;
+    }
+
+    uint32_t max = fat32_dir_buffer_clusters();
+    if (run > max) run = max;
+    fat32_readahead(dev, &dir->ra, dir->start_cluster, dir->next_index, run);
+    if (fat32_read_sectors(dev, cluster_to_sector(cluster), run * bpb.sectorsPerCluster, dir->buffer.virt) != 0) {
+        dir->error = true;
+        return false;
+    }
+
     dir->cluster = cluster;
-    dir->sectorIndex = 0;
+    dir->next_index += run;
+    dir->entries = run * bpb.sectorsPerCluster * (512 / sizeof(FAT32_DirectoryEntry));
     dir->entryIndex = 0;
-    dir->end = false;
+    return true;
+}
+
+bool fat32_opendir(BLOCK_DEVICE* dev,FAT32_DIR* dir, uint32_t cluster) {
+    dir->start_cluster = cluster;
+    dir->next_index = 0;
+    dir->cluster = cluster;
+    dir->entries = 0;
+    dir->entryIndex = 0;
+    dir->end = true;
+    dir->error = false;
     dir->lfnBuffer[0] = '\0';
+    dir->pending = false;
+    dir->buffer.virt = 0;
+    fat32_readahead_init(&dir->ra);
+
+    if (bpb.sectorsPerCluster == 0) return false;     // not mounted
+    if (dma_alloc(&dir->buffer, fat32_dir_buffer_clusters() * bpb.sectorsPerCluster * 512, 512) != 0) return false;
 
-    sata_ahci_read(port, cluster_to_sector(cluster), 1, dir->sectorBuffer);
+    if (!fat32_dir_fill(dev, dir)) {
+        dma_free(&dir->buffer);
+        return false;
+    }
+    dir->end = false;
     return true;
 }
 
-bool fat32_readdir(uint32_t port, FAT32_DIR* dir, char* name_out, FAT32_DirectoryEntry* entry_out) {
-    if (dir->end) return false;
+// Next short entry, in place in the iterator buffer, with its long name
+// (if any) collected in lfn_buffer.
+static FAT32_DirectoryEntry* fat32_dir_next(BLOCK_DEVICE* dev, FAT32_DIR* dir) {
+    if (dir->pending) {
+        // Handed back by fat32_getdents for lack of room.
+        dir->pending = false;
+        memcpy(lfn_buffer, dir->lfnBuffer, sizeof(dir->lfnBuffer));
+        return (FAT32_DirectoryEntry*)dir->buffer.virt + dir->entryIndex - 1;
+    }
+    if (dir->end) return 0;
 
     while (1) {
-        FAT32_DirectoryEntry* entries = (FAT32_DirectoryEntry*)dir->sectorBuffer;
-
-        if (dir->entryIndex >= 512 / sizeof(FAT32_DirectoryEntry)) {
-            dir->entryIndex = 0;
-            dir->sectorIndex++;
+        FAT32_DirectoryEntry* entries = (FAT32_DirectoryEntry*)dir->buffer.virt;
 
-            if (dir->sectorIndex >= bpb.sectorsPerCluster) {
+        if (dir->entryIndex >= dir->entries) {
+            if (!fat32_dir_fill(dev, dir)) {
                 dir->end = true;
-                return false;
+                return 0;
             }
-
-            sata_ahci_read(port, cluster_to_sector(dir->cluster) + dir->sectorIndex,1, dir->sectorBuffer);
             continue;
         }
 
@@ -315,7 +340,7 @@ bool fat32_readdir(uint32_t port, FAT32_DIR* dir, char* name_out, FAT32_Director
 
         if (entry->name[0] == 0x00) {
             dir->end = true;
-            return false;
+            return 0;
         }
 
         if (entry->name[0] == 0xE5) continue; // Deleted
@@ -325,30 +350,91 @@ bool fat32_readdir(uint32_t port, FAT32_DIR* dir, char* name_out, FAT32_Director
             continue;
         }
 
-        // Normal entry
-        *entry_out = *entry;
-        if (lfn_buffer[0] != '\0') {
-            for (int i = 0; lfn_buffer[i]; i++) name_out[i] = lfn_buffer[i];
-            name_out[strlen(lfn_buffer)] = '\0';
+        return entry;
+    }
+}
+
+// Length of the name fat32_entry_name would produce.
+static uint32_t fat32_entry_name_len(const FAT32_DirectoryEntry* entry) {
+    if (lfn_buffer[0] != '\0') return strlen(lfn_buffer);
+
+    uint32_t len = 0;
+    for (int i = 0; i < 8 && entry->name[i] != ' '; i++) len++;
+    if (entry->name[8] != ' ') {
+        len++;
+        for (int i = 8; i < 11 && entry->name[i] != ' '; i++) len++;
+    }
+    return len;
+}
+
+// The long name if there was one, otherwise the short name converted.
+static void fat32_entry_name(const FAT32_DirectoryEntry* entry, char* name_out) {
+    if (lfn_buffer[0] != '\0') {
+        for (int i = 0; lfn_buffer[i]; i++) name_out[i] = lfn_buffer[i];
+        name_out[strlen(lfn_buffer)] = '\0';
+        lfn_buffer[0] = '\0';
+        return;
+    }
+
+    char* n = name_out;
+    for (int i = 0; i < 8 && entry->name[i] != ' '; i++) *n++ = entry->name[i];
+    if (entry->name[8] != ' ') {
+        *n++ = '.';
+        for (int i = 8; i < 11 && entry->name[i] != ' '; i++) *n++ = entry->name[i];
+    }
+    *n = '\0';
+}
+
+bool fat32_readdir(BLOCK_DEVICE* dev, FAT32_DIR* dir, char* name_out, FAT32_DirectoryEntry* entry_out) {
+    FAT32_DirectoryEntry* entry = fat32_dir_next(dev, dir);
+    if (!entry) return false;
+
+    *entry_out = *entry;
+    fat32_entry_name(entry, name_out);
+    return true;
+}
+
+// Sector and slot of the entry fat32_dir_next returned last.
+static void fat32_dir_position(const FAT32_DIR* dir, uint32_t* sector_out, uint32_t* slot_out) {
+    uint32_t index = dir->entryIndex - 1;
+    uint32_t per_sector = 512 / sizeof(FAT32_DirectoryEntry);
+    *sector_out = cluster_to_sector(dir->cluster) + index / per_sector;
+    *slot_out = index % per_sector;
+}
+
+int fat32_getdents(BLOCK_DEVICE* dev, FAT32_DIR* dir, void* buffer, uint32_t size) {
+    uint8_t* out = buffer;
+    uint32_t used = 0;
+
+    FAT32_DirectoryEntry* entry;
+    while ((entry = fat32_dir_next(dev, dir)) != 0) {
+        uint32_t name_len = fat32_entry_name_len(entry);
+        uint32_t reclen = (sizeof(FAT32_DIRENT) + name_len + 1 + 3) & ~3u;
+        if (used + reclen > size) {
+            // Keep it for the next call.
+            memcpy(dir->lfnBuffer, lfn_buffer, sizeof(dir->lfnBuffer));
             lfn_buffer[0] = '\0';
-        } else {
-            // Fallback: convert short name
-            char* n = name_out;
-            for (int i = 0; i < 8 && entry->name[i] != ' '; i++) *n++ = entry->name[i];
-            if (entry->name[8] != ' ') {
-                *n++ = '.';
-                for (int i = 8; i < 11 && entry->name[i] != ' '; i++) *n++ = entry->name[i];
-            }
-            *n = '\0';
+            dir->pending = true;
+            return used ? (int)used : -1;
         }
 
-        return true;
+        FAT32_DIRENT* d = (FAT32_DIRENT*)(out + used);
+        d->reclen = reclen;
+        d->attr = entry->attr;
+        d->cluster = get_entry_cluster(entry);
+        d->size = entry->fileSize;
+        uint32_t slot;
+        fat32_dir_position(dir, &d->sector, &slot);
+        d->slot = slot;
+        fat32_entry_name(entry, d->name);
+        used += reclen;
     }
+    return used;
 }
 
 void fat32_closedir(FAT32_DIR* dir) {
-    // No cleanup needed in this implementation
-    (void)dir;
+    dma_free(&dir->buffer);
+    dir->end = true;
 }
 
 
@@ -356,11 +442,128 @@ uint32_t get_entry_cluster(const FAT32_DirectoryEntry* entry) {
     return ((uint32_t)entry->firstClusterHigh << 16) | entry->firstClusterLow;
 }
 
-uint32_t resolve_path_to_cluster(uint32_t port, const char* path) {
+static FAT32_DENTRY dentries[FAT32_DENTRIES];
+static FAT32_DENTRY* dentry_hash[FAT32_DENTRY_BUCKETS];
+static uint32_t dentry_clock = 0;
+
+static void fat32_dentry_reset(void) {
+    for (int i = 0; i < FAT32_DENTRIES; i++) dentries[i].parent = 0;
+    for (int i = 0; i < FAT32_DENTRY_BUCKETS; i++) dentry_hash[i] = 0;
+}
+
+// FNV-1a over the name, mixed with the parent cluster.
+static uint32_t fat32_dentry_hash(uint32_t parent, const char* name) {
+    uint32_t h = 2166136261u ^ parent;
+    for (; *name; name++) h = (h ^ (uint8_t)*name) * 16777619u;
+    return h;
+}
+
+static FAT32_DENTRY** fat32_dentry_bucket(uint32_t hash) {
+    return &dentry_hash[hash & (FAT32_DENTRY_BUCKETS - 1)];
+}
+
+static FAT32_DENTRY* fat32_dentry_find(BLOCK_DEVICE* dev, uint32_t parent, const char* name, uint32_t hash) {
+    for (FAT32_DENTRY* d = *fat32_dentry_bucket(hash); d; d = d->hash_next) {
+        if (d->hash == hash && d->parent == parent && d->dev == dev && strcmp(d->name, name) == 0) {
+            d->last_used = ++dentry_clock;
+            return d;
+        }
+    }
+    return 0;
+}
+
+static void fat32_dentry_unhash(FAT32_DENTRY* d) {
+    FAT32_DENTRY** link = fat32_dentry_bucket(d->hash);
+    while (*link && *link != d) link = &(*link)->hash_next;
+    if (*link) *link = d->hash_next;
+    d->parent = 0;
+}
+
+// Record the outcome of a lookup; entry is 0 for a name that does not
+// exist. Reuses the least recently used slot.
+static void fat32_dentry_add(BLOCK_DEVICE* dev, uint32_t parent, const char* name,
+                             const FAT32_DirectoryEntry* entry, uint32_t sector, uint32_t slot) {
+    uint32_t len = strlen(name);
+    if (len >= FAT32_DENTRY_NAME_LEN) return;
+    uint32_t hash = fat32_dentry_hash(parent, name);
+
+    FAT32_DENTRY* d = fat32_dentry_find(dev, parent, name, hash);
+    if (!d) {
+        d = &dentries[0];
+        for (int i = 0; i < FAT32_DENTRIES && d->parent; i++) {
+            if (!dentries[i].parent || dentries[i].last_used < d->last_used) d = &dentries[i];
+        }
+        if (d->parent) fat32_dentry_unhash(d);
+
+        d->dev = dev;
+        d->parent = parent;
+        d->hash = hash;
+        memcpy(d->name, name, len + 1);
+        FAT32_DENTRY** bucket = fat32_dentry_bucket(hash);
+        d->hash_next = *bucket;
+        *bucket = d;
+    }
+
+    d->negative = entry == 0;
+    if (entry) d->entry = *entry;
+    d->sector = sector;
+    d->slot = slot;
+    d->last_used = ++dentry_clock;
+}
+
+// Forget one name, or with name 0 everything cached under parent.
+static void fat32_dentry_invalidate(BLOCK_DEVICE* dev, uint32_t parent, const char* name) {
+    for (int i = 0; i < FAT32_DENTRIES; i++) {
+        FAT32_DENTRY* d = &dentries[i];
+        if (d->parent != parent || d->dev != dev) continue;
+        if (name && strcmp(d->name, name) != 0) continue;
+        fat32_dentry_unhash(d);
+    }
+}
+
+bool fat32_lookup(BLOCK_DEVICE* dev, uint32_t parent_cluster, const char* name,
+                  FAT32_DirectoryEntry* entry_out, uint32_t* sector_out, uint32_t* slot_out) {
+    FAT32_DENTRY* d = fat32_dentry_find(dev, parent_cluster, name, fat32_dentry_hash(parent_cluster, name));
+    if (d) {
+        if (d->negative) return false;
+        if (entry_out) *entry_out = d->entry;
+        if (sector_out) *sector_out = d->sector;
+        if (slot_out) *slot_out = d->slot;
+        return true;
+    }
+
+    // Miss: scan the directory in the iterator buffer, caching the entries
+    // that go past on the way as they are on disk.
+    FAT32_DIR dir;
+    FAT32_DirectoryEntry* entry;
+    char entry_name[256];
+    bool found = false;
+
+    if (!fat32_opendir(dev, &dir, parent_cluster)) return false;   // not cached: may be transient
+    while ((entry = fat32_dir_next(dev, &dir)) != 0) {
+        uint32_t sector, slot;
+        fat32_dir_position(&dir, &sector, &slot);
+        fat32_entry_name(entry, entry_name);
+        fat32_dentry_add(dev, parent_cluster, entry_name, entry, sector, slot);
+        if (strcmp(entry_name, name) != 0) continue;
+
+        if (entry_out) *entry_out = *entry;
+        if (sector_out) *sector_out = sector;
+        if (slot_out) *slot_out = slot;
+        found = true;
+        break;
+    }
+    fat32_closedir(&dir);
+
+    // Only a complete scan proves the name is not there.
+    if (!found && !dir.error) fat32_dentry_add(dev, parent_cluster, name, 0, 0, 0);
+    return found;
+}
+
+uint32_t resolve_path_to_cluster(BLOCK_DEVICE* dev, const char* path) {
     if (path[0] == '/' || path[0] == '\\') path++; // skip initial slash
     if (path[0] == '\0') return bpb.rootCluster;
 
-    FAT32_DIR dir;
     char segment[256];
     int segIndex = 0;
 
@@ -374,33 +577,28 @@ uint32_t resolve_path_to_cluster(uint32_t port, const char* path) {
         segment[segIndex] = '\0';
         if (*path == '/' || *path == '\\') path++;
 
-        fat32_opendir(port, &dir, currentCluster);
-        char name[256];
         FAT32_DirectoryEntry entry;
-        bool found = false;
-
-        while (fat32_readdir(port, &dir, name, &entry)) {
-            if (!fat32_is_dir(&entry)) continue;
-            if (strcmp(name, segment) == 0) {
-                currentCluster = get_entry_cluster(&entry);
-                found = true;
-                break;
-            }
-        }
-
-        fat32_closedir(&dir);
-
-        if (!found) return 0; // not found
+        if (!fat32_lookup(dev, currentCluster, segment, &entry, 0, 0)) return 0; // not found
+        if (!fat32_is_dir(&entry)) return 0;
+        currentCluster = get_entry_cluster(&entry);
         if (*path == '\0') return currentCluster;
     }
 }
 
-uint32_t fat32_get_fat_entry(uint32_t port, uint32_t cluster) {
+uint32_t fat32_get_fat_entry(BLOCK_DEVICE* dev, uint32_t cluster) {
     uint8_t sector[512];
     uint32_t fat_sector = fat_start_sector() + ((cluster * 4) / 512);
     uint32_t offset = (cluster * 4) % 512;
 
-    if (sata_ahci_read(port, fat_sector, 1, sector) != 0) {
+    // FAT sectors are hot: look at the cached copy in place when possible.
+    BCACHE_BUFFER* buf = bcache_get(dev, fat_sector);
+    if (buf) {
+        uint32_t value = *(uint32_t*)&buf->data[offset] & 0x0FFFFFFF;
+        bcache_release(buf);
+        return value;
+    }
+
+    if (blockdev_read(dev, fat_sector, 1, sector) != 0) {
         return 0xFFFFFFFF; // read failed
     }
 
@@ -411,118 +609,544 @@ uint32_t fat32_get_fat_entry(uint32_t port, uint32_t cluster) {
 }
 
 
-void fat32_list_root_dir(uint32_t port) {
-    uint32_t cluster = bpb.rootCluster;
-    uint8_t sector[512];
+static FAT32_EXTENT_MAP extent_maps[FAT32_EXTENT_MAPS];
+static uint32_t extent_clock = 0;
 
-    while (cluster < 0x0FFFFFF8) {
-        for (uint8_t i = 0; i < bpb.sectorsPerCluster; i++) {
-            sata_ahci_read(port, cluster_to_sector(cluster) + i, 1, sector);
+static void fat32_extent_reset(void) {
+    for (int i = 0; i < FAT32_EXTENT_MAPS; i++) extent_maps[i].first_cluster = 0;
+}
 
-            FAT32_DirectoryEntry* entry = (FAT32_DirectoryEntry*)sector;
-            lfn_buffer[0] = '\0';
+static bool fat32_chain_end(uint32_t cluster) {
+    return cluster < 2 || cluster >= 0x0FFFFFF8;
+}
 
-            for (int j = 0; j < 512 / sizeof(FAT32_DirectoryEntry); j++) {
-                if (entry[j].name[0] == 0x00) return; // End of directory
-                if (entry[j].name[0] == 0xE5) continue; // Deleted entry
+// The map for a chain, taking over the least recently used slot if there
+// is none yet.
+static FAT32_EXTENT_MAP* fat32_extent_map(BLOCK_DEVICE* dev, uint32_t first_cluster) {
+    FAT32_EXTENT_MAP* victim = &extent_maps[0];
+    for (int i = 0; i < FAT32_EXTENT_MAPS; i++) {
+        FAT32_EXTENT_MAP* map = &extent_maps[i];
+        if (map->first_cluster == first_cluster && map->dev == dev) {
+            map->last_used = ++extent_clock;
+            return map;
+        }
+        if (victim->first_cluster == 0) continue;
+        if (map->first_cluster == 0 || map->last_used < victim->last_used) victim = map;
+    }
 
-                if (is_lfn_entry(&entry[j])) {
-                    append_lfn_part((FAT32_LFNEntry*)&entry[j]);
-                    continue;
-                }
+    victim->dev = dev;
+    victim->first_cluster = first_cluster;
+    victim->mapped = 0;
+    victim->next = first_cluster;
+    victim->complete = false;
+    victim->count = 0;
+    victim->last_used = ++extent_clock;
+    return victim;
+}
 
-                // Normal 8.3 entry
-                if (lfn_buffer[0] != '\0') {
-                    print(lfn_buffer);
-                    print("\n");
-                    lfn_buffer[0] = '\0';
-                } else {
-                    print_short_name(entry[j].name);
-                    print("\n");
-                }
+// Follow the chain until index is mapped, the chain ends or the map is
+// full. A FAT read error stops the walk without marking the map complete.
+static void fat32_extent_extend(BLOCK_DEVICE* dev, FAT32_EXTENT_MAP* map, uint32_t index) {
+    uint32_t limit = fat32_total_clusters();
+    while (!map->complete && map->mapped <= index) {
+        uint32_t c = map->next;
+        if (fat32_chain_end(c) || (limit && map->mapped >= limit)) {
+            map->complete = true;
+            return;
+        }
+
+        FAT32_EXTENT* last = map->count ? &map->extents[map->count - 1] : 0;
+        if (last && c == last->cluster + last->length) {
+            last->length++;
+        } else {
+            if (map->count == FAT32_MAP_EXTENTS) return;
+            last = &map->extents[map->count++];
+            last->file_cluster = map->mapped;
+            last->cluster = c;
+            last->length = 1;
+        }
+
+        uint32_t next = fat32_get_fat_entry(dev, c);
+        if (next == 0xFFFFFFFF) {
+            // Keep c out of the map so the walk resumes with it.
+            if (--last->length == 0) map->count--;
+            return;
+        }
+        map->next = next;
+        map->mapped++;
+    }
+}
+
+uint32_t fat32_map_cluster(BLOCK_DEVICE* dev, uint32_t first_cluster, uint32_t index, uint32_t* run_out) {
+    if (fat32_chain_end(first_cluster)) return 0;
+    FAT32_EXTENT_MAP* map = fat32_extent_map(dev, first_cluster);
+    fat32_extent_extend(dev, map, index);
+
+    if (index >= map->mapped) {
+        if (map->complete) return 0;
+        if (map->count < FAT32_MAP_EXTENTS) return FAT32_CLUSTER_ERROR;    // the walk hit a read error
+
+        // The map is full: walk the rest of the way.
+        uint32_t c = map->next;
+        for (uint32_t i = map->mapped; i < index && !fat32_chain_end(c); i++) c = fat32_get_fat_entry(dev, c);
+        if (c == FAT32_CLUSTER_ERROR) return c;
+        if (fat32_chain_end(c)) return 0;
+        if (run_out) *run_out = 1;
+        return c;
+    }
+
+    // Last extent starting at or before index.
+    uint32_t lo = 0;
+    uint32_t hi = map->count;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (map->extents[mid].file_cluster <= index) lo = mid;
+        else hi = mid;
+    }
+
+    const FAT32_EXTENT* ext = &map->extents[lo];
+    uint32_t offset = index - ext->file_cluster;
+    if (run_out) *run_out = ext->length - offset;
+    return ext->cluster + offset;
+}
+
+uint32_t fat32_read_clusters(BLOCK_DEVICE* dev, uint32_t first_cluster, uint32_t index, uint32_t count, void* buffer) {
+    uint32_t cluster_bytes = bpb.sectorsPerCluster * 512;
+    uint8_t* out = buffer;
+    uint32_t done = 0;
+
+    while (done < count) {
+        uint32_t run = 0;
+        uint32_t cluster = fat32_map_cluster(dev, first_cluster, index + done, &run);
+        if (fat32_chain_end(cluster)) break;
+        if (run > count - done) run = count - done;
+
+        if (blockdev_read(dev, cluster_to_sector(cluster), run * bpb.sectorsPerCluster, out) != 0) break;
+        out += run * cluster_bytes;
+        done += run;
+    }
+    return done;
+}
+
+void fat32_readahead_init(FAT32_READAHEAD* ra) {
+    ra->next_index = 0;
+    ra->ahead = 0;
+    ra->window = 0;
+}
+
+// Called before reading clusters index..index+count-1 of the chain. Makes
+// sure they and the window after them are cached.
+void fat32_readahead(BLOCK_DEVICE* dev, FAT32_READAHEAD* ra, uint32_t first_cluster, uint32_t index, uint32_t count) {
+    if (bpb.sectorsPerCluster == 0 || !bcache_cacheable(dev)) return;
+    uint32_t max_window = FAT32_RA_MAX_SECTORS / bpb.sectorsPerCluster;
+    if (max_window == 0) max_window = 1;
+
+    uint32_t from = index;
+    if (ra->ahead && index == ra->next_index) {
+        ra->window = ra->window ? ra->window * 2 : count;
+        if (ra->window > max_window) ra->window = max_window;
+        if (ra->ahead > from) from = ra->ahead;
+    } else {
+        ra->window = 0;     // first access or a seek: just what was asked for
+    }
+
+    uint32_t end = index + count + ra->window;
+    ra->next_index = index + count;
+    while (from < end) {
+        uint32_t run = 0;
+        uint32_t cluster = fat32_map_cluster(dev, first_cluster, from, &run);
+        if (fat32_chain_end(cluster)) break;    // the end, or an error the reader will see
+        if (run > end - from) run = end - from;
+        if (bcache_prefetch(dev, cluster_to_sector(cluster), run * bpb.sectorsPerCluster) != 0) break;
+        from += run;
+    }
+    ra->ahead = from;
+}
+
+// A FAT entry is about to change: forget every map that contains it.
+static void fat32_extent_invalidate(BLOCK_DEVICE* dev, uint32_t cluster) {
+    for (int i = 0; i < FAT32_EXTENT_MAPS; i++) {
+        FAT32_EXTENT_MAP* map = &extent_maps[i];
+        if (map->first_cluster == 0 || map->dev != dev) continue;
+
+        for (uint32_t e = 0; e < map->count; e++) {
+            const FAT32_EXTENT* ext = &map->extents[e];
+            if (cluster >= ext->cluster && cluster < ext->cluster + ext->length) {
+                map->first_cluster = 0;
+                break;
             }
         }
+    }
+}
 
-        // Get next cluster in the chain
-        cluster = fat32_get_fat_entry(port, cluster);
+
+void fat32_list_root_dir(BLOCK_DEVICE* dev) {
+    FAT32_DIR dir;
+    uint32_t records[FAT32_GETDENTS_WORDS];
+    if (!fat32_opendir(dev, &dir, bpb.rootCluster)) return;
+
+    int n;
+    while ((n = fat32_getdents(dev, &dir, records, sizeof(records))) > 0) {
+        for (int off = 0; off < n; ) {
+            const FAT32_DIRENT* d = (const FAT32_DIRENT*)((uint8_t*)records + off);
+            off += d->reclen;
+            print(d->name);
+            print("\n");
+        }
     }
+
+    fat32_closedir(&dir);
 }
 
 
-void fat32_list_directory(uint32_t port, const char* path) {
+void fat32_list_directory(BLOCK_DEVICE* dev, const char* path) {
     FAT32_DIR dir;
-    FAT32_DirectoryEntry entry;
-    char name[256];
+    uint32_t records[FAT32_GETDENTS_WORDS];
 
-    uint32_t cluster = resolve_path_to_cluster(port, path);
+    uint32_t cluster = resolve_path_to_cluster(dev, path);
     if (cluster == 0) {
         print("Directory not found\n");
         return;
     }
 
-    if (!fat32_opendir(port, &dir, cluster)) {
+    if (!fat32_opendir(dev, &dir, cluster)) {
         print("Failed to open directory\n");
         return;
     }
 
     print("Directory listing:\n");
 
-    while (fat32_readdir(port, &dir, name, &entry)) {
-        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-            continue; // skip special entries
-        }
+    int n;
+    while ((n = fat32_getdents(dev, &dir, records, sizeof(records))) > 0) {
+        for (int off = 0; off < n; ) {
+            const FAT32_DIRENT* d = (const FAT32_DIRENT*)((uint8_t*)records + off);
+            off += d->reclen;
+            if (strcmp(d->name, ".") == 0 || strcmp(d->name, "..") == 0) {
+                continue; // skip special entries
+            }
 
-        print(name);
-        if (fat32_is_dir(&entry)) {
-            print(" [DIR]");
+            print(d->name);
+            if (d->attr & 0x10) {
+                print(" [DIR]");
+            }
+            print("\n");
         }
-        print("\n");
     }
 
     fat32_closedir(&dir);
 }
 
-bool fat32_dir_exists(uint32_t port, const char* path) {
-    return resolve_path_to_cluster(port, path) != 0;
+bool fat32_dir_exists(BLOCK_DEVICE* dev, const char* path) {
+    return resolve_path_to_cluster(dev, path) != 0;
+}
+
+// Freed clusters waiting to be discarded, as coalesced runs. A cluster
+// must leave this list before it is reused, or the discard would destroy
+// its new contents.
+#define FAT32_DISCARD_RUNS 32
+
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} FAT32_ClusterRun;
+
+static FAT32_ClusterRun discard_runs[FAT32_DISCARD_RUNS];
+static int discard_run_count = 0;
+
+void fat32_flush_discards(BLOCK_DEVICE* dev) {
+    if (discard_run_count == 0) return;
+
+    BLOCK_RANGE ranges[FAT32_DISCARD_RUNS];
+    for (int i = 0; i < discard_run_count; i++) {
+        ranges[i].lba = cluster_to_sector(discard_runs[i].first);
+        ranges[i].count = discard_runs[i].count * bpb.sectorsPerCluster;
+    }
+
+    blockdev_discard(dev, ranges, discard_run_count);
+    discard_run_count = 0;
+}
+
+static void fat32_queue_discard(BLOCK_DEVICE* dev, uint32_t cluster) {
+    for (int i = 0; i < discard_run_count; i++) {
+        FAT32_ClusterRun* run = &discard_runs[i];
+        if (cluster >= run->first && cluster < run->first + run->count) return;
+        if (cluster == run->first + run->count) {
+            run->count++;
+            // Merge with the following run if this closed the gap.
+            for (int j = 0; j < discard_run_count; j++) {
+                if (discard_runs[j].first == cluster + 1) {
+                    run->count += discard_runs[j].count;
+                    discard_runs[j] = discard_runs[--discard_run_count];
+                    break;
+                }
+            }
+            return;
+        }
+        if (cluster + 1 == run->first) {
+            run->first = cluster;
+            run->count++;
+            return;
+        }
+    }
+
+    if (discard_run_count == FAT32_DISCARD_RUNS) fat32_flush_discards(dev);
+    discard_runs[discard_run_count].first = cluster;
+    discard_runs[discard_run_count].count = 1;
+    discard_run_count++;
+}
+
+static void fat32_cancel_discard(uint32_t cluster) {
+    for (int i = 0; i < discard_run_count; i++) {
+        FAT32_ClusterRun* run = &discard_runs[i];
+        if (cluster < run->first || cluster >= run->first + run->count) continue;
+
+        uint32_t end = run->first + run->count;
+        if (cluster == run->first) {
+            run->first++;
+            run->count--;
+        } else if (cluster == end - 1) {
+            run->count--;
+        } else {
+            // Split; if there is no room for the tail it is simply not discarded.
+            run->count = cluster - run->first;
+            if (discard_run_count < FAT32_DISCARD_RUNS) {
+                discard_runs[discard_run_count].first = cluster + 1;
+                discard_runs[discard_run_count].count = end - cluster - 1;
+                discard_run_count++;
+            }
+        }
+
+        if (run->count == 0) discard_runs[i] = discard_runs[--discard_run_count];
+        return;
+    }
+}
+
+// Free-cluster bitmap, built from the FAT at mount and kept up to date by
+// fat32_set_fat_entry. A set bit means the cluster is in use (clusters 0
+// and 1 and anything past the end of the volume count as used). Clusters
+// beyond FAT32_FREE_MAP_CLUSTERS are not tracked and are found by
+// scanning the FAT, as before.
+static uint32_t free_map[FAT32_FREE_MAP_CLUSTERS / 32];
+static uint32_t free_map_clusters = 0;     // clusters covered by the map
+static uint32_t cluster_count = 0;         // valid cluster numbers are < this
+static uint32_t free_clusters = 0;
+static uint32_t next_free = 2;             // where the next search starts
+static bool fsinfo_dirty = false;
+
+static bool fat32_map_used(uint32_t cluster) {
+    return (free_map[cluster >> 5] >> (cluster & 31)) & 1;
+}
+
+static void fat32_map_set(uint32_t cluster, bool used) {
+    if (used) free_map[cluster >> 5] |= 1u << (cluster & 31);
+    else free_map[cluster >> 5] &= ~(1u << (cluster & 31));
+}
+
+static uint32_t fat32_read_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void fat32_write_le32(uint8_t* p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static bool fat32_fsinfo_valid(const uint8_t* sector) {
+    return fat32_read_le32(sector) == FAT32_FSINFO_LEAD_SIG &&
+           fat32_read_le32(sector + 484) == FAT32_FSINFO_STRUCT_SIG &&
+           fat32_read_le32(sector + 508) == FAT32_FSINFO_TRAIL_SIG;
 }
 
-uint32_t fat32_find_free_cluster(uint32_t port) {
+// Nothing mounted: allocate nothing.
+static void fat32_clear_free_map(void) {
+    cluster_count = 0;
+    free_map_clusters = 0;
+    free_clusters = 0;
+    fsinfo_dirty = false;
+}
+
+// Stream the FAT in large reads and fill the bitmap. FSInfo only
+// contributes its next-free hint: the count is recomputed, and written
+// back at the next sync if FSInfo had it wrong.
+static void fat32_load_free_map(BLOCK_DEVICE* dev) {
+    uint32_t data_start = cluster_to_sector(2);
+    uint32_t entries = bpb.FATSize32 * (512 / 4);
+    cluster_count = entries;
+    if (bpb.sectorsPerCluster && bpb.totalSectors32 > data_start) {
+        uint32_t data_clusters = (bpb.totalSectors32 - data_start) / bpb.sectorsPerCluster;
+        if (data_clusters + 2 < cluster_count) cluster_count = data_clusters + 2;
+    }
+    free_map_clusters = cluster_count < FAT32_FREE_MAP_CLUSTERS ? cluster_count : FAT32_FREE_MAP_CLUSTERS;
+    memset(free_map, 0xFF, sizeof(free_map));
+    free_clusters = 0;
+    next_free = 2;
+    fsinfo_dirty = false;
+
+    DMA_BUFFER buf;
+    if (dma_alloc(&buf, FAT32_FAT_READ_SECTORS * 512, 512) != 0) {
+        cluster_count = 0;
+        free_map_clusters = 0;
+        return;
+    }
+
+    uint32_t fat_start = fat_start_sector();
+    for (uint32_t s = 0; s < bpb.FATSize32; s += FAT32_FAT_READ_SECTORS) {
+        uint32_t n = bpb.FATSize32 - s;
+        if (n > FAT32_FAT_READ_SECTORS) n = FAT32_FAT_READ_SECTORS;
+        if (blockdev_read(dev, fat_start + s, n, buf.virt) != 0) {
+            // Unknown state: allocate nothing rather than something in use.
+            cluster_count = 0;
+            free_map_clusters = 0;
+            free_clusters = 0;
+            dma_free(&buf);
+            return;
+        }
+
+        const uint32_t* fat = buf.virt;
+        uint32_t first = s * (512 / 4);
+        for (uint32_t e = 0; e < n * (512 / 4); e++) {
+            uint32_t cluster = first + e;
+            if (cluster < 2 || cluster >= cluster_count) continue;
+            if ((fat[e] & 0x0FFFFFFF) != 0) continue;
+            free_clusters++;
+            if (cluster < free_map_clusters) fat32_map_set(cluster, false);
+        }
+    }
+    dma_free(&buf);
+
+    uint8_t sector[512];
+    if (bpb.fsInfo && blockdev_read(dev, bpb.fsInfo, 1, sector) == 0 && fat32_fsinfo_valid(sector)) {
+        uint32_t hint = fat32_read_le32(sector + 492);
+        if (hint >= 2 && hint < cluster_count) next_free = hint;
+        fsinfo_dirty = fat32_read_le32(sector + 488) != free_clusters;
+    }
+
+    printf("Free clusters: %u of %u\n", free_clusters, cluster_count - 2);
+}
+
+// Write the free count and next-free hint into FSInfo if they changed.
+static void fat32_write_fsinfo(BLOCK_DEVICE* dev) {
+    if (!fsinfo_dirty || !bpb.fsInfo) return;
+
+    uint8_t sector[512];
+    if (blockdev_read(dev, bpb.fsInfo, 1, sector) != 0 || !fat32_fsinfo_valid(sector)) return;
+    fat32_write_le32(sector + 488, free_clusters);
+    fat32_write_le32(sector + 492, next_free);
+    if (blockdev_write(dev, bpb.fsInfo, 1, sector) == 0) fsinfo_dirty = false;
+}
+
+uint32_t fat32_free_clusters(void) {
+    return free_clusters;
+}
+
+uint32_t fat32_total_clusters(void) {
+    return cluster_count > 2 ? cluster_count - 2 : 0;
+}
+
+// First free cluster in [from, to) according to the bitmap, or 0. Whole
+// words of used clusters are skipped at once.
+static uint32_t fat32_map_search(uint32_t from, uint32_t to) {
+    uint32_t cluster = from;
+    while (cluster < to) {
+        if ((cluster & 31) == 0 && free_map[cluster >> 5] == 0xFFFFFFFF) {
+            cluster += 32;
+            continue;
+        }
+        if (!fat32_map_used(cluster)) return cluster;
+        cluster++;
+    }
+    return 0;
+}
+
+// Clusters past the bitmap: one read per FAT sector.
+static uint32_t fat32_scan_untracked(BLOCK_DEVICE* dev) {
     uint32_t fat_start = fat_start_sector();
-    uint32_t entries = bpb.FATSize32 * 512 / 4;
     uint8_t sector[512];
 
-    for (uint32_t i = 2; i < entries; i++) {
-        uint32_t offset = i * 4;
-        uint32_t sector_num = fat_start + (offset / 512);
-        uint32_t sector_offset = offset % 512;
-
-        sata_ahci_read(port, sector_num,1, sector);
-        uint32_t entry = *(uint32_t*)&sector[sector_offset] & 0x0FFFFFFF;
-        if (entry == 0x00000000) {
-            // Mark it as EOC
-            *(uint32_t*)&sector[sector_offset] = FAT_ENTRY_EOC;
-            sata_ahci_write(port, sector_num,1, sector);
-            return i;
+    for (uint32_t s = free_map_clusters / (512 / 4); s < bpb.FATSize32; s++) {
+        if (blockdev_read(dev, fat_start + s, 1, sector) != 0) return 0;
+
+        uint32_t* fat = (uint32_t*)sector;
+        for (uint32_t e = 0; e < 512 / 4; e++) {
+            uint32_t i = s * (512 / 4) + e;
+            if (i < free_map_clusters || i >= cluster_count) continue;
+            if ((fat[e] & 0x0FFFFFFF) == 0x00000000) return i;
         }
     }
-    return 0; // No free cluster found
+    return 0;
+}
+
+// Allocate a cluster and mark it end-of-chain. The search resumes where
+// the last one stopped, so a run of allocations walks the bitmap once.
+uint32_t fat32_find_free_cluster(BLOCK_DEVICE* dev) {
+    if (free_clusters == 0) return 0;
+
+    uint32_t start = next_free < free_map_clusters ? next_free : 2;
+    uint32_t cluster = fat32_map_search(start, free_map_clusters);
+    if (!cluster) cluster = fat32_map_search(2, start);
+    if (!cluster) cluster = fat32_scan_untracked(dev);
+    if (!cluster) return 0;
+
+    if (fat32_set_fat_entry(dev, cluster, FAT_ENTRY_EOC) != 0) return 0;
+    next_free = cluster + 1 < cluster_count ? cluster + 1 : 2;
+    return cluster;
 }
 
 
 // Helper: Write FAT entry
-void fat32_set_fat_entry(uint32_t port, uint32_t cluster, uint32_t value) {
+int fat32_set_fat_entry(BLOCK_DEVICE* dev, uint32_t cluster, uint32_t value) {
     uint32_t offset = cluster * 4;
     uint32_t sector_num = fat_start_sector() + (offset / 512);
     uint32_t sector_offset = offset % 512;
     uint8_t sector[512];
 
-    sata_ahci_read(port, sector_num, 1, sector);
-    *(uint32_t*)&sector[sector_offset] = value;
-    sata_ahci_write(port, sector_num,1, sector);
+    fat32_extent_invalidate(dev, cluster);
+
+    // Whether the cluster was in use, for the accounting below.
+    bool tracked = cluster >= 2 && cluster < cluster_count;
+    bool was_used = false;
+    if (tracked) {
+        was_used = cluster < free_map_clusters ? fat32_map_used(cluster)
+                                               : fat32_get_fat_entry(dev, cluster) != 0;
+    }
+
+    BCACHE_BUFFER* buf = bcache_get(dev, sector_num);
+    if (buf) {
+        *(uint32_t*)&buf->data[sector_offset] = value;
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+    } else {
+        // Uncached device. Never patch a sector we failed to read.
+        if (blockdev_read(dev, sector_num, 1, sector) != 0) return -1;
+        *(uint32_t*)&sector[sector_offset] = value;
+        if (blockdev_write(dev, sector_num,1, sector) != 0) return -1;
+    }
+
+    // Only now that the FAT has it: keep the free count and bitmap in step.
+    bool used = (value & 0x0FFFFFFF) != 0;
+    if (tracked && was_used != used) {
+        if (used) free_clusters--;
+        else free_clusters++;
+        if (cluster < free_map_clusters) fat32_map_set(cluster, used);
+        fsinfo_dirty = true;
+    }
+
+    if ((value & 0x0FFFFFFF) == 0) fat32_queue_discard(dev, cluster);
+    else fat32_cancel_discard(cluster);
+    return 0;
+}
+
+// Make everything durable and hand freed clusters back to the device.
+void fat32_sync(BLOCK_DEVICE* dev) {
+    fat32_write_fsinfo(dev);
+    blockdev_flush(dev);
+    fat32_flush_discards(dev);
 }
 
 // Create directory
-bool fat32_create_dir(uint32_t port, const char* path) {
+bool fat32_create_dir(BLOCK_DEVICE* dev, const char* path) {
     // Split into parent path and new dir name
     char parent[256], name[256];
     strncpy(parent, path, sizeof(parent));
@@ -532,20 +1156,14 @@ bool fat32_create_dir(uint32_t port, const char* path) {
     *last = '\0';
     if (strlen(parent) == 0) strcpy(parent, "/");
 
-    uint32_t parent_cluster = resolve_path_to_cluster(port, parent);
+    uint32_t parent_cluster = resolve_path_to_cluster(dev, parent);
     if (parent_cluster == 0) return false;
 
     // Ensure directory with same name does not exist
-    FAT32_DIR dir;
-    FAT32_DirectoryEntry entry;
-    char entry_name[256];
-    fat32_opendir(port, &dir, parent_cluster);
-    while (fat32_readdir(port, &dir, entry_name, &entry)) {
-        if (strcmp(entry_name, name) == 0) return false; // Already exists
-    }
+    if (fat32_lookup(dev, parent_cluster, name, 0, 0, 0)) return false;
 
     // Find free cluster
-    uint32_t new_cluster = fat32_find_free_cluster(port);
+    uint32_t new_cluster = fat32_find_free_cluster(dev);
     if (new_cluster == 0) return false;
 
     // Initialize the new cluster with . and ..
@@ -564,14 +1182,27 @@ bool fat32_create_dir(uint32_t port, const char* path) {
     entries[1].firstClusterLow = parent_cluster & 0xFFFF;
     entries[1].firstClusterHigh = (parent_cluster >> 16) & 0xFFFF;
 
-    // Write new directory entries
-    sata_ahci_write(port, cluster_to_sector(new_cluster),1, (uint8_t*)entries);
+    // Write the whole new cluster in one command: . and .. followed by
+    // zeroed sectors so stale data is never read back as entries.
+    static uint8_t zero_sector[512];
+    BLOCK_SEGMENT segs[128];
+    segs[0].buffer = entries;
+    segs[0].length = 512;
+    for (int s = 1; s < bpb.sectorsPerCluster && s < 128; s++) {
+        segs[s].buffer = zero_sector;
+        segs[s].length = 512;
+    }
+    if (blockdev_writev(dev, cluster_to_sector(new_cluster), segs, bpb.sectorsPerCluster) != 0) return false;
+
+    // Barrier: the FAT allocation and the new cluster must be on media
+    // before the parent directory points at them.
+    if (blockdev_flush(dev) != 0) return false;
 
     // Add entry to parent directory
-    fat32_opendir(port, &dir, parent_cluster);
+    uint8_t sector[512];
     for (int s = 0; s < bpb.sectorsPerCluster; s++) {
-        sata_ahci_read(port, cluster_to_sector(parent_cluster) + s,1, dir.sectorBuffer);
-        FAT32_DirectoryEntry* ents = (FAT32_DirectoryEntry*)dir.sectorBuffer;
+        blockdev_read(dev, cluster_to_sector(parent_cluster) + s,1, sector);
+        FAT32_DirectoryEntry* ents = (FAT32_DirectoryEntry*)sector;
         for (int i = 0; i < 512 / sizeof(FAT32_DirectoryEntry); i++) {
             if (ents[i].name[0] == 0x00 || ents[i].name[0] == 0xE5) {
                 // Add entry
@@ -582,8 +1213,8 @@ bool fat32_create_dir(uint32_t port, const char* path) {
                 ents[i].attr = 0x10;
                 ents[i].firstClusterLow = new_cluster & 0xFFFF;
                 ents[i].firstClusterHigh = (new_cluster >> 16) & 0xFFFF;
-                sata_ahci_write(port, cluster_to_sector(parent_cluster) + s,1, dir.sectorBuffer);
-                return true;
+                fat32_dentry_invalidate(dev, parent_cluster, name);
+                return blockdev_write_fua(dev, cluster_to_sector(parent_cluster) + s,1, sector) == 0;
             }
         }
     }
@@ -592,22 +1223,23 @@ bool fat32_create_dir(uint32_t port, const char* path) {
 }
 
 // Delete empty directory
-bool fat32_delete_dir(uint32_t port, const char* path) {
-    uint32_t cluster = resolve_path_to_cluster(port, path);
+bool fat32_delete_dir(BLOCK_DEVICE* dev, const char* path) {
+    uint32_t cluster = resolve_path_to_cluster(dev, path);
     if (cluster == 0) return false;
 
     // Check if empty
     FAT32_DIR dir;
     FAT32_DirectoryEntry entry;
     char name[256];
-    fat32_opendir(port, &dir, cluster);
-    while (fat32_readdir(port, &dir, name, &entry)) {
+    bool empty = true;
+    if (!fat32_opendir(dev, &dir, cluster)) return false;
+    while (fat32_readdir(dev, &dir, name, &entry)) {
         if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
-        return false; // Not empty
+        empty = false;
+        break;
     }
-
-    // Clear FAT entry
-    fat32_set_fat_entry(port, cluster, 0x00000000);
+    fat32_closedir(&dir);
+    if (!empty || dir.error) return false; // Not empty, or we could not tell
 
     // Remove from parent directory
     char parent[256], leaf[256];
@@ -618,27 +1250,27 @@ bool fat32_delete_dir(uint32_t port, const char* path) {
     *last = '\0';
     if (strlen(parent) == 0) strcpy(parent, "/");
 
-    uint32_t parent_cluster = resolve_path_to_cluster(port, parent);
+    uint32_t parent_cluster = resolve_path_to_cluster(dev, parent);
     if (parent_cluster == 0) return false;
 
-    for (int s = 0; s < bpb.sectorsPerCluster; s++) {
-        uint8_t buffer[512];
-        sata_ahci_read(0, cluster_to_sector(parent_cluster) + s,1, buffer);
-        FAT32_DirectoryEntry* ents = (FAT32_DirectoryEntry*)buffer;
-        for (int i = 0; i < 512 / sizeof(FAT32_DirectoryEntry); i++) {
-            if (ents[i].name[0] == 0x00) break;
-            if (ents[i].name[0] == 0xE5) continue;
-            char short_name[12];
-            strncpy(short_name, (char*)ents[i].name, 11);
-            short_name[11] = '\0';
-            for (int k = 10; k >= 0 && short_name[k] == ' '; k--) short_name[k] = '\0';
-            if (strcmp(short_name, leaf) == 0) {
-                ents[i].name[0] = 0xE5; // Mark deleted
-                sata_ahci_write(port, cluster_to_sector(parent_cluster) + s,1, buffer);
-                return true;
-            }
-        }
-    }
+    uint32_t sector;
+    uint32_t slot;
+    if (!fat32_lookup(dev, parent_cluster, leaf, 0, &sector, &slot)) return false;
 
-    return false;
+    uint8_t buffer[512];
+    if (blockdev_read(dev, sector, 1, buffer) != 0) return false;
+    FAT32_DirectoryEntry* ents = (FAT32_DirectoryEntry*)buffer;
+    ents[slot].name[0] = 0xE5; // Mark deleted
+    int status = blockdev_write(dev, sector, 1, buffer);
+    fat32_dentry_invalidate(dev, parent_cluster, leaf);
+    fat32_dentry_invalidate(dev, cluster, 0);
+    if (status != 0) return false;  // the entry may still point at the cluster: keep it
+
+    // Barrier: the entry must be gone before its cluster is
+    // freed, or a crash could leave it pointing at a cluster
+    // that gets reused. A crash after this only leaks it.
+    if (blockdev_flush(dev) != 0) return false;
+
+    // Clear FAT entry
+    return fat32_set_fat_entry(dev, cluster, 0x00000000) == 0;
 }
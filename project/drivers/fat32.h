@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "blockdev.h"
+#include "dma.h"
 
 #pragma pack(push, 1)
 
@@ -66,21 +68,123 @@ typedef struct {
 
 #pragma pack(pop)
 
+// Sequential readahead for one open directory or file. A reader calls
+// fat32_readahead before reading clusters of a chain; when it carries on
+// where the previous call left off, the window of clusters read ahead of
+// it into the buffer cache doubles (up to FAT32_RA_MAX_SECTORS), and a
+// jump resets it. Physically contiguous clusters go out as one command.
+#define FAT32_RA_MAX_SECTORS 128
+
+typedef struct {
+    uint32_t next_index;        // chain index a sequential reader asks for next
+    uint32_t ahead;             // chain index the cache has been filled up to
+    uint32_t window;            // clusters read ahead of the reader
+} FAT32_READAHEAD;
+
+// Extent maps: a cluster chain collapsed into runs of physically
+// contiguous clusters, built from the FAT as far as someone has looked
+// and looked up by binary search. One map per file or directory (keyed
+// by its first cluster) is kept in a small LRU table; changing a FAT
+// entry drops the maps that contain the cluster.
+#define FAT32_EXTENT_MAPS    16
+#define FAT32_MAP_EXTENTS    64     // beyond this, lookups walk the FAT
+
+typedef struct {
+    uint32_t file_cluster;      // index of the first cluster within the chain
+    uint32_t cluster;           // its cluster number
+    uint32_t length;            // contiguous clusters
+} FAT32_EXTENT;
+
+typedef struct {
+    BLOCK_DEVICE* dev;
+    uint32_t first_cluster;     // 0: slot unused
+    uint32_t mapped;            // chain clusters covered by extents
+    uint32_t next;              // FAT entry of the last mapped cluster
+    bool complete;              // reached the end of the chain
+    uint32_t count;
+    uint32_t last_used;
+    FAT32_EXTENT extents[FAT32_MAP_EXTENTS];
+} FAT32_EXTENT_MAP;
+
+// Directory-entry cache: names looked up in a directory, keyed by
+// (parent cluster, name hash), with the entry and where it sits on disk.
+// Names that were not found are cached too. Creating or deleting a
+// directory drops the affected names; mounting drops everything.
+#define FAT32_DENTRIES        128
+#define FAT32_DENTRY_BUCKETS  64
+#define FAT32_DENTRY_NAME_LEN 64    // longer names are not cached
+
+typedef struct FAT32_DENTRY FAT32_DENTRY;
+
+struct FAT32_DENTRY {
+    BLOCK_DEVICE* dev;
+    uint32_t parent;            // cluster of the containing directory, 0 if unused
+    uint32_t hash;
+    char name[FAT32_DENTRY_NAME_LEN];
+    bool negative;              // no such name
+    FAT32_DirectoryEntry entry;
+    uint32_t sector;            // LBA of the sector holding the entry
+    uint32_t slot;              // entry index within that sector
+    uint32_t last_used;
+    FAT32_DENTRY* hash_next;
+};
+
+// Directory iterator. It follows the cluster chain through the extent map
+// and fills its own buffer with up to FAT32_DIR_READ_SECTORS of contiguous
+// clusters (at least one whole cluster) at a time, reading ahead through
+// the buffer cache as the scan goes on. The buffer comes from the DMA
+// pool: always pair fat32_opendir with fat32_closedir.
+#define FAT32_DIR_READ_SECTORS 64
+
 typedef struct {
-    uint32_t cluster;
-    uint8_t sectorBuffer[512];
-    uint8_t sectorIndex;
-    uint8_t entryIndex;
+    uint32_t start_cluster;     // first cluster of the directory
+    uint32_t next_index;        // chain index of the next cluster to read
+    uint32_t cluster;           // first cluster in the buffer
+    uint32_t entries;           // entries in the buffer
+    uint32_t entryIndex;        // next entry to look at
     bool end;
-    char lfnBuffer[256];
+    bool error;                 // a read failed: end does not mean the end
+    bool pending;               // entryIndex - 1 did not fit into fat32_getdents' buffer
+    char lfnBuffer[256];        // its long name
+    FAT32_READAHEAD ra;
+    DMA_BUFFER buffer;
 } FAT32_DIR;
 
+// Record written by fat32_getdents. Records are packed back to back; each
+// is reclen bytes long, a multiple of 4, and its name is NUL-terminated.
+typedef struct {
+    uint16_t reclen;
+    uint8_t attr;
+    uint8_t slot;               // entry index within sector
+    uint32_t cluster;           // first cluster
+    uint32_t size;              // bytes
+    uint32_t sector;            // LBA of the sector holding the entry
+    char name[];
+} FAT32_DIRENT;
+
+// A getdents buffer of this many words always has room for a record.
+#define FAT32_GETDENTS_WORDS 256
+
+// Clusters the free-cluster bitmap covers (one bit each); larger volumes
+// fall back to scanning the FAT beyond that.
+#define FAT32_FREE_MAP_CLUSTERS (1u << 20)
+
+// FAT sectors per read while building the bitmap at mount.
+#define FAT32_FAT_READ_SECTORS  64
+
+#define FAT32_FSINFO_LEAD_SIG   0x41615252
+#define FAT32_FSINFO_STRUCT_SIG 0x61417272
+#define FAT32_FSINFO_TRAIL_SIG  0xAA550000
+
 // Global Variables
 extern FAT32_BPB bpb;
 extern char lfn_buffer[256];
 
 // FAT32 functions
-void fat32_init(uint32_t port);
+// Mount the volume on dev. Only devices with 512-byte sectors are taken;
+// returns false (and leaves nothing mounted) otherwise or if the boot
+// sector cannot be read or makes no sense.
+bool fat32_init(BLOCK_DEVICE* dev);
 uint32_t fat_start_sector(void);
 uint32_t cluster_to_sector(uint32_t cluster);
 bool is_lfn_entry(FAT32_DirectoryEntry* entry);
@@ -88,17 +192,57 @@ void append_lfn_part(FAT32_LFNEntry* lfn);
 void print_short_name(uint8_t* name);
 bool fat32_is_dir(const FAT32_DirectoryEntry* entry);
 uint32_t get_entry_cluster(const FAT32_DirectoryEntry* entry);
-uint32_t resolve_path_to_cluster(uint32_t port, const char* path);
-void fat32_list_root_dir(uint32_t port);
-void print_first_sector(uint32_t port);
+uint32_t resolve_path_to_cluster(BLOCK_DEVICE* dev, const char* path);
+
+// Find name in the directory at parent_cluster, through the dentry cache.
+// sector_out and slot_out (may be 0) get the entry's location on disk.
+bool fat32_lookup(BLOCK_DEVICE* dev, uint32_t parent_cluster, const char* name,
+                  FAT32_DirectoryEntry* entry_out, uint32_t* sector_out, uint32_t* slot_out);
+void fat32_list_root_dir(BLOCK_DEVICE* dev);
+void print_first_sector(BLOCK_DEVICE* dev);
+
+void fat32_readahead_init(FAT32_READAHEAD* ra);
+void fat32_readahead(BLOCK_DEVICE* dev, FAT32_READAHEAD* ra, uint32_t first_cluster, uint32_t index, uint32_t count);
 
 // Directory operations (if you add them)
-bool fat32_opendir(uint32_t port, FAT32_DIR* dir, uint32_t start_cluster);
-bool fat32_readdir(uint32_t port, FAT32_DIR* dir, char* name_out, FAT32_DirectoryEntry* entry_out);
+bool fat32_opendir(BLOCK_DEVICE* dev, FAT32_DIR* dir, uint32_t start_cluster);
+bool fat32_readdir(BLOCK_DEVICE* dev, FAT32_DIR* dir, char* name_out, FAT32_DirectoryEntry* entry_out);
+// Fill buffer with as many records as fit, decoded in place from the
+// iterator buffer. Returns the bytes used, 0 at the end of the directory,
+// or -1 if buffer cannot even hold the next record. Mixing it with
+// fat32_readdir on one iterator is fine.
+int fat32_getdents(BLOCK_DEVICE* dev, FAT32_DIR* dir, void* buffer, uint32_t size);
+
 void fat32_closedir(FAT32_DIR* dir);
-void fat32_list_directory(uint32_t port, const char* path);
-bool fat32_dir_exists(uint32_t port,const char* path);
-bool fat32_delete_dir(uint32_t port,const char* path);
-bool fat32_create_dir(uint32_t port,const char* path);
+void fat32_list_directory(BLOCK_DEVICE* dev, const char* path);
+bool fat32_dir_exists(BLOCK_DEVICE* dev,const char* path);
+bool fat32_delete_dir(BLOCK_DEVICE* dev,const char* path);
+bool fat32_create_dir(BLOCK_DEVICE* dev,const char* path);
+
+#define FAT32_CLUSTER_ERROR 0xFFFFFFFF     // FAT could not be read
+
+// Cluster number of cluster index of the chain starting at first_cluster,
+// 0 past its end, or FAT32_CLUSTER_ERROR. *run_out (if given) gets how
+// many clusters from there on are physically contiguous, as far as the
+// map knows.
+uint32_t fat32_map_cluster(BLOCK_DEVICE* dev, uint32_t first_cluster, uint32_t index, uint32_t* run_out);
+
+// Read count clusters starting at cluster index of a chain, one command
+// per extent. Returns the number of clusters read.
+uint32_t fat32_read_clusters(BLOCK_DEVICE* dev, uint32_t first_cluster, uint32_t index, uint32_t count, void* buffer);
+
+// Cluster allocation. fat32_init builds the free-cluster bitmap; these
+// answer from it without touching the disk.
+uint32_t fat32_find_free_cluster(BLOCK_DEVICE* dev);
+// Returns 0 on success, -1 if the FAT sector could not be read or written.
+int fat32_set_fat_entry(BLOCK_DEVICE* dev, uint32_t cluster, uint32_t value);
+uint32_t fat32_free_clusters(void);
+uint32_t fat32_total_clusters(void);
+
+// Freed clusters are discarded (TRIM) in coalesced batches: when the
+// queue fills up, or on fat32_sync / fat32_flush_discards.
+void fat32_flush_discards(BLOCK_DEVICE* dev);
+// Also writes the free count and next-free hint back to FSInfo.
+void fat32_sync(BLOCK_DEVICE* dev);
 
 #endif // FAT32_H
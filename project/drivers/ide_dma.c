@@ -0,0 +1,327 @@
+// ide_dma.c
+
+#include "ide_dma.h"
+#include "port_io.h"
+#include "print.h"
+#include "pci.h"
+#include "interrupts.h"
+#include "timer.h"
+#include "drive_tools.h"
+#include "dma.h"
+
+#define ATA_REG_DATA       0x00
+#define ATA_REG_ERROR      0x01
+#define ATA_REG_SECCOUNT0  0x02
+#define ATA_REG_LBA0       0x03
+#define ATA_REG_LBA1       0x04
+#define ATA_REG_LBA2       0x05
+#define ATA_REG_HDDEVSEL   0x06
+#define ATA_REG_COMMAND    0x07
+#define ATA_REG_STATUS     0x07
+
+#define ATA_SR_BSY         0x80
+#define ATA_SR_DF          0x20
+#define ATA_SR_ERR         0x01
+
+#define ATA_CMD_READ_DMA      0xC8
+#define ATA_CMD_WRITE_DMA     0xCA
+#define ATA_CMD_READ_DMA_EXT  0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_FLUSH_CACHE     0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+
+// Bus master registers, 8 bytes per channel from BAR4
+#define BM_REG_COMMAND     0x00
+#define BM_REG_STATUS      0x02
+#define BM_REG_PRDT        0x04
+
+#define BM_CMD_START       0x01
+#define BM_CMD_READ        0x08    // device to memory
+#define BM_SR_ACTIVE       0x01
+#define BM_SR_ERR          0x02
+#define BM_SR_IRQ          0x04
+
+// One PRD table per channel, a page from the DMA pool so a table never
+// crosses a 64 KiB boundary. An entry covers at most 64 KiB and may not
+// cross a 64 KiB boundary itself.
+#define IDE_PRDT_SIZE      0x1000
+#define IDE_MAX_PRD        (IDE_PRDT_SIZE / 8)
+#define IDE_PRD_EOT        0x8000
+
+// Per-command limits: 256 sectors for 28-bit commands; 48-bit ones are
+// kept to 4 MiB so the PRD table can describe any buffer alignment.
+#define IDE_DMA_MAX_SECTORS     256
+#define IDE_DMA_MAX_SECTORS_EXT 8192
+#define IDE_DMA_TIMEOUT_MS      5000
+#define IDE_DMA_SPIN_TIMEOUT    1000000
+
+typedef struct {
+    uint32_t addr;
+    uint16_t count;     // bytes, 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed)) IDE_PRD;
+
+typedef struct {
+    uint16_t io;
+    uint16_t ctrl;
+    uint16_t bm;
+    int irq;
+    IDE_PRD* prdt;
+    DMA_BUFFER prdt_dma;
+    volatile int busy;
+    volatile int result;
+} IDE_CHANNEL;
+
+static IDE_CHANNEL ide_channels[IDE_DMA_CHANNELS];
+static int ide_present = 0;
+
+static void ide_dma_complete(IDE_CHANNEL* ch) {
+    uint8_t bm_status = inb(ch->bm + BM_REG_STATUS);
+    outb(ch->bm + BM_REG_COMMAND, 0);
+
+    // Reading the status register also acknowledges the drive's INTRQ.
+    uint8_t status = inb(ch->io + ATA_REG_STATUS);
+    outb(ch->bm + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);
+
+    ch->result = ((bm_status & BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) ? 0 : 1;
+    ch->busy = 0;
+}
+
+static void ide_dma_irq_handler(uint8_t irq) {
+    for (int i = 0; i < IDE_DMA_CHANNELS; i++) {
+        IDE_CHANNEL* ch = &ide_channels[i];
+        if (ch->irq != irq || !ch->busy) continue;
+        if (inb(ch->bm + BM_REG_STATUS) & BM_SR_IRQ) ide_dma_complete(ch);
+    }
+}
+
+void ide_dma_init(void) {
+    PCI_DEVICE pci;
+    if (!pci_find_device(0x01, 0x01, -1, 0, &pci)) return;
+
+    uint32_t bar4 = pci_read_bar(&pci, 4);
+    if (!(bar4 & 1)) return;    // bus mastering needs an I/O BAR4
+
+    uint8_t prog_if = pci_config_read8(pci.bus, pci.device, pci.function, 0x09);
+    pci_enable_bus_master(&pci);
+
+    static const uint16_t legacy_io[] = { 0x1F0, 0x170 };
+    static const uint16_t legacy_ctrl[] = { 0x3F6, 0x376 };
+    static const int legacy_irq[] = { 14, 15 };
+
+    for (int i = 0; i < IDE_DMA_CHANNELS; i++) {
+        IDE_CHANNEL* ch = &ide_channels[i];
+
+        // prog_if bit 0/2: primary/secondary channel in PCI native mode
+        if (prog_if & (1 << (i * 2))) {
+            ch->io = pci_read_bar(&pci, i * 2) & ~3;
+            ch->ctrl = (pci_read_bar(&pci, i * 2 + 1) & ~3) + 2;
+            ch->irq = pci.irq_line < IRQ_COUNT ? pci.irq_line : -1;
+        } else {
+            ch->io = legacy_io[i];
+            ch->ctrl = legacy_ctrl[i];
+            ch->irq = legacy_irq[i];
+        }
+        ch->bm = (uint16_t)((bar4 & ~3) + i * 8);
+        if (!ch->prdt_dma.virt && dma_alloc(&ch->prdt_dma, IDE_PRDT_SIZE, IDE_PRDT_SIZE) != 0) return;
+        ch->prdt = ch->prdt_dma.virt;
+        ch->busy = 0;
+        ch->result = 1;
+
+        outb(ch->bm + BM_REG_COMMAND, 0);
+        outb(ch->bm + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);
+        outb(ch->ctrl, 0);      // clear nIEN so the drive raises INTRQ
+
+        if (ch->irq >= 0 && (i == 0 || ch->irq != ide_channels[0].irq)) {
+            irq_register_handler(ch->irq, ide_dma_irq_handler);
+        }
+    }
+
+    ide_present = 1;
+    print("IDE bus master at ");
+    print_hex32(bar4 & ~3);
+    print("\n");
+}
+
+int ide_dma_available(int drive) {
+    return ide_present && ata_get_device_info(drive) != 0;
+}
+
+uint32_t ide_dma_max_sectors(int drive) {
+    const ATA_DEVICE_INFO* info = ata_get_device_info(drive);
+    return (info && info->lba48) ? IDE_DMA_MAX_SECTORS_EXT : IDE_DMA_MAX_SECTORS;
+}
+
+// Describe a physically contiguous buffer, splitting at 64 KiB boundaries.
+static int ide_build_prdt(IDE_PRD* prdt, uintptr_t addr, uint32_t bytes) {
+    int n = 0;
+    while (bytes) {
+        if (n == IDE_MAX_PRD) return 0;
+
+        uint32_t len = 0x10000 - (addr & 0xFFFF);
+        if (len > bytes) len = bytes;
+
+        prdt[n].addr = dma_phys((void*)addr);
+        prdt[n].count = (uint16_t)len;  // 0x10000 wraps to 0 = 64 KiB
+        prdt[n].flags = 0;
+        n++;
+
+        addr += len;
+        bytes -= len;
+    }
+    prdt[n - 1].flags = IDE_PRD_EOT;
+    return n;
+}
+
+int ide_dma_start(int drive, uint32_t lba, uint32_t count, uint8_t* buffer, int write) {
+    if (!ide_present || drive < 0 || drive >= IDE_DMA_CHANNELS * 2) return 0;
+
+    const ATA_DEVICE_INFO* info = ata_get_device_info(drive);
+    IDE_CHANNEL* ch = &ide_channels[drive / 2];
+    int slave = drive % 2;
+
+    if (!info || ch->busy) return 0;
+    if (count == 0 || count > ide_dma_max_sectors(drive)) return 0;
+    if ((uintptr_t)buffer & 1) return 0;    // PRDs need word alignment
+
+    int lba48 = info->lba48 && (lba + count > (1u << 28) || count > IDE_DMA_MAX_SECTORS);
+
+    if (!ide_build_prdt(ch->prdt, (uintptr_t)buffer, count * info->logical_sector_size)) return 0;
+
+    int timeout = 100000;
+    while ((inb(ch->io + ATA_REG_STATUS) & ATA_SR_BSY) && --timeout);
+    if (!timeout) return 0;
+
+    outb(ch->bm + BM_REG_COMMAND, 0);
+    outl(ch->bm + BM_REG_PRDT, ch->prdt_dma.phys);
+    outb(ch->bm + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);
+    outb(ch->bm + BM_REG_COMMAND, write ? 0 : BM_CMD_READ);
+
+    if (lba48) {
+        outb(ch->io + ATA_REG_HDDEVSEL, 0x40 | (slave << 4));
+        outb(ch->io + ATA_REG_SECCOUNT0, (uint8_t)(count >> 8));
+        outb(ch->io + ATA_REG_LBA0, (uint8_t)(lba >> 24));
+        outb(ch->io + ATA_REG_LBA1, 0);
+        outb(ch->io + ATA_REG_LBA2, 0);
+    } else {
+        outb(ch->io + ATA_REG_HDDEVSEL, 0xE0 | (slave << 4) | ((lba >> 24) & 0x0F));
+    }
+    outb(ch->io + ATA_REG_SECCOUNT0, (uint8_t)count); // 256 is sent as 0
+    outb(ch->io + ATA_REG_LBA0, (uint8_t)(lba));
+    outb(ch->io + ATA_REG_LBA1, (uint8_t)(lba >> 8));
+    outb(ch->io + ATA_REG_LBA2, (uint8_t)(lba >> 16));
+
+    uint8_t cmd;
+    if (write) cmd = lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+    else cmd = lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+
+    uint32_t flags = irq_save();
+    ch->busy = 1;
+    outb(ch->io + ATA_REG_COMMAND, cmd);
+    outb(ch->bm + BM_REG_COMMAND, (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+    irq_restore(flags);
+
+    return 1;
+}
+
+int ide_dma_poll(int channel) {
+    if (channel < 0 || channel >= IDE_DMA_CHANNELS) return 0;
+    IDE_CHANNEL* ch = &ide_channels[channel];
+
+    uint32_t flags = irq_save();
+    // Without an IRQ (or with it masked) the interrupt bit is still latched.
+    if (ch->busy && (inb(ch->bm + BM_REG_STATUS) & BM_SR_IRQ)) ide_dma_complete(ch);
+    int result = ch->busy ? IDE_DMA_BUSY : ch->result;
+    irq_restore(flags);
+
+    return result;
+}
+
+int ide_dma_wait(int channel) {
+    if (channel < 0 || channel >= IDE_DMA_CHANNELS) return 0;
+    IDE_CHANNEL* ch = &ide_channels[channel];
+
+    uint32_t start_ms = timer_ms();
+    uint32_t spins = 0;
+
+    while (1) {
+        uint32_t flags = irq_save();
+        if (ch->busy && (inb(ch->bm + BM_REG_STATUS) & BM_SR_IRQ)) ide_dma_complete(ch);
+        if (!ch->busy) {
+            irq_restore(flags);
+            return ch->result;
+        }
+
+        if ((flags & (1 << 9)) && ch->irq >= 0) {
+            irq_wait();
+        } else {
+            irq_restore(flags);
+        }
+
+        if (timer_running() ? (timer_ms() - start_ms > IDE_DMA_TIMEOUT_MS) : (++spins > IDE_DMA_SPIN_TIMEOUT)) {
+            break;
+        }
+    }
+
+    print("IDE DMA command timed out\n");
+    uint32_t flags = irq_save();
+    outb(ch->bm + BM_REG_COMMAND, 0);
+    outb(ch->bm + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);
+    ch->busy = 0;
+    ch->result = 0;
+    irq_restore(flags);
+    return 0;
+}
+
+static int ide_dma_transfer(int drive, uint32_t lba, uint32_t count, uint8_t* buffer, int write) {
+    const ATA_DEVICE_INFO* info = ata_get_device_info(drive);
+    if (!info) return 0;
+
+    uint32_t max = ide_dma_max_sectors(drive);
+    while (count) {
+        uint32_t n = count < max ? count : max;
+        if (!ide_dma_start(drive, lba, n, buffer, write)) return 0;
+        if (!ide_dma_wait(drive / 2)) return 0;
+
+        lba += n;
+        count -= n;
+        buffer += n * info->logical_sector_size;
+    }
+    return 1; // success
+}
+
+int ide_dma_read(int drive, uint32_t lba, uint32_t count, uint8_t* buffer) {
+    return ide_dma_transfer(drive, lba, count, buffer, 0);
+}
+
+int ide_dma_write(int drive, uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    return ide_dma_transfer(drive, lba, count, (uint8_t*)buffer, 1);
+}
+
+// FLUSH CACHE moves no data: issue it on the task file and poll BSY, which
+// also acknowledges the drive's INTRQ (the IRQ handler ignores idle channels).
+int ide_dma_flush(int drive) {
+    if (!ide_present || drive < 0 || drive >= IDE_DMA_CHANNELS * 2) return 0;
+
+    const ATA_DEVICE_INFO* info = ata_get_device_info(drive);
+    IDE_CHANNEL* ch = &ide_channels[drive / 2];
+    if (!info) return 0;
+    if (!info->write_cache) return 1;
+    if (ch->busy && !ide_dma_wait(drive / 2)) return 0;
+
+    outb(ch->io + ATA_REG_HDDEVSEL, 0xE0 | ((drive % 2) << 4));
+    outb(ch->io + ATA_REG_COMMAND, info->flush_ext ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+    for (int i = 0; i < 4; i++) inb(ch->ctrl);     // 400ns for BSY to show
+
+    // A full cache can take a while to write out.
+    uint32_t start_ms = timer_ms();
+    uint32_t spins = 0;
+    uint8_t status;
+    while ((status = inb(ch->io + ATA_REG_STATUS)) & ATA_SR_BSY) {
+        if (timer_running() ? (timer_ms() - start_ms > IDE_DMA_TIMEOUT_MS) : (++spins > IDE_DMA_SPIN_TIMEOUT)) {
+            print("IDE flush timed out\n");
+            return 0;
+        }
+    }
+    return !(status & (ATA_SR_ERR | ATA_SR_DF));
+}
@@ -0,0 +1,34 @@
+#ifndef IDE_DMA_H
+#define IDE_DMA_H
+
+#include <stdint.h>
+
+// Bus-master IDE (PIIX-style BAR4) DMA for the legacy ATA positions.
+// Drives are numbered as in drive_tools.h: 0/1 primary master/slave,
+// 2/3 secondary master/slave.
+#define IDE_DMA_CHANNELS 2
+
+// Find the IDE controller, enable bus mastering and hook IRQs 14/15.
+void ide_dma_init(void);
+int ide_dma_available(int drive);
+
+// Blocking transfers with the same shape as ata_pio_read/ata_pio_write,
+// but any number of sectors. Return 1 on success, 0 on error.
+int ide_dma_read(int drive, uint32_t lba, uint32_t count, uint8_t* buffer);
+int ide_dma_write(int drive, uint32_t lba, uint32_t count, const uint8_t* buffer);
+
+// Write barrier: FLUSH CACHE (EXT) on any of the four drives. Returns 1
+// once completed writes are on media, 0 on error or timeout.
+int ide_dma_flush(int drive);
+
+// Split form: start one command (at most ide_dma_max_sectors(drive)) and
+// collect it later, so the primary and secondary channels can transfer
+// at the same time. ide_dma_poll returns IDE_DMA_BUSY while in flight.
+#define IDE_DMA_BUSY 2
+
+uint32_t ide_dma_max_sectors(int drive);
+int ide_dma_start(int drive, uint32_t lba, uint32_t count, uint8_t* buffer, int write);
+int ide_dma_poll(int channel);
+int ide_dma_wait(int channel);
+
+#endif
@@ -0,0 +1,150 @@
+#include "interrupts.h"
+#include "port_io.h"
+#include "mem.h"
+
+#define PIC1_CMD   0x20
+#define PIC1_DATA  0x21
+#define PIC2_CMD   0xA0
+#define PIC2_DATA  0xA1
+#define PIC_EOI    0x20
+
+#define IDT_ENTRIES 256
+#define IRQ_MAX_HANDLERS 4
+
+#pragma pack(push, 1)
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t  zero;
+    uint8_t  type_attr;
+    uint16_t offset_high;
+} IDT_ENTRY;
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} IDT_PTR;
+
+#pragma pack(pop)
+
+// Stubs in isr.s: save registers, call irq_dispatch(irq), iret.
+extern void irq_stub_0(void);  extern void irq_stub_1(void);
+extern void irq_stub_2(void);  extern void irq_stub_3(void);
+extern void irq_stub_4(void);  extern void irq_stub_5(void);
+extern void irq_stub_6(void);  extern void irq_stub_7(void);
+extern void irq_stub_8(void);  extern void irq_stub_9(void);
+extern void irq_stub_10(void); extern void irq_stub_11(void);
+extern void irq_stub_12(void); extern void irq_stub_13(void);
+extern void irq_stub_14(void); extern void irq_stub_15(void);
+
+static void (*const irq_stubs[IRQ_COUNT])(void) = {
+    irq_stub_0,  irq_stub_1,  irq_stub_2,  irq_stub_3,
+    irq_stub_4,  irq_stub_5,  irq_stub_6,  irq_stub_7,
+    irq_stub_8,  irq_stub_9,  irq_stub_10, irq_stub_11,
+    irq_stub_12, irq_stub_13, irq_stub_14, irq_stub_15
+};
+
+static IDT_ENTRY idt[IDT_ENTRIES];
+static irq_handler_t irq_handlers[IRQ_COUNT][IRQ_MAX_HANDLERS];
+static uint16_t irq_mask_bits = 0xFFFF;
+
+static void idt_set_gate(uint8_t vector, void (*handler)(void), uint16_t selector) {
+    uint32_t addr = (uint32_t)(uintptr_t)handler;
+    idt[vector].offset_low = addr & 0xFFFF;
+    idt[vector].selector = selector;
+    idt[vector].zero = 0;
+    idt[vector].type_attr = 0x8E;   // present, ring 0, 32-bit interrupt gate
+    idt[vector].offset_high = (addr >> 16) & 0xFFFF;
+}
+
+static void pic_write_mask(void) {
+    outb(PIC1_DATA, irq_mask_bits & 0xFF);
+    outb(PIC2_DATA, (irq_mask_bits >> 8) & 0xFF);
+}
+
+static void pic_remap(void) {
+    outb(PIC1_CMD, 0x11);               // ICW1: init, expect ICW4
+    outb(PIC2_CMD, 0x11);
+    outb(PIC1_DATA, IRQ_BASE_VECTOR);   // ICW2: vector offsets
+    outb(PIC2_DATA, IRQ_BASE_VECTOR + 8);
+    outb(PIC1_DATA, 0x04);              // ICW3: slave on IRQ2
+    outb(PIC2_DATA, 0x02);
+    outb(PIC1_DATA, 0x01);              // ICW4: 8086 mode
+    outb(PIC2_DATA, 0x01);
+    pic_write_mask();
+}
+
+void interrupts_init(void) {
+    uint16_t cs;
+    asm volatile ("mov %%cs, %0" : "=r"(cs));
+
+    memset(idt, 0, sizeof(idt));
+    for (int i = 0; i < IRQ_COUNT; i++) {
+        idt_set_gate(IRQ_BASE_VECTOR + i, irq_stubs[i], cs);
+    }
+
+    IDT_PTR ptr;
+    ptr.limit = sizeof(idt) - 1;
+    ptr.base = (uint32_t)(uintptr_t)idt;
+    asm volatile ("lidt %0" : : "m"(ptr));
+
+    pic_remap();
+    asm volatile ("sti");
+}
+
+// Called from the assembly stubs with interrupts disabled.
+void irq_dispatch(uint32_t irq) {
+    for (int i = 0; i < IRQ_MAX_HANDLERS; i++) {
+        if (irq_handlers[irq][i]) irq_handlers[irq][i]((uint8_t)irq);
+    }
+
+    if (irq >= 8) outb(PIC2_CMD, PIC_EOI);
+    outb(PIC1_CMD, PIC_EOI);
+}
+
+int irq_register_handler(uint8_t irq, irq_handler_t handler) {
+    if (irq >= IRQ_COUNT) return -1;
+
+    uint32_t flags = irq_save();
+    for (int i = 0; i < IRQ_MAX_HANDLERS; i++) {
+        if (irq_handlers[irq][i] == handler) break;
+        if (!irq_handlers[irq][i]) {
+            irq_handlers[irq][i] = handler;
+            break;
+        }
+    }
+    irq_restore(flags);
+
+    irq_unmask(irq);
+    return 0;
+}
+
+void irq_mask(uint8_t irq) {
+    if (irq >= IRQ_COUNT) return;
+    irq_mask_bits |= (1 << irq);
+    pic_write_mask();
+}
+
+void irq_unmask(uint8_t irq) {
+    if (irq >= IRQ_COUNT) return;
+    irq_mask_bits &= ~(1 << irq);
+    if (irq >= 8) irq_mask_bits &= ~(1 << 2);  // cascade
+    pic_write_mask();
+}
+
+uint32_t irq_save(void) {
+    uint32_t flags;
+    asm volatile ("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+void irq_restore(uint32_t flags) {
+    if (flags & (1 << 9)) asm volatile ("sti" : : : "memory");
+}
+
+void irq_wait(void) {
+    // sti only takes effect after the next instruction, so an interrupt
+    // arriving between the caller's check and hlt still wakes us.
+    asm volatile ("sti; hlt" : : : "memory");
+}
@@ -0,0 +1,28 @@
+#ifndef INTERRUPTS_H
+#define INTERRUPTS_H
+
+#include <stdint.h>
+
+// Hardware IRQs 0-15 are remapped to vectors 0x20-0x2F.
+#define IRQ_BASE_VECTOR 0x20
+#define IRQ_COUNT       16
+
+typedef void (*irq_handler_t)(uint8_t irq);
+
+// Build the IDT, remap the PICs with every line masked and enable interrupts.
+void interrupts_init(void);
+
+// Add a handler to an IRQ line and unmask it. Lines may be shared, so
+// handlers must check whether their device actually raised the interrupt.
+int irq_register_handler(uint8_t irq, irq_handler_t handler);
+void irq_mask(uint8_t irq);
+void irq_unmask(uint8_t irq);
+
+// Save/restore the interrupt flag around state shared with handlers.
+uint32_t irq_save(void);
+void irq_restore(uint32_t flags);
+
+// Sleep until the next interrupt.
+void irq_wait(void);
+
+#endif
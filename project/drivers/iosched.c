@@ -0,0 +1,160 @@
+// iosched.c
+
+#include "iosched.h"
+#include "timer.h"
+
+static uint32_t iosched_segs_sectors(BLOCK_DEVICE* dev, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    uint32_t bytes = 0;
+    for (uint32_t i = 0; i < seg_count; i++) bytes += segs[i].length;
+    return bytes / dev->sector_size;
+}
+
+int iosched_submit(IO_REQUEST* req) {
+    BLOCK_DEVICE* dev = req->dev;
+    if (!dev || !dev->ops || req->prio < 0 || req->prio >= IOPRIO_CLASSES) {
+        req->status = -1;
+        return -1;
+    }
+
+    req->count = iosched_segs_sectors(dev, req->segs, req->seg_count);
+    req->deadline = timer_ms() + (req->write ? IOSCHED_WRITE_DEADLINE_MS : IOSCHED_READ_DEADLINE_MS);
+    req->status = IOSCHED_PENDING;
+    req->submit_tsc = timer_rdtsc();
+    iostat_queue_enter(&dev->stats);
+
+    // Sorted insert; equal LBAs keep arrival order.
+    IO_REQUEST** link = &dev->io_queue[req->prio];
+    while (*link && (*link)->lba <= req->lba) link = &(*link)->next;
+    req->next = *link;
+    *link = req;
+    return 0;
+}
+
+static int iosched_expired(IO_REQUEST* req, uint32_t now) {
+    return timer_running() && (int32_t)(now - req->deadline) >= 0;
+}
+
+// Choose the request to dispatch next and the class list it is on.
+static IO_REQUEST* iosched_pick(BLOCK_DEVICE* dev, int* prio_out) {
+    uint32_t now = timer_ms();
+    IO_REQUEST* oldest = 0;
+
+    for (int p = 0; p < IOPRIO_CLASSES; p++) {
+        for (IO_REQUEST* r = dev->io_queue[p]; r; r = r->next) {
+            if (!iosched_expired(r, now)) continue;
+            if (!oldest || (int32_t)(r->deadline - oldest->deadline) < 0) {
+                oldest = r;
+                *prio_out = p;
+            }
+        }
+    }
+    if (oldest) return oldest;
+
+    for (int p = 0; p < IOPRIO_CLASSES; p++) {
+        IO_REQUEST* r = dev->io_queue[p];
+        if (!r) continue;
+
+        // One-way elevator: the first request at or past the head,
+        // otherwise wrap to the lowest LBA.
+        *prio_out = p;
+        for (IO_REQUEST* s = r; s; s = s->next) {
+            if (s->lba >= dev->io_head) return s;
+        }
+        return r;
+    }
+    return 0;
+}
+
+static void iosched_unlink(BLOCK_DEVICE* dev, int prio, IO_REQUEST* req) {
+    IO_REQUEST** link = &dev->io_queue[prio];
+    while (*link && *link != req) link = &(*link)->next;
+    if (*link) *link = req->next;
+    req->next = 0;
+}
+
+int iosched_dispatch(BLOCK_DEVICE* dev) {
+    int prio = 0;
+    IO_REQUEST* first = iosched_pick(dev, &prio);
+    if (!first) return 0;
+
+    // Gather the contiguous run that starts at first. The class list is
+    // sorted, so mergeable requests follow it directly.
+    IO_REQUEST* batch[IOSCHED_MAX_MERGE_SEGS];
+    BLOCK_SEGMENT segs[IOSCHED_MAX_MERGE_SEGS];
+    uint32_t nreq = 0;
+    uint32_t nseg = 0;
+    uint64_t end = first->lba;
+
+    for (IO_REQUEST* r = first; r; r = r->next) {
+        if (r != first && (r->write != first->write || r->lba != end)) break;
+        if (nseg + r->seg_count > IOSCHED_MAX_MERGE_SEGS) break;
+        for (uint32_t i = 0; i < r->seg_count; i++) segs[nseg++] = r->segs[i];
+        batch[nreq++] = r;
+        end = r->lba + r->count;
+    }
+
+    int status;
+    if (nreq == 0) {
+        // A single request with more segments than we can merge.
+        batch[nreq++] = first;
+        end = first->lba + first->count;
+        status = first->write ? blockdev_raw_writev(dev, first->lba, first->segs, first->seg_count)
+                              : blockdev_raw_readv(dev, first->lba, first->segs, first->seg_count);
+    } else {
+        status = first->write ? blockdev_raw_writev(dev, first->lba, segs, nseg)
+                              : blockdev_raw_readv(dev, first->lba, segs, nseg);
+    }
+    dev->io_head = end;
+    dev->stats.merges += nreq - 1;
+
+    for (uint32_t i = 0; i < nreq; i++) {
+        IO_REQUEST* r = batch[i];
+        iosched_unlink(dev, prio, r);
+        iostat_queue_leave(&dev->stats);
+        iostat_account(&dev->stats, r->write ? IOSTAT_WRITE : IOSTAT_READ, r->count, r->submit_tsc, status != 0);
+        r->status = status == 0 ? 0 : -1;
+        if (r->callback) r->callback(r);
+    }
+    return nreq;
+}
+
+int iosched_wait(IO_REQUEST* req) {
+    while (req->status == IOSCHED_PENDING) {
+        if (iosched_dispatch(req->dev) == 0) break;
+    }
+    return req->status;
+}
+
+int iosched_pending(BLOCK_DEVICE* dev) {
+    int count = 0;
+    for (int p = 0; p < IOPRIO_CLASSES; p++) {
+        for (IO_REQUEST* r = dev->io_queue[p]; r; r = r->next) count++;
+    }
+    return count;
+}
+
+void iosched_run(BLOCK_DEVICE* dev) {
+    if (dev) {
+        while (iosched_dispatch(dev));
+        return;
+    }
+    for (int i = 0; i < blockdev_count(); i++) {
+        BLOCK_DEVICE* d = blockdev_get(i);
+        while (iosched_dispatch(d));
+    }
+}
+
+int iosched_transfer(BLOCK_DEVICE* dev, int write, int prio, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    IO_REQUEST req;
+    req.dev = dev;
+    req.write = write;
+    req.prio = prio;
+    req.lba = lba;
+    req.segs = segs;
+    req.seg_count = seg_count;
+    req.callback = 0;
+    req.context = 0;
+
+    if (iosched_submit(&req) != 0) return -1;
+    return iosched_wait(&req);
+}
@@ -0,0 +1,64 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include <stdint.h>
+#include "blockdev.h"
+
+// I/O scheduler between the buffer cache and the drivers. Requests queue
+// per device and priority class, sorted by LBA. Each dispatch issues one
+// transfer: a request whose deadline has passed if there is one,
+// otherwise the next request in ascending LBA order (wrapping around) from
+// the highest non-empty class. Contiguous requests in the same direction
+// are merged into that transfer.
+
+#define IOPRIO_INTERACTIVE 0    // someone is waiting on it
+#define IOPRIO_BACKGROUND  1    // write-back
+#define IOPRIO_CLASSES     2
+
+#define IOSCHED_READ_DEADLINE_MS  50
+#define IOSCHED_WRITE_DEADLINE_MS 500
+#define IOSCHED_MAX_MERGE_SEGS    128
+
+#define IOSCHED_PENDING 1
+
+typedef struct IO_REQUEST IO_REQUEST;
+typedef void (*io_callback_t)(IO_REQUEST* req);
+
+struct IO_REQUEST {
+    BLOCK_DEVICE* dev;
+    int write;
+    int prio;
+    uint64_t lba;
+    uint32_t count;                 // sectors
+    const BLOCK_SEGMENT* segs;
+    uint32_t seg_count;
+    io_callback_t callback;         // runs when the transfer completes
+    void* context;
+    volatile int status;            // IOSCHED_PENDING, 0 or -1
+
+    // Scheduler bookkeeping
+    uint32_t deadline;              // timer_ms() value
+    uint64_t submit_tsc;            // latency is measured from submission
+    IO_REQUEST* next;
+};
+
+// Queue a request. The request and its segments must stay valid until it
+// completes.
+int iosched_submit(IO_REQUEST* req);
+
+// Issue one (possibly merged) transfer for dev. Returns the number of
+// requests it completed, 0 if the queue was empty.
+int iosched_dispatch(BLOCK_DEVICE* dev);
+
+// Dispatch until req has completed; returns its status.
+int iosched_wait(IO_REQUEST* req);
+
+// Dispatch until dev's queues are empty (every device's if dev is 0).
+void iosched_run(BLOCK_DEVICE* dev);
+
+int iosched_pending(BLOCK_DEVICE* dev);
+
+// Submit and wait in one call.
+int iosched_transfer(BLOCK_DEVICE* dev, int write, int prio, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count);
+
+#endif
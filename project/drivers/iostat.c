@@ -0,0 +1,74 @@
+// iostat.c
+
+#include "iostat.h"
+#include "print.h"
+#include "timer.h"
+
+static int iostat_bucket(uint32_t us) {
+    int bucket = 0;
+    while (us > 1 && bucket < IOSTAT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void iostat_account(IO_STATS* stats, int op, uint32_t sectors, uint64_t start_tsc, int error) {
+    if (op < 0 || op >= IOSTAT_OPS) return;
+
+    stats->requests[op]++;
+    if (error) {
+        stats->errors++;
+        return;
+    }
+    stats->sectors[op] += sectors;
+    stats->latency[op][iostat_bucket(timer_elapsed_us(start_tsc))]++;
+}
+
+void iostat_queue_enter(IO_STATS* stats) {
+    stats->queue_depth++;
+    if (stats->queue_depth > stats->max_queue_depth) stats->max_queue_depth = stats->queue_depth;
+}
+
+void iostat_queue_leave(IO_STATS* stats) {
+    if (stats->queue_depth) stats->queue_depth--;
+}
+
+static const char* iostat_op_names[IOSTAT_OPS] = { "read ", "write", "flush" };
+
+void iostat_print(const char* name, const IO_STATS* stats) {
+    print(name);
+    print(": merges ");
+    print_uint(stats->merges);
+    print(", errors ");
+    print_uint(stats->errors);
+    print(", timeouts ");
+    print_uint(stats->timeouts);
+    print(", queue ");
+    print_uint(stats->queue_depth);
+    print(" (max ");
+    print_uint(stats->max_queue_depth);
+    print(")\n");
+
+    for (int op = 0; op < IOSTAT_OPS; op++) {
+        if (!stats->requests[op]) continue;
+
+        print("  ");
+        print(iostat_op_names[op]);
+        print(" ");
+        print_uint(stats->requests[op]);
+        print(" req, ");
+        print_uint((uint32_t)stats->sectors[op]);
+        print(" sectors\n    us:");
+
+        // "lower bound:count" for every non-empty bucket
+        for (int b = 0; b < IOSTAT_BUCKETS; b++) {
+            if (!stats->latency[op][b]) continue;
+            print(" ");
+            print_uint(b ? (1u << b) : 0);
+            print(":");
+            print_uint(stats->latency[op][b]);
+        }
+        print("\n");
+    }
+}
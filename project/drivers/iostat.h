@@ -0,0 +1,36 @@
+#ifndef IOSTAT_H
+#define IOSTAT_H
+
+#include <stdint.h>
+
+// I/O counters and latency histograms, kept per block device and per AHCI
+// port. Latencies are measured with the TSC; bucket i counts operations
+// that took [2^i, 2^(i+1)) microseconds (bucket 0 also takes 0 us).
+
+#define IOSTAT_READ    0
+#define IOSTAT_WRITE   1
+#define IOSTAT_FLUSH   2
+#define IOSTAT_OPS     3
+
+#define IOSTAT_BUCKETS 24       // up to ~16 s
+
+typedef struct {
+    uint32_t requests[IOSTAT_OPS];
+    uint64_t sectors[IOSTAT_OPS];
+    uint32_t merges;            // requests folded into another's transfer
+    uint32_t errors;
+    uint32_t timeouts;
+    uint32_t queue_depth;       // currently queued or in flight
+    uint32_t max_queue_depth;
+    uint32_t latency[IOSTAT_OPS][IOSTAT_BUCKETS];
+} IO_STATS;
+
+// Record one completed operation that started at start_tsc (timer_rdtsc()).
+void iostat_account(IO_STATS* stats, int op, uint32_t sectors, uint64_t start_tsc, int error);
+
+void iostat_queue_enter(IO_STATS* stats);
+void iostat_queue_leave(IO_STATS* stats);
+
+void iostat_print(const char* name, const IO_STATS* stats);
+
+#endif
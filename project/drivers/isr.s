@@ -0,0 +1,30 @@
+.section .text
+
+.macro IRQ_STUB num
+.global irq_stub_\num
+irq_stub_\num:
+    pusha
+    cld
+    pushl $\num
+    call irq_dispatch
+    addl $4, %esp
+    popa
+    iret
+.endm
+
+IRQ_STUB 0
+IRQ_STUB 1
+IRQ_STUB 2
+IRQ_STUB 3
+IRQ_STUB 4
+IRQ_STUB 5
+IRQ_STUB 6
+IRQ_STUB 7
+IRQ_STUB 8
+IRQ_STUB 9
+IRQ_STUB 10
+IRQ_STUB 11
+IRQ_STUB 12
+IRQ_STUB 13
+IRQ_STUB 14
+IRQ_STUB 15
@@ -7,9 +7,27 @@ void* memset(void* dest, int value, unsigned int count) {
     return dest;
 }
 
+// Dwords first, then the tail bytes.
 void* memcpy(void* dest, const void* src, unsigned int count) {
+    void* d = dest;
+    const void* s = src;
+    unsigned int dwords = count >> 2;
+    unsigned int bytes = count & 3;
+    __asm__ volatile ("cld; rep movsl; mov %3, %%ecx; rep movsb"
+                      : "+D"(d), "+S"(s), "+c"(dwords)
+                      : "r"(bytes)
+                      : "memory");
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, unsigned int count) {
     unsigned char* dst = (unsigned char*)dest;
     const unsigned char* src8 = (const unsigned char*)src;
-    while (count--) *dst++ = *src8++;
+    if (dst <= src8 || dst >= src8 + count) return memcpy(dest, src, count);
+
+    // Overlapping with dest above src: copy from the end.
+    dst += count;
+    src8 += count;
+    while (count--) *--dst = *--src8;
     return dest;
 }
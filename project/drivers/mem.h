@@ -6,5 +6,6 @@
 
 void* memset(void* dest, int value, unsigned int count);
 void* memcpy(void* dest, const void* src, unsigned int count);
+void* memmove(void* dest, const void* src, unsigned int count);
 
 #endif
@@ -0,0 +1,32 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include <stdint.h>
+
+// The parts of the Multiboot (0.6.96) boot information we use. GRUB
+// leaves MULTIBOOT_BOOTLOADER_MAGIC in eax and the info's address in ebx.
+
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+
+#define MULTIBOOT_INFO_MEMORY  0x001    // mem_lower/mem_upper are valid
+#define MULTIBOOT_INFO_CMDLINE 0x004
+#define MULTIBOOT_INFO_MODS    0x008
+
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;         // KiB below 1 MiB
+    uint32_t mem_upper;         // KiB from 1 MiB to the first hole
+    uint32_t boot_device;
+    uint32_t cmdline;           // physical address of a C string
+    uint32_t mods_count;
+    uint32_t mods_addr;         // physical address of MULTIBOOT_MODULE[mods_count]
+} __attribute__((packed)) MULTIBOOT_INFO;
+
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;           // one past the last byte
+    uint32_t string;
+    uint32_t reserved;
+} __attribute__((packed)) MULTIBOOT_MODULE;
+
+#endif
@@ -0,0 +1,722 @@
+// nvme.c
+
+#include "nvme.h"
+#include "print.h"
+#include "pci.h"
+#include "timer.h"
+#include "mem.h"
+#include "dma.h"
+
+#define NVME_PAGE_SIZE       4096
+#define NVME_PAGE_MASK       (NVME_PAGE_SIZE - 1)
+
+typedef volatile struct {
+    uint32_t cap_lo;
+    uint32_t cap_hi;
+    uint32_t vs;
+    uint32_t intms;
+    uint32_t intmc;
+    uint32_t cc;
+    uint32_t rsv0;
+    uint32_t csts;
+    uint32_t nssr;
+    uint32_t aqa;
+    uint32_t asq_lo;
+    uint32_t asq_hi;
+    uint32_t acq_lo;
+    uint32_t acq_hi;
+} NVME_REGS;
+
+#define NVME_CAP_MQES(lo)    ((lo) & 0xFFFF)
+#define NVME_CAP_TO(lo)      (((lo) >> 24) & 0xFF)  // 500 ms units
+#define NVME_CAP_DSTRD(hi)   ((hi) & 0xF)
+#define NVME_CAP_MPSMIN(hi)  (((hi) >> 16) & 0xF)
+
+#define NVME_CC_EN           (1u << 0)
+#define NVME_CC_IOSQES       (6u << 16)     // 64-byte submission entries
+#define NVME_CC_IOCQES       (4u << 20)     // 16-byte completion entries
+#define NVME_CSTS_RDY        (1u << 0)
+#define NVME_CSTS_CFS        (1u << 1)
+#define NVME_DOORBELL_BASE   0x1000
+
+// Admin commands
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+#define NVME_FEAT_NUM_QUEUES    0x07
+#define NVME_IDENTIFY_NS        0x00
+#define NVME_IDENTIFY_CTRL      0x01
+#define NVME_QUEUE_CONTIGUOUS   0x01
+
+// NVM commands
+#define NVME_CMD_FLUSH       0x00
+#define NVME_CMD_WRITE       0x01
+#define NVME_CMD_READ        0x02
+#define NVME_CMD_DSM         0x09
+#define NVME_RW_FUA          (1u << 30)
+#define NVME_DSM_DEALLOCATE  (1u << 2)
+#define NVME_DSM_MAX_RANGES  256
+
+#define NVME_ONCS_DSM        (1u << 2)
+#define NVME_VWC_PRESENT     0x01
+
+#define NVME_ADMIN_ENTRIES   16
+#define NVME_IO_ENTRIES      32
+#define NVME_PRP_ENTRIES     (NVME_PAGE_SIZE / 8)   // per PRP list page
+
+#define NVME_CMD_TIMEOUT_MS  5000
+#define NVME_SPIN_TIMEOUT    10000000
+
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t reserved;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed)) NVME_COMMAND;
+
+typedef struct {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;            // bit 0 is the phase tag
+} __attribute__((packed)) NVME_COMPLETION;
+
+typedef struct {
+    uint32_t attributes;
+    uint32_t nlb;
+    uint64_t slba;
+} __attribute__((packed)) NVME_DSM_RANGE;
+
+typedef struct {
+    uint16_t id;
+    uint16_t entries;
+    volatile NVME_COMMAND* sq;
+    volatile NVME_COMPLETION* cq;
+    volatile uint32_t* sq_doorbell;
+    volatile uint32_t* cq_doorbell;
+    uint16_t sq_tail;
+    uint16_t sq_rung;           // tail last written to the doorbell
+    uint16_t cq_head;
+    uint8_t phase;
+    uint32_t inflight;          // usable command IDs
+    uint32_t busy;              // command ID bitmask
+    uint32_t errors;            // completions with a non-zero status
+    uint32_t result;            // dword 0 of the last completion
+    uint64_t* prp_lists;        // one page per command ID (I/O queues)
+
+    // From the DMA pool: a page per ring, allocated on first use
+    DMA_BUFFER sq_dma;
+    DMA_BUFFER cq_dma;
+    DMA_BUFFER prp_dma;
+} NVME_QUEUE;
+
+typedef struct NVME_CONTROLLER NVME_CONTROLLER;
+
+typedef struct {
+    NVME_CONTROLLER* ctrl;
+    uint32_t nsid;
+    uint32_t lba_shift;
+    BLOCK_DEVICE blockdev;
+} NVME_NAMESPACE;
+
+struct NVME_CONTROLLER {
+    NVME_REGS* regs;
+    DMA_BUFFER scratch_dma;     // identify data, DSM ranges
+    uint32_t dstrd;
+    uint32_t ready_timeout_ms;
+    uint32_t io_entries;
+    NVME_QUEUE admin;
+    NVME_QUEUE io[NVME_IO_QUEUES];
+    uint32_t io_count;
+    uint32_t next_queue;        // round-robin position
+    uint32_t max_prps;          // PRP entries per command (MDTS)
+    uint16_t oncs;
+    uint8_t vwc;
+    NVME_NAMESPACE ns[NVME_MAX_NAMESPACES];
+};
+
+static NVME_CONTROLLER nvme_ctrls[NVME_MAX_CONTROLLERS];
+static int nvme_ctrl_count = 0;
+
+static volatile uint32_t* nvme_doorbell(NVME_CONTROLLER* ctrl, uint16_t qid, int cq) {
+    uintptr_t offset = NVME_DOORBELL_BASE + (2 * qid + cq) * (4u << ctrl->dstrd);
+    return (volatile uint32_t*)((uintptr_t)ctrl->regs + offset);
+}
+
+static void nvme_queue_free(NVME_QUEUE* q) {
+    dma_free(&q->sq_dma);
+    dma_free(&q->cq_dma);
+    dma_free(&q->prp_dma);
+}
+
+// Allocate the rings, plus PRP list pages for an I/O queue. A restart
+// reuses what the queue already has.
+static int nvme_queue_alloc(NVME_QUEUE* q, int io) {
+    if (q->sq_dma.virt) return 0;
+    int ok = dma_alloc(&q->sq_dma, NVME_PAGE_SIZE, NVME_PAGE_SIZE) == 0 &&
+             dma_alloc(&q->cq_dma, NVME_PAGE_SIZE, NVME_PAGE_SIZE) == 0 &&
+             (!io || dma_alloc(&q->prp_dma, NVME_QUEUE_INFLIGHT * NVME_PAGE_SIZE, NVME_PAGE_SIZE) == 0);
+    if (ok) return 0;
+
+    nvme_queue_free(q);
+    return -1;
+}
+
+static void nvme_queue_setup(NVME_CONTROLLER* ctrl, NVME_QUEUE* q, uint16_t id, uint16_t entries) {
+    q->id = id;
+    q->entries = entries;
+    q->sq = (volatile NVME_COMMAND*)q->sq_dma.virt;
+    q->cq = (volatile NVME_COMPLETION*)q->cq_dma.virt;
+    q->sq_doorbell = nvme_doorbell(ctrl, id, 0);
+    q->cq_doorbell = nvme_doorbell(ctrl, id, 1);
+    q->sq_tail = 0;
+    q->sq_rung = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+    q->inflight = entries - 1 < NVME_QUEUE_INFLIGHT ? entries - 1 : NVME_QUEUE_INFLIGHT;
+    q->busy = 0;
+    q->prp_lists = q->prp_dma.virt;
+    memset(q->sq_dma.virt, 0, entries * sizeof(NVME_COMMAND));
+    memset(q->cq_dma.virt, 0, entries * sizeof(NVME_COMPLETION));
+}
+
+// Copy a command into the submission queue. The controller does not see
+// it until the next nvme_ring.
+static void nvme_submit(NVME_QUEUE* q, const NVME_COMMAND* cmd) {
+    memcpy((void*)&q->sq[q->sq_tail], cmd, sizeof(NVME_COMMAND));
+    q->busy |= 1u << cmd->cid;
+    if (++q->sq_tail == q->entries) q->sq_tail = 0;
+}
+
+static void nvme_ring(NVME_QUEUE* q) {
+    if (q->sq_tail == q->sq_rung) return;
+    __asm__ volatile ("" ::: "memory");
+    *q->sq_doorbell = q->sq_tail;
+    q->sq_rung = q->sq_tail;
+}
+
+// Consume new completion entries and release one CQ doorbell write for
+// all of them. Returns how many there were.
+static int nvme_reap(NVME_QUEUE* q) {
+    int count = 0;
+    while (1) {
+        volatile NVME_COMPLETION* c = &q->cq[q->cq_head];
+        uint16_t status = c->status;
+        if ((status & 1) != q->phase) break;
+        __asm__ volatile ("" ::: "memory");
+
+        if (c->cid < q->inflight) q->busy &= ~(1u << c->cid);
+        if (status >> 1) q->errors++;
+        q->result = c->result;
+        count++;
+
+        if (++q->cq_head == q->entries) {
+            q->cq_head = 0;
+            q->phase ^= 1;
+        }
+    }
+    if (count) *q->cq_doorbell = q->cq_head;
+    return count;
+}
+
+// Poll until something completes on q, or on any I/O queue if q is 0.
+static int nvme_wait(NVME_CONTROLLER* ctrl, NVME_QUEUE* q) {
+    uint32_t start_ms = timer_ms();
+    uint32_t spins = 0;
+
+    while (1) {
+        int n = 0;
+        if (q) {
+            n = nvme_reap(q);
+        } else {
+            for (uint32_t i = 0; i < ctrl->io_count; i++) n += nvme_reap(&ctrl->io[i]);
+        }
+        if (n) return 0;
+
+        if (timer_running() ? (timer_ms() - start_ms > NVME_CMD_TIMEOUT_MS) : (++spins > NVME_SPIN_TIMEOUT)) {
+            break;
+        }
+        __asm__ volatile ("pause");
+    }
+
+    print("NVMe command timed out\n");
+    return -1;
+}
+
+static int nvme_admin(NVME_CONTROLLER* ctrl, NVME_COMMAND* cmd, uint32_t* result) {
+    NVME_QUEUE* q = &ctrl->admin;
+    uint32_t errors = q->errors;
+
+    cmd->cid = 0;
+    nvme_submit(q, cmd);
+    nvme_ring(q);
+    while (q->busy) {
+        if (nvme_wait(ctrl, q) != 0) return -1;
+    }
+
+    if (result) *result = q->result;
+    return q->errors == errors ? 0 : -1;
+}
+
+static int nvme_wait_ready(NVME_CONTROLLER* ctrl, uint32_t ready) {
+    uint32_t start_ms = timer_ms();
+    uint32_t spins = 0;
+    while (((ctrl->regs->csts & NVME_CSTS_RDY) != 0) != ready) {
+        if (ready && (ctrl->regs->csts & NVME_CSTS_CFS)) return -1;
+        if (timer_running() ? (timer_ms() - start_ms > ctrl->ready_timeout_ms) : (++spins > NVME_SPIN_TIMEOUT)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int nvme_create_io_queues(NVME_CONTROLLER* ctrl) {
+    NVME_COMMAND cmd;
+    uint32_t result = 0;
+    uint32_t want = NVME_IO_QUEUES;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = ((want - 1) << 16) | (want - 1);
+    if (nvme_admin(ctrl, &cmd, &result) != 0) return -1;
+
+    // The controller may grant fewer (or more) than asked for.
+    if ((result & 0xFFFF) + 1 < want) want = (result & 0xFFFF) + 1;
+    if ((result >> 16) + 1 < want) want = (result >> 16) + 1;
+
+    ctrl->io_count = 0;
+    for (uint32_t i = 0; i < want; i++) {
+        NVME_QUEUE* q = &ctrl->io[i];
+        uint16_t qid = i + 1;
+        if (nvme_queue_alloc(q, 1) != 0) break;
+        nvme_queue_setup(ctrl, q, qid, ctrl->io_entries);
+
+        // Completion queue first; interrupts stay off, completions are polled.
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_ADMIN_CREATE_CQ;
+        cmd.prp1 = q->cq_dma.phys;
+        cmd.cdw10 = ((uint32_t)(q->entries - 1) << 16) | qid;
+        cmd.cdw11 = NVME_QUEUE_CONTIGUOUS;
+        if (nvme_admin(ctrl, &cmd, 0) != 0) break;
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_ADMIN_CREATE_SQ;
+        cmd.prp1 = q->sq_dma.phys;
+        cmd.cdw10 = ((uint32_t)(q->entries - 1) << 16) | qid;
+        cmd.cdw11 = ((uint32_t)qid << 16) | NVME_QUEUE_CONTIGUOUS;
+        if (nvme_admin(ctrl, &cmd, 0) != 0) break;
+
+        ctrl->io_count++;
+    }
+    ctrl->next_queue = 0;
+    return ctrl->io_count ? 0 : -1;
+}
+
+// Reset the controller, bring up the admin queue and the I/O queues.
+// Anything in flight is lost.
+static int nvme_start(NVME_CONTROLLER* ctrl) {
+    NVME_REGS* regs = ctrl->regs;
+
+    regs->cc &= ~NVME_CC_EN;
+    if (nvme_wait_ready(ctrl, 0) != 0) return -1;
+
+    if (nvme_queue_alloc(&ctrl->admin, 0) != 0) return -1;
+    nvme_queue_setup(ctrl, &ctrl->admin, 0, NVME_ADMIN_ENTRIES);
+
+    regs->aqa = ((NVME_ADMIN_ENTRIES - 1) << 16) | (NVME_ADMIN_ENTRIES - 1);
+    regs->asq_lo = ctrl->admin.sq_dma.phys;
+    regs->asq_hi = 0;
+    regs->acq_lo = ctrl->admin.cq_dma.phys;
+    regs->acq_hi = 0;
+    regs->intms = 0xFFFFFFFF;
+
+    // NVM command set, 4 KiB pages, round-robin arbitration
+    regs->cc = NVME_CC_IOSQES | NVME_CC_IOCQES | NVME_CC_EN;
+    if (nvme_wait_ready(ctrl, 1) != 0) return -1;
+
+    return nvme_create_io_queues(ctrl);
+}
+
+static int nvme_identify(NVME_CONTROLLER* ctrl, uint32_t cns, uint32_t nsid, uint8_t* buffer) {
+    NVME_COMMAND cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = dma_phys(buffer);
+    cmd.cdw10 = cns;
+    return nvme_admin(ctrl, &cmd, 0);
+}
+
+static int nvme_io_busy(NVME_CONTROLLER* ctrl) {
+    for (uint32_t i = 0; i < ctrl->io_count; i++) {
+        if (ctrl->io[i].busy) return 1;
+    }
+    return 0;
+}
+
+static uint32_t nvme_io_errors(NVME_CONTROLLER* ctrl) {
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < ctrl->io_count; i++) errors += ctrl->io[i].errors;
+    return errors;
+}
+
+// Next queue pair in round-robin order with a free command ID.
+static NVME_QUEUE* nvme_pick_queue(NVME_CONTROLLER* ctrl, uint16_t* cid) {
+    for (uint32_t i = 0; i < ctrl->io_count; i++) {
+        uint32_t index = (ctrl->next_queue + i) % ctrl->io_count;
+        NVME_QUEUE* q = &ctrl->io[index];
+        for (uint32_t id = 0; id < q->inflight; id++) {
+            if (q->busy & (1u << id)) continue;
+            ctrl->next_queue = (index + 1) % ctrl->io_count;
+            *cid = id;
+            return q;
+        }
+    }
+    return 0;
+}
+
+// Describe the data of the next command, starting at the cursor, with
+// PRP1 and the command ID's PRP list page. Only the first entry may
+// start inside a page and only the last may end inside one, so the
+// command stops at the first gap PRPs cannot express, at max_prps
+// entries, and then at a sector boundary. Returns the bytes covered and
+// advances the cursor; 0 if not even one sector can be described.
+static uint32_t nvme_build_prps(NVME_QUEUE* q, NVME_COMMAND* cmd, uint32_t max_prps, uint32_t sector_size,
+                                const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t* seg_io, uint32_t* off_io) {
+    uint64_t* list = q->prp_lists + cmd->cid * NVME_PRP_ENTRIES;
+    uint32_t seg = *seg_io;
+    uint32_t off = *off_io;
+    uint32_t n = 0;
+    uint32_t bytes = 0;
+    uint32_t first_len = 0;
+    uintptr_t end = 0;
+
+    while (seg < seg_count && n < max_prps) {
+        uint32_t len = segs[seg].length - off;
+        uintptr_t addr = (uintptr_t)segs[seg].buffer + off;
+        if (len == 0) {
+            seg++;
+            off = 0;
+            continue;
+        }
+        if (n && ((addr & NVME_PAGE_MASK) || (end & NVME_PAGE_MASK))) break;
+        if (addr & 3) break;    // PRP entries are dword aligned
+
+        while (len && n < max_prps) {
+            uint32_t chunk = NVME_PAGE_SIZE - (addr & NVME_PAGE_MASK);
+            if (chunk > len) chunk = len;
+            if (n == 0) {
+                cmd->prp1 = dma_phys((void*)addr);
+                first_len = chunk;
+            } else {
+                list[n - 1] = dma_phys((void*)addr);
+            }
+            n++;
+            bytes += chunk;
+            addr += chunk;
+            len -= chunk;
+            off += chunk;
+        }
+        end = addr;
+        if (off == segs[seg].length) {
+            seg++;
+            off = 0;
+        }
+    }
+
+    uint32_t keep = bytes - bytes % sector_size;
+    if (keep == 0) return 0;
+
+    // Entries between the first and the last cover whole pages.
+    n = keep <= first_len ? 1 : 1 + (keep - first_len + NVME_PAGE_MASK) / NVME_PAGE_SIZE;
+    if (n == 2) cmd->prp2 = list[0];
+    else if (n > 2) cmd->prp2 = q->prp_dma.phys + cmd->cid * NVME_PAGE_SIZE;
+
+    seg = *seg_io;
+    off = *off_io;
+    uint32_t left = keep;
+    while (left) {
+        uint32_t avail = segs[seg].length - off;
+        if (avail > left) {
+            off += left;
+            left = 0;
+        } else {
+            left -= avail;
+            seg++;
+            off = 0;
+        }
+    }
+    *seg_io = seg;
+    *off_io = off;
+    return keep;
+}
+
+// Split the transfer into commands, queue them round-robin over the I/O
+// queues while command IDs are free, ring each doorbell once, and keep
+// refilling as completions come in. Buffers must be dword aligned; a
+// buffer that starts or ends inside a page ends the command there, so it
+// must hold whole sectors.
+static int nvme_rw(NVME_NAMESPACE* ns, int write, int fua, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    NVME_CONTROLLER* ctrl = ns->ctrl;
+    uint32_t sector_size = 1u << ns->lba_shift;
+    uint32_t errors = nvme_io_errors(ctrl);
+    uint32_t seg = 0;
+    uint32_t off = 0;
+    int error = 0;
+
+    while ((seg < seg_count && !error) || nvme_io_busy(ctrl)) {
+        while (seg < seg_count && !error) {
+            while (seg < seg_count && segs[seg].length == off) {
+                seg++;
+                off = 0;
+            }
+            if (seg == seg_count) break;
+
+            uint16_t cid;
+            NVME_QUEUE* q = nvme_pick_queue(ctrl, &cid);
+            if (!q) break;
+
+            NVME_COMMAND cmd;
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.cid = cid;
+            uint32_t bytes = nvme_build_prps(q, &cmd, ctrl->max_prps, sector_size, segs, seg_count, &seg, &off);
+            if (!bytes) {
+                error = 1;
+                break;
+            }
+
+            uint32_t nlb = bytes >> ns->lba_shift;
+            cmd.opcode = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+            cmd.nsid = ns->nsid;
+            cmd.cdw10 = (uint32_t)lba;
+            cmd.cdw11 = (uint32_t)(lba >> 32);
+            cmd.cdw12 = (nlb - 1) | (fua ? NVME_RW_FUA : 0);
+            nvme_submit(q, &cmd);
+            lba += nlb;
+        }
+
+        for (uint32_t i = 0; i < ctrl->io_count; i++) nvme_ring(&ctrl->io[i]);
+
+        if (nvme_io_busy(ctrl) && nvme_wait(ctrl, 0) != 0) {
+            nvme_start(ctrl);
+            return -1;
+        }
+    }
+
+    if (nvme_io_errors(ctrl) != errors) error = 1;
+    return error ? -1 : 0;
+}
+
+// Issue one command whose data (if any) fits PRP1 and wait for it.
+static int nvme_io_sync(NVME_CONTROLLER* ctrl, NVME_COMMAND* cmd) {
+    uint32_t errors = nvme_io_errors(ctrl);
+    uint16_t cid;
+    NVME_QUEUE* q = nvme_pick_queue(ctrl, &cid);
+    if (!q) return -1;
+    cmd->cid = cid;
+
+    nvme_submit(q, cmd);
+    nvme_ring(q);
+    while (q->busy & (1u << cid)) {
+        if (nvme_wait(ctrl, 0) != 0) {
+            nvme_start(ctrl);
+            return -1;
+        }
+    }
+    return nvme_io_errors(ctrl) == errors ? 0 : -1;
+}
+
+static NVME_NAMESPACE* nvme_ns(BLOCK_DEVICE* dev) {
+    return (NVME_NAMESPACE*)dev->driver_data;
+}
+
+static int nvme_blk_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    return nvme_rw(nvme_ns(dev), 0, 0, lba, segs, seg_count);
+}
+
+static int nvme_blk_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    return nvme_rw(nvme_ns(dev), 1, 0, lba, segs, seg_count);
+}
+
+static int nvme_blk_read(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, void* buffer) {
+    BLOCK_SEGMENT seg = { buffer, count * dev->sector_size };
+    return nvme_rw(nvme_ns(dev), 0, 0, lba, &seg, 1);
+}
+
+static int nvme_blk_write(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    BLOCK_SEGMENT seg = { (void*)buffer, count * dev->sector_size };
+    return nvme_rw(nvme_ns(dev), 1, 0, lba, &seg, 1);
+}
+
+static int nvme_blk_write_fua(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    BLOCK_SEGMENT seg = { (void*)buffer, count * dev->sector_size };
+    return nvme_rw(nvme_ns(dev), 1, 1, lba, &seg, 1);
+}
+
+static int nvme_blk_flush(BLOCK_DEVICE* dev) {
+    NVME_NAMESPACE* ns = nvme_ns(dev);
+    if (!(ns->ctrl->vwc & NVME_VWC_PRESENT)) return 0;    // writes are durable on completion
+
+    NVME_COMMAND cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_CMD_FLUSH;
+    cmd.nsid = ns->nsid;
+    return nvme_io_sync(ns->ctrl, &cmd);
+}
+
+// DATASET MANAGEMENT with the deallocate attribute, up to
+// NVME_DSM_MAX_RANGES ranges per command.
+static int nvme_blk_discard(BLOCK_DEVICE* dev, const BLOCK_RANGE* ranges, uint32_t range_count) {
+    NVME_NAMESPACE* ns = nvme_ns(dev);
+    NVME_CONTROLLER* ctrl = ns->ctrl;
+    if (!(ctrl->oncs & NVME_ONCS_DSM)) return 0;
+
+    NVME_DSM_RANGE* dsm = ctrl->scratch_dma.virt;
+    while (range_count) {
+        uint32_t n = range_count < NVME_DSM_MAX_RANGES ? range_count : NVME_DSM_MAX_RANGES;
+        for (uint32_t i = 0; i < n; i++) {
+            dsm[i].attributes = 0;
+            dsm[i].nlb = ranges[i].count;
+            dsm[i].slba = ranges[i].lba;
+        }
+
+        NVME_COMMAND cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_CMD_DSM;
+        cmd.nsid = ns->nsid;
+        cmd.prp1 = ctrl->scratch_dma.phys;
+        cmd.cdw10 = n - 1;
+        cmd.cdw11 = NVME_DSM_DEALLOCATE;
+        if (nvme_io_sync(ctrl, &cmd) != 0) return -1;
+
+        ranges += n;
+        range_count -= n;
+    }
+    return 0;
+}
+
+static const BLOCK_DEVICE_OPS nvme_blk_ops = {
+    nvme_blk_read,
+    nvme_blk_write,
+    nvme_blk_readv,
+    nvme_blk_writev,
+    nvme_blk_flush,
+    nvme_blk_write_fua,
+    nvme_blk_discard,
+};
+
+static void nvme_add_namespace(NVME_CONTROLLER* ctrl, int ctrl_index, uint32_t nsid, const uint8_t* id) {
+    uint64_t nsze = *(const uint64_t*)&id[0];
+    if (nsze == 0) return;      // inactive
+
+    uint8_t flbas = id[26] & 0x0F;
+    const uint8_t* lbaf = &id[128 + flbas * 4];
+    uint16_t metadata = lbaf[0] | (lbaf[1] << 8);
+    uint8_t lbads = lbaf[2];
+    if (metadata || lbads < 9 || lbads > 12) {
+        print("NVMe: unsupported LBA format on namespace ");
+        print_uint(nsid);
+        print("\n");
+        return;
+    }
+
+    NVME_NAMESPACE* ns = &ctrl->ns[nsid - 1];
+    ns->ctrl = ctrl;
+    ns->nsid = nsid;
+    ns->lba_shift = lbads;
+
+    char prefix[8] = "nvme0n";
+    prefix[4] = '0' + ctrl_index;
+
+    BLOCK_DEVICE* dev = &ns->blockdev;
+    blockdev_set_name(dev, prefix, nsid);
+    dev->ops = &nvme_blk_ops;
+    dev->unit = nsid;
+    dev->driver_data = ns;
+    dev->sector_size = 1u << lbads;
+    dev->sector_count = nsze;
+    dev->max_sectors = 0;   // requests are split into commands internally
+    blockdev_register(dev);
+
+    print(dev->name);
+    print(": ");
+    print_uint((uint32_t)((nsze << lbads) >> 20));
+    print(" MiB, ");
+    print_uint(ctrl->io_count);
+    print(" I/O queues\n");
+}
+
+static void nvme_probe(const PCI_DEVICE* pci) {
+    uint32_t bar0 = pci_read_bar(pci, 0);
+    if (bar0 & 1) return;
+    if ((bar0 & 0x6) == 0x4 && pci_read_bar(pci, 1) != 0) {
+        print("NVMe: BAR above 4 GiB, skipped\n");
+        return;
+    }
+
+    int index = nvme_ctrl_count;
+    NVME_CONTROLLER* ctrl = &nvme_ctrls[index];
+    ctrl->regs = (NVME_REGS*)(uintptr_t)(bar0 & ~0xF);
+    if (!ctrl->scratch_dma.virt && dma_alloc(&ctrl->scratch_dma, NVME_PAGE_SIZE, NVME_PAGE_SIZE) != 0) {
+        print("NVMe: out of DMA memory\n");
+        return;
+    }
+    pci_enable_bus_master(pci);
+
+    uint32_t cap_lo = ctrl->regs->cap_lo;
+    uint32_t cap_hi = ctrl->regs->cap_hi;
+    if (NVME_CAP_MPSMIN(cap_hi) != 0) {
+        print("NVMe: controller does not support 4 KiB pages\n");
+        return;
+    }
+    ctrl->dstrd = NVME_CAP_DSTRD(cap_hi);
+    ctrl->ready_timeout_ms = NVME_CAP_TO(cap_lo) * 500;
+    if (ctrl->ready_timeout_ms == 0) ctrl->ready_timeout_ms = 500;
+    ctrl->io_entries = NVME_CAP_MQES(cap_lo) + 1 < NVME_IO_ENTRIES ? NVME_CAP_MQES(cap_lo) + 1 : NVME_IO_ENTRIES;
+
+    if (nvme_start(ctrl) != 0) {
+        print("NVMe: controller failed to start\n");
+        return;
+    }
+    nvme_ctrl_count++;
+
+    uint8_t* id = ctrl->scratch_dma.virt;
+    if (nvme_identify(ctrl, NVME_IDENTIFY_CTRL, 0, id) != 0) return;
+
+    uint8_t mdts = id[77];
+    uint32_t nn = id[516] | (id[517] << 8) | (id[518] << 16) | ((uint32_t)id[519] << 24);
+    ctrl->oncs = id[520] | (id[521] << 8);
+    ctrl->vwc = id[525];
+
+    // MDTS is a power of two in pages; 0 means no limit.
+    ctrl->max_prps = NVME_PRP_ENTRIES + 1;
+    if (mdts && mdts < 10 && (1u << mdts) < ctrl->max_prps) ctrl->max_prps = 1u << mdts;
+
+    if (nn > NVME_MAX_NAMESPACES) nn = NVME_MAX_NAMESPACES;
+    for (uint32_t nsid = 1; nsid <= nn; nsid++) {
+        if (nvme_identify(ctrl, NVME_IDENTIFY_NS, nsid, id) != 0) continue;
+        nvme_add_namespace(ctrl, index, nsid, id);
+    }
+}
+
+void nvme_init(void) {
+    PCI_DEVICE pci;
+    for (int i = 0; nvme_ctrl_count < NVME_MAX_CONTROLLERS && pci_find_device(0x01, 0x08, 0x02, i, &pci); i++) {
+        nvme_probe(&pci);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include <stdint.h>
+#include "blockdev.h"
+
+// NVMe over PCI (class 01h, subclass 08h, prog-if 02h). Each controller
+// gets an admin queue and up to NVME_IO_QUEUES I/O queue pairs. A
+// transfer is split into commands (by MDTS, PRP-list size and buffer
+// alignment) that are spread round-robin over the queue pairs; every
+// queue's submission doorbell is written once per batch and every
+// completion doorbell once per reap. Completions are polled.
+//
+// Every active namespace is registered as block device "nvme<c>n<ns>".
+
+#define NVME_MAX_CONTROLLERS 2
+#define NVME_MAX_NAMESPACES  4      // per controller
+#define NVME_IO_QUEUES       4      // pairs requested per controller
+#define NVME_QUEUE_INFLIGHT  16     // commands in flight per queue pair
+
+void nvme_init(void);
+
+#endif
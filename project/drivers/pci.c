@@ -2,6 +2,7 @@
 #include "port_io.h"
 #include "print.h"
 #include "ahci.h"
+#include "pci.h"
 
 #define PCI_CONFIG_ADDRESS 0xCF8
 #define PCI_CONFIG_DATA    0xCFC
@@ -25,6 +26,18 @@ uint32_t pci_config_read32(uint8_t bus, uint8_t device, uint8_t function, uint8_
     return inl(0xCFC);
 }
 
+void pci_config_write32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value) {
+    uint32_t address = (uint32_t)(
+        (1 << 31)              |
+        ((uint32_t)bus << 16)  |
+        ((uint32_t)device << 11) |
+        ((uint32_t)function << 8) |
+        (offset & 0xFC)
+    );
+    outl(PCI_CONFIG_ADDRESS, address);
+    outl(PCI_CONFIG_DATA, value);
+}
+
 uint16_t pci_read_vendor_id(uint8_t bus, uint8_t device, uint8_t function) {
     return pci_config_read(bus, device, function, 0x00) & 0xFFFF;
 }
@@ -92,7 +105,65 @@ void pci_scan() {
 
                     //ahci_init(abar);
                 }
+
+                // NVMe controller (nvme_init picks it up)
+                if (class_code == 0x01 && subclass == 0x08 && prog_if == 0x02) {
+                    print("NVMe controller detected at BAR0: 0x");
+                    print_hex32(pci_config_read32(bus, device, function, 0x10) & ~0xF);
+                    print("\n");
+                }
             }
         }
     }
 }
+
+int pci_find_device(uint8_t class_code, uint8_t subclass, int prog_if, int index, PCI_DEVICE* out) {
+    for (int bus = 0; bus < 256; bus++) {
+        for (int device = 0; device < 32; device++) {
+            for (int function = 0; function < 8; function++) {
+                if (pci_read_vendor_id(bus, device, function) == 0xFFFF) continue;
+                if (pci_read_class_code(bus, device, function) != class_code) continue;
+                if (pci_read_subclass(bus, device, function) != subclass) continue;
+                if (prog_if >= 0 && pci_config_read8(bus, device, function, 0x09) != prog_if) continue;
+                if (index-- > 0) continue;
+
+                out->bus = bus;
+                out->device = device;
+                out->function = function;
+                out->irq_line = pci_config_read8(bus, device, function, 0x3C);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int pci_find_id(uint16_t vendor, uint16_t device_id, int index, PCI_DEVICE* out) {
+    for (int bus = 0; bus < 256; bus++) {
+        for (int device = 0; device < 32; device++) {
+            for (int function = 0; function < 8; function++) {
+                if (pci_read_vendor_id(bus, device, function) != vendor) continue;
+                if (pci_read_device_id(bus, device, function) != device_id) continue;
+                if (index-- > 0) continue;
+
+                out->bus = bus;
+                out->device = device;
+                out->function = function;
+                out->irq_line = pci_config_read8(bus, device, function, 0x3C);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+uint32_t pci_read_bar(const PCI_DEVICE* dev, int bar) {
+    return pci_config_read32(dev->bus, dev->device, dev->function, 0x10 + bar * 4);
+}
+
+void pci_enable_bus_master(const PCI_DEVICE* dev) {
+    uint32_t cmd = pci_config_read32(dev->bus, dev->device, dev->function, 0x04);
+    cmd |= (1 << 2) | (1 << 1) | (1 << 0);  // bus master, memory and I/O space
+    cmd &= ~(1 << 10);              // interrupts not disabled
+    pci_config_write32(dev->bus, dev->device, dev->function, 0x04, cmd & 0xFFFF);
+}
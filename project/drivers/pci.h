@@ -3,8 +3,17 @@
 
 #include <stdint.h>
 
+typedef struct {
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+    uint8_t irq_line;
+} PCI_DEVICE;
+
 // Reads 32 bits from the PCI configuration space
 uint32_t pci_config_read(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
+uint32_t pci_config_read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
+void pci_config_write32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value);
 
 // Basic device info
 uint16_t pci_read_vendor_id(uint8_t bus, uint8_t device, uint8_t function);
@@ -17,4 +26,12 @@ uint8_t pci_config_read8(uint8_t bus, uint8_t device, uint8_t function, uint8_t
 // Scanning routine
 void pci_scan(void);
 
+// Find the index-th function with the given class/subclass (prog_if < 0
+// matches any). Returns 1 and fills *out if found.
+int pci_find_device(uint8_t class_code, uint8_t subclass, int prog_if, int index, PCI_DEVICE* out);
+// Same, by vendor and device ID.
+int pci_find_id(uint16_t vendor, uint16_t device_id, int index, PCI_DEVICE* out);
+uint32_t pci_read_bar(const PCI_DEVICE* dev, int bar);
+void pci_enable_bus_master(const PCI_DEVICE* dev);
+
 #endif // PCI_H
@@ -29,3 +29,11 @@ uint32_t inl(uint16_t port) {
 void outl(uint16_t port, uint32_t val) {
     asm volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
 }
+
+void insw(uint16_t port, void* buffer, uint32_t count) {
+    asm volatile ("cld; rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+void outsw(uint16_t port, const void* buffer, uint32_t count) {
+    asm volatile ("cld; rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
@@ -10,5 +10,9 @@ void outw(uint16_t port, uint16_t data);
 uint32_t inl(uint16_t port);
 void outl(uint16_t port, uint32_t val);
 
+// String I/O: move `count` 16-bit words between a port and memory.
+void insw(uint16_t port, void* buffer, uint32_t count);
+void outsw(uint16_t port, const void* buffer, uint32_t count);
+
 
 #endif
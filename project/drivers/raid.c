@@ -0,0 +1,506 @@
+// raid.c
+
+#include "raid.h"
+#include "bcache.h"
+#include "iosched.h"
+#include "dma.h"
+#include "mem.h"
+#include "print.h"
+
+#define RAID_DISCARD_BATCH 16
+#define RAID_RESYNC_SECTORS 128
+
+// One member's share of a volume transfer.
+typedef struct {
+    IO_REQUEST req;
+    const BLOCK_SEGMENT* list;      // segs, or the caller's list (mirrored writes)
+    uint32_t seg_count;
+    uint64_t lba;
+    uint32_t count;                 // sectors
+    BLOCK_SEGMENT segs[RAID_MAX_SEGS];
+} RAID_MEMBER_IO;
+
+typedef struct {
+    BLOCK_DEVICE dev;
+    int level;
+    uint32_t chunk_shift;           // chunk is 1 << chunk_shift sectors
+    uint32_t member_count;
+    BLOCK_DEVICE* members[RAID_MAX_MEMBERS];
+    uint32_t failed;                // bit per member
+    uint32_t next_read;             // RAID-1 tie breaker
+    RAID_MEMBER_IO io[RAID_MAX_MEMBERS];
+    BLOCK_RANGE discards[RAID_MAX_MEMBERS][RAID_DISCARD_BATCH];
+    uint32_t discard_count[RAID_MAX_MEMBERS];
+} RAID_VOLUME;
+
+static RAID_VOLUME raid_volumes[RAID_MAX_VOLUMES];
+static uint32_t raid_volume_count = 0;
+
+// Position in the segment list of a volume transfer.
+typedef struct {
+    const BLOCK_SEGMENT* segs;
+    uint32_t index;
+    uint32_t offset;
+} RAID_CURSOR;
+
+static uint32_t raid_segs_bytes(const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    uint32_t bytes = 0;
+    for (uint32_t i = 0; i < seg_count; i++) bytes += segs[i].length;
+    return bytes;
+}
+
+// Segments the next bytes of the transfer would take up.
+static uint32_t raid_cursor_span(const RAID_CURSOR* c, uint32_t bytes) {
+    uint32_t n = 0;
+    uint32_t i = c->index;
+    uint32_t off = c->offset;
+    while (bytes) {
+        uint32_t len = c->segs[i].length - off;
+        if (len > bytes) len = bytes;
+        if (len) n++;
+        bytes -= len;
+        i++;
+        off = 0;
+    }
+    return n;
+}
+
+// Move the next bytes of the transfer onto a member's segment list, or
+// just step over them if io is 0.
+static void raid_cursor_take(RAID_CURSOR* c, uint32_t bytes, RAID_MEMBER_IO* io) {
+    while (bytes) {
+        const BLOCK_SEGMENT* seg = &c->segs[c->index];
+        uint32_t len = seg->length - c->offset;
+        if (len > bytes) len = bytes;
+        if (len && io) {
+            io->segs[io->seg_count].buffer = (uint8_t*)seg->buffer + c->offset;
+            io->segs[io->seg_count].length = len;
+            io->seg_count++;
+        }
+        bytes -= len;
+        c->offset += len;
+        if (c->offset == seg->length) {
+            c->index++;
+            c->offset = 0;
+        }
+    }
+}
+
+static void raid_reset(RAID_VOLUME* vol) {
+    for (uint32_t m = 0; m < vol->member_count; m++) {
+        RAID_MEMBER_IO* io = &vol->io[m];
+        io->list = io->segs;
+        io->seg_count = 0;
+        io->count = 0;
+    }
+}
+
+// Queue every member's share, then wait for all of them. Returns the
+// members whose part failed, as a bit mask.
+static uint32_t raid_submit(RAID_VOLUME* vol, int write) {
+    uint32_t failed = 0;
+    for (uint32_t m = 0; m < vol->member_count; m++) {
+        RAID_MEMBER_IO* io = &vol->io[m];
+        if (!io->count) continue;
+
+        IO_REQUEST* req = &io->req;
+        req->dev = vol->members[m];
+        req->write = write;
+        req->prio = IOPRIO_INTERACTIVE;
+        req->lba = io->lba;
+        req->segs = io->list;
+        req->seg_count = io->seg_count;
+        req->callback = 0;
+        req->context = 0;
+        if (iosched_submit(req) != 0) {
+            failed |= 1u << m;
+            io->count = 0;
+        }
+    }
+
+    for (uint32_t m = 0; m < vol->member_count; m++) {
+        RAID_MEMBER_IO* io = &vol->io[m];
+        if (io->count && iosched_wait(&io->req) != 0) failed |= 1u << m;
+    }
+    return failed;
+}
+
+static void raid_fail_members(RAID_VOLUME* vol, uint32_t mask) {
+    for (uint32_t m = 0; m < vol->member_count; m++) {
+        if (!(mask & (1u << m)) || (vol->failed & (1u << m))) continue;
+        vol->failed |= 1u << m;
+        print(vol->dev.name);
+        print(": ");
+        print(vol->members[m]->name);
+        print(" failed, running degraded\n");
+    }
+}
+
+// Member for a chunk-relative position: consecutive chunks go to
+// consecutive members, and the chunks a member gets are contiguous on it.
+static uint32_t raid0_member(RAID_VOLUME* vol, uint64_t lba, uint64_t* member_lba) {
+    uint32_t stripe = (uint32_t)(lba >> vol->chunk_shift);
+    uint32_t off = (uint32_t)lba & ((1u << vol->chunk_shift) - 1);
+    *member_lba = ((uint64_t)(stripe / vol->member_count) << vol->chunk_shift) + off;
+    return stripe % vol->member_count;
+}
+
+static int raid0_transfer(RAID_VOLUME* vol, int write, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    uint32_t sector_size = vol->dev.sector_size;
+    uint32_t chunk = 1u << vol->chunk_shift;
+    uint32_t sectors = raid_segs_bytes(segs, seg_count) / sector_size;
+    RAID_CURSOR c = { segs, 0, 0 };
+
+    raid_reset(vol);
+    while (sectors) {
+        uint64_t member_lba;
+        uint32_t m = raid0_member(vol, lba, &member_lba);
+        uint32_t n = chunk - ((uint32_t)lba & (chunk - 1));
+        if (n > sectors) n = sectors;
+
+        // Out of segment slots for this member: send what we have.
+        RAID_MEMBER_IO* io = &vol->io[m];
+        if (io->seg_count + raid_cursor_span(&c, n * sector_size) > RAID_MAX_SEGS) {
+            if (io->seg_count == 0) return -1;
+            if (raid_submit(vol, write)) return -1;
+            raid_reset(vol);
+            continue;
+        }
+
+        if (!io->count) io->lba = member_lba;
+        raid_cursor_take(&c, n * sector_size, io);
+        io->count += n;
+        lba += n;
+        sectors -= n;
+    }
+    return raid_submit(vol, write) ? -1 : 0;
+}
+
+// The working member whose last transfer ended closest to lba, taking
+// turns between equally close ones.
+static int raid1_pick(RAID_VOLUME* vol, uint64_t lba, uint32_t exclude) {
+    int best = -1;
+    uint64_t best_dist = 0;
+    for (uint32_t i = 0; i < vol->member_count; i++) {
+        uint32_t m = (vol->next_read + i) % vol->member_count;
+        if ((vol->failed | exclude) & (1u << m)) continue;
+
+        uint64_t head = vol->members[m]->io_head;
+        uint64_t dist = head > lba ? head - lba : lba - head;
+        if (best < 0 || dist < best_dist) {
+            best = m;
+            best_dist = dist;
+        }
+    }
+    if (best >= 0) vol->next_read = best + 1;
+    return best;
+}
+
+// Read from one mirror, falling back to the others on error.
+static int raid1_read_one(RAID_VOLUME* vol, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count, uint32_t exclude) {
+    int m;
+    while ((m = raid1_pick(vol, lba, exclude)) >= 0) {
+        if (iosched_transfer(vol->members[m], 0, IOPRIO_INTERACTIVE, lba, segs, seg_count) == 0) return 0;
+        exclude |= 1u << m;
+    }
+    return -1;
+}
+
+// Large reads get one contiguous part per working mirror.
+static int raid1_read(RAID_VOLUME* vol, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    uint32_t sector_size = vol->dev.sector_size;
+    uint32_t sectors = raid_segs_bytes(segs, seg_count) / sector_size;
+    uint32_t chunk = 1u << vol->chunk_shift;
+
+    uint32_t live = 0;
+    for (uint32_t m = 0; m < vol->member_count; m++) {
+        if (!(vol->failed & (1u << m))) live++;
+    }
+    if (live < 2 || sectors < 2 * chunk) return raid1_read_one(vol, lba, segs, seg_count, 0);
+
+    uint32_t part = ((sectors + live - 1) / live + chunk - 1) & ~(chunk - 1);
+
+    // Every part has to fit a member's segment list; otherwise read it
+    // all from one mirror.
+    RAID_CURSOR c = { segs, 0, 0 };
+    for (uint32_t left = sectors; left; ) {
+        uint32_t n = part < left ? part : left;
+        if (raid_cursor_span(&c, n * sector_size) > RAID_MAX_SEGS) return raid1_read_one(vol, lba, segs, seg_count, 0);
+        raid_cursor_take(&c, n * sector_size, 0);
+        left -= n;
+    }
+
+    c.index = 0;
+    c.offset = 0;
+    raid_reset(vol);
+    for (uint32_t m = 0; m < vol->member_count && sectors; m++) {
+        if (vol->failed & (1u << m)) continue;
+        uint32_t n = part < sectors ? part : sectors;
+        RAID_MEMBER_IO* io = &vol->io[m];
+        io->lba = lba;
+        raid_cursor_take(&c, n * sector_size, io);
+        io->count = n;
+        lba += n;
+        sectors -= n;
+    }
+
+    // Re-read failed parts from the other mirrors.
+    uint32_t failed = raid_submit(vol, 0);
+    for (uint32_t m = 0; m < vol->member_count; m++) {
+        RAID_MEMBER_IO* io = &vol->io[m];
+        if (!(failed & (1u << m))) continue;
+        if (raid1_read_one(vol, io->lba, io->segs, io->seg_count, 1u << m) != 0) return -1;
+    }
+    return 0;
+}
+
+static int raid1_write(RAID_VOLUME* vol, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    uint32_t sectors = raid_segs_bytes(segs, seg_count) / vol->dev.sector_size;
+
+    raid_reset(vol);
+    for (uint32_t m = 0; m < vol->member_count; m++) {
+        if (vol->failed & (1u << m)) continue;
+        RAID_MEMBER_IO* io = &vol->io[m];
+        io->list = segs;
+        io->seg_count = seg_count;
+        io->lba = lba;
+        io->count = sectors;
+    }
+
+    raid_fail_members(vol, raid_submit(vol, 1));
+    for (uint32_t m = 0; m < vol->member_count; m++) {
+        if (!(vol->failed & (1u << m))) return 0;
+    }
+    return -1;
+}
+
+static int raid_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    RAID_VOLUME* vol = dev->driver_data;
+    if (vol->level == RAID_LEVEL_STRIPE) return raid0_transfer(vol, 0, lba, segs, seg_count);
+    return raid1_read(vol, lba, segs, seg_count);
+}
+
+static int raid_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    RAID_VOLUME* vol = dev->driver_data;
+    if (vol->level == RAID_LEVEL_STRIPE) return raid0_transfer(vol, 1, lba, segs, seg_count);
+    return raid1_write(vol, lba, segs, seg_count);
+}
+
+static int raid_read(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, void* buffer) {
+    BLOCK_SEGMENT seg = { buffer, count * dev->sector_size };
+    return raid_readv(dev, lba, &seg, 1);
+}
+
+static int raid_write(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    BLOCK_SEGMENT seg = { (void*)buffer, count * dev->sector_size };
+    return raid_writev(dev, lba, &seg, 1);
+}
+
+static int raid_flush(BLOCK_DEVICE* dev) {
+    RAID_VOLUME* vol = dev->driver_data;
+    int status = 0;
+    for (uint32_t m = 0; m < vol->member_count; m++) {
+        if (vol->failed & (1u << m)) continue;
+        if (blockdev_flush(vol->members[m]) != 0) status = -1;
+    }
+    return status;
+}
+
+static int raid_discard_flush(RAID_VOLUME* vol, uint32_t m) {
+    uint32_t n = vol->discard_count[m];
+    vol->discard_count[m] = 0;
+    if (!n || (vol->failed & (1u << m))) return 0;
+    return blockdev_discard(vol->members[m], vol->discards[m], n);
+}
+
+// Add a member range, extending the previous one where it continues it.
+static int raid_discard_add(RAID_VOLUME* vol, uint32_t m, uint64_t lba, uint32_t count) {
+    uint32_t n = vol->discard_count[m];
+    if (n) {
+        BLOCK_RANGE* last = &vol->discards[m][n - 1];
+        if (last->lba + last->count == lba) {
+            last->count += count;
+            return 0;
+        }
+    }
+    if (n == RAID_DISCARD_BATCH && raid_discard_flush(vol, m) != 0) return -1;
+
+    n = vol->discard_count[m]++;
+    vol->discards[m][n].lba = lba;
+    vol->discards[m][n].count = count;
+    return 0;
+}
+
+static int raid_discard(BLOCK_DEVICE* dev, const BLOCK_RANGE* ranges, uint32_t range_count) {
+    RAID_VOLUME* vol = dev->driver_data;
+    uint32_t chunk = 1u << vol->chunk_shift;
+
+    for (uint32_t i = 0; i < range_count; i++) {
+        uint64_t lba = ranges[i].lba;
+        uint32_t count = ranges[i].count;
+        while (count) {
+            uint64_t member_lba = lba;
+            uint32_t n = count;
+            uint32_t m = 0;
+            if (vol->level == RAID_LEVEL_STRIPE) {
+                m = raid0_member(vol, lba, &member_lba);
+                n = chunk - ((uint32_t)lba & (chunk - 1));
+                if (n > count) n = count;
+                if (raid_discard_add(vol, m, member_lba, n) != 0) return -1;
+            } else {
+                for (m = 0; m < vol->member_count; m++) {
+                    if (raid_discard_add(vol, m, member_lba, n) != 0) return -1;
+                }
+            }
+            lba += n;
+            count -= n;
+        }
+    }
+
+    int status = 0;
+    for (uint32_t m = 0; m < vol->member_count; m++) {
+        if (raid_discard_flush(vol, m) != 0) status = -1;
+    }
+    return status;
+}
+
+static const BLOCK_DEVICE_OPS raid_blk_ops = {
+    raid_read,
+    raid_write,
+    raid_readv,
+    raid_writev,
+    raid_flush,
+    0,              // write + flush
+    raid_discard,
+};
+
+// Copy the first member onto the others.
+static int raid1_resync(RAID_VOLUME* vol) {
+    DMA_BUFFER buf;
+    uint32_t sector_size = vol->dev.sector_size;
+    if (dma_alloc(&buf, RAID_RESYNC_SECTORS * sector_size, sector_size) != 0) return -1;
+
+    print(vol->dev.name);
+    print(": syncing from ");
+    print(vol->members[0]->name);
+    print("\n");
+
+    int status = 0;
+    for (uint64_t lba = 0; lba < vol->dev.sector_count && status == 0; lba += RAID_RESYNC_SECTORS) {
+        uint32_t n = RAID_RESYNC_SECTORS;
+        if (vol->dev.sector_count - lba < n) n = (uint32_t)(vol->dev.sector_count - lba);
+
+        BLOCK_SEGMENT seg = { buf.virt, n * sector_size };
+        if (iosched_transfer(vol->members[0], 0, IOPRIO_INTERACTIVE, lba, &seg, 1) != 0) {
+            status = -1;
+            break;
+        }
+        raid_reset(vol);
+        for (uint32_t m = 1; m < vol->member_count; m++) {
+            RAID_MEMBER_IO* io = &vol->io[m];
+            io->list = &seg;
+            io->seg_count = 1;
+            io->lba = lba;
+            io->count = n;
+        }
+        if (raid_submit(vol, 1)) status = -1;
+    }
+
+    dma_free(&buf);
+    return status;
+}
+
+// Members keep their own scheduler and statistics but give up caching.
+static int raid_claim(BLOCK_DEVICE* dev) {
+    if (blockdev_flush(dev) != 0) return -1;
+    bcache_invalidate(dev, 0, 0xFFFFFFFF);
+    dev->flags |= BLOCKDEV_CLAIMED | BLOCKDEV_NOCACHE;
+    return 0;
+}
+
+static void raid_release(BLOCK_DEVICE** members, const uint32_t* flags, uint32_t count) {
+    for (uint32_t m = 0; m < count; m++) members[m]->flags = flags[m];
+}
+
+BLOCK_DEVICE* raid_create(int level, uint32_t chunk_kb, BLOCK_DEVICE** members, uint32_t member_count) {
+    if (raid_volume_count == RAID_MAX_VOLUMES) return 0;
+    if (level != RAID_LEVEL_STRIPE && level != RAID_LEVEL_MIRROR) return 0;
+    if (member_count < 2 || member_count > RAID_MAX_MEMBERS) return 0;
+
+    uint32_t sector_size = members[0]->sector_size;
+    uint64_t member_sectors = members[0]->sector_count;
+    for (uint32_t m = 0; m < member_count; m++) {
+        BLOCK_DEVICE* dev = members[m];
+        if (dev->sector_size != sector_size || dev->sector_count == 0) return 0;
+        if (dev->flags & BLOCKDEV_CLAIMED) return 0;
+        for (uint32_t k = 0; k < m; k++) {
+            if (members[k] == dev) return 0;
+        }
+        if (dev->sector_count < member_sectors) member_sectors = dev->sector_count;
+    }
+
+    if (chunk_kb == 0) chunk_kb = RAID_DEFAULT_CHUNK_KB;
+    if (chunk_kb > RAID_MAX_CHUNK_KB || (chunk_kb & (chunk_kb - 1))) return 0;
+    uint32_t chunk_bytes = chunk_kb * 1024;
+    if (chunk_bytes < sector_size) return 0;
+    uint32_t chunk_shift = 0;
+    while ((sector_size << chunk_shift) < chunk_bytes) chunk_shift++;
+    if ((sector_size << chunk_shift) != chunk_bytes) return 0;   // not a power of two
+
+    RAID_VOLUME* vol = &raid_volumes[raid_volume_count];
+    memset(vol, 0, sizeof(*vol));
+    vol->level = level;
+    vol->chunk_shift = chunk_shift;
+    vol->member_count = member_count;
+    for (uint32_t m = 0; m < member_count; m++) vol->members[m] = members[m];
+
+    // Whole chunks only; the stripe number has to fit in 32 bits.
+    BLOCK_DEVICE* dev = &vol->dev;
+    uint64_t chunks = member_sectors >> chunk_shift;
+    if (level == RAID_LEVEL_STRIPE) {
+        if (chunks > 0xFFFFFFFF / member_count) chunks = 0xFFFFFFFF / member_count;
+        dev->sector_count = (chunks * member_count) << chunk_shift;
+    } else {
+        dev->sector_count = member_sectors;
+    }
+    if (dev->sector_count == 0) return 0;
+
+    uint32_t flags[RAID_MAX_MEMBERS];
+    for (uint32_t m = 0; m < member_count; m++) {
+        flags[m] = members[m]->flags;
+        if (raid_claim(members[m]) != 0) {
+            raid_release(members, flags, m + 1);
+            return 0;
+        }
+    }
+
+    blockdev_set_name(dev, "md", raid_volume_count);
+    dev->ops = &raid_blk_ops;
+    dev->unit = raid_volume_count;
+    dev->flags = 0;
+    dev->driver_data = vol;
+    dev->sector_size = sector_size;
+    dev->max_sectors = 0;
+
+    if (level == RAID_LEVEL_MIRROR && raid1_resync(vol) != 0) {
+        print(dev->name);
+        print(": sync failed\n");
+        raid_release(members, flags, member_count);
+        return 0;
+    }
+    if (blockdev_register(dev) < 0) {
+        raid_release(members, flags, member_count);
+        return 0;
+    }
+    raid_volume_count++;
+
+    print(dev->name);
+    print(": RAID-");
+    print_uint(level);
+    print(", ");
+    print_uint(member_count);
+    print(" members, ");
+    print_uint((uint32_t)((dev->sector_count * sector_size) >> 20));
+    print(" MiB\n");
+    return dev;
+}
@@ -0,0 +1,40 @@
+#ifndef RAID_H
+#define RAID_H
+
+#include <stdint.h>
+#include "blockdev.h"
+
+// Software RAID volumes over registered block devices, registered as
+// "md<n>" so FAT32 (or anything else) can use them like any disk.
+//
+// RAID-0 stripes the volume over its members in chunks of a power-of-two
+// number of sectors. RAID-1 mirrors it: writes go to every member, small
+// reads go to the member whose head is nearest, and large reads are split
+// into one contiguous part per member. A member that fails a write is
+// dropped and the volume carries on degraded.
+//
+// A transfer is cut into one request per member, all of which are queued
+// with the members' schedulers before the first one is waited on.
+//
+// There is no on-disk superblock: volumes are put together at run time
+// (the "raid0" and "raid1" shell commands). Members are claimed: their
+// cached blocks are written back and dropped, and from then on they
+// bypass the buffer cache so only the volume's blocks are cached.
+
+#define RAID_MAX_VOLUMES     2
+#define RAID_MAX_MEMBERS     4
+#define RAID_MAX_SEGS        128    // per member request
+#define RAID_DEFAULT_CHUNK_KB 64
+#define RAID_MAX_CHUNK_KB    16384
+
+#define RAID_LEVEL_STRIPE    0
+#define RAID_LEVEL_MIRROR    1
+
+// chunk_kb is the RAID-0 stripe unit (0 for the default); for RAID-1 it
+// is the smallest read worth splitting across the mirrors. It must be a
+// power of two no larger than RAID_MAX_CHUNK_KB. A new RAID-1
+// volume is synced from its first member, so a filesystem on that member
+// shows up on the volume. Returns the volume, or 0 on error.
+BLOCK_DEVICE* raid_create(int level, uint32_t chunk_kb, BLOCK_DEVICE** members, uint32_t member_count);
+
+#endif
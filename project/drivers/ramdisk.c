@@ -0,0 +1,129 @@
+// ramdisk.c
+
+#include "ramdisk.h"
+#include "mem.h"
+#include "print.h"
+
+static BLOCK_DEVICE ramdisk_dev;
+
+static uint8_t* ramdisk_ptr(BLOCK_DEVICE* dev, uint64_t lba) {
+    return (uint8_t*)dev->driver_data + (uint32_t)lba * RAMDISK_SECTOR_SIZE;
+}
+
+static int ramdisk_read(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, void* buffer) {
+    memcpy(buffer, ramdisk_ptr(dev, lba), count * RAMDISK_SECTOR_SIZE);
+    return 0;
+}
+
+static int ramdisk_write(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    memcpy(ramdisk_ptr(dev, lba), buffer, count * RAMDISK_SECTOR_SIZE);
+    return 0;
+}
+
+// Segments need not hold whole sectors here, so copy byte-wise through the
+// list instead of letting blockdev split it per segment.
+static int ramdisk_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    uint8_t* p = ramdisk_ptr(dev, lba);
+    for (uint32_t i = 0; i < seg_count; i++) {
+        memcpy(segs[i].buffer, p, segs[i].length);
+        p += segs[i].length;
+    }
+    return 0;
+}
+
+static int ramdisk_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    uint8_t* p = ramdisk_ptr(dev, lba);
+    for (uint32_t i = 0; i < seg_count; i++) {
+        memcpy(p, segs[i].buffer, segs[i].length);
+        p += segs[i].length;
+    }
+    return 0;
+}
+
+// Discarded sectors read back as zeroes.
+static int ramdisk_discard(BLOCK_DEVICE* dev, const BLOCK_RANGE* ranges, uint32_t range_count) {
+    for (uint32_t i = 0; i < range_count; i++) {
+        memset(ramdisk_ptr(dev, ranges[i].lba), 0, ranges[i].count * RAMDISK_SECTOR_SIZE);
+    }
+    return 0;
+}
+
+static const BLOCK_DEVICE_OPS ramdisk_blk_ops = {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_readv,
+    ramdisk_writev,
+    0,              // nothing volatile to flush
+    0,
+    ramdisk_discard,
+};
+
+// Value of "ramdisk=<n>" on the command line, or 0.
+static uint32_t ramdisk_cmdline_mb(const char* cmdline) {
+    const char* key = "ramdisk=";
+    for (const char* p = cmdline; *p; p++) {
+        int k = 0;
+        while (key[k] && p[k] == key[k]) k++;
+        if (key[k]) continue;
+
+        uint32_t mb = 0;
+        for (p += k; *p >= '0' && *p <= '9'; p++) mb = mb * 10 + (*p - '0');
+        return mb;
+    }
+    return 0;
+}
+
+int ramdisk_init(uint32_t magic, const MULTIBOOT_INFO* info) {
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC) info = 0;
+
+    uint32_t mb = 0;
+    if (info && (info->flags & MULTIBOOT_INFO_CMDLINE)) mb = ramdisk_cmdline_mb((const char*)info->cmdline);
+    if (mb == 0) mb = RAMDISK_DEFAULT_MB;
+    uint32_t size = mb << 20;
+
+    const MULTIBOOT_MODULE* mod = 0;
+    if (info && (info->flags & MULTIBOOT_INFO_MODS) && info->mods_count) {
+        mod = (const MULTIBOOT_MODULE*)info->mods_addr;
+    }
+    uint32_t image = mod ? mod->mod_end - mod->mod_start : 0;
+    if (image > size) size = image;
+    size = (size + RAMDISK_SECTOR_SIZE - 1) & ~(RAMDISK_SECTOR_SIZE - 1);
+
+    // Stay inside the memory GRUB reported.
+    if (info && (info->flags & MULTIBOOT_INFO_MEMORY)) {
+        uint32_t mem_end = 0x100000 + info->mem_upper * 1024;
+        if (mem_end <= RAMDISK_BASE) {
+            print("ramdisk: not enough memory\n");
+            return -1;
+        }
+        if (size > mem_end - RAMDISK_BASE) size = (mem_end - RAMDISK_BASE) & ~(RAMDISK_SECTOR_SIZE - 1);
+    }
+    if (image > size) {
+        print("ramdisk: image does not fit in memory\n");
+        image = 0;
+    }
+
+    // The module may sit anywhere above the kernel, including inside the
+    // disk's own window.
+    uint8_t* base = (uint8_t*)RAMDISK_BASE;
+    if (image) memmove(base, (const void*)mod->mod_start, image);
+    memset(base + image, 0, size - image);
+
+    BLOCK_DEVICE* dev = &ramdisk_dev;
+    blockdev_set_name(dev, "ram", 0);
+    dev->ops = &ramdisk_blk_ops;
+    dev->unit = 0;
+    dev->flags = BLOCKDEV_NOCACHE;
+    dev->driver_data = base;
+    dev->sector_size = RAMDISK_SECTOR_SIZE;
+    dev->sector_count = size / RAMDISK_SECTOR_SIZE;
+    dev->max_sectors = 0;
+    if (blockdev_register(dev) < 0) return -1;
+
+    print("ramdisk: ");
+    print_uint(size >> 10);
+    print(" KiB");
+    if (image) print(", seeded from module");
+    print("\n");
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdint.h>
+#include "blockdev.h"
+#include "multiboot.h"
+
+// RAM-backed block device "ram0". It lives in a fixed window at
+// RAMDISK_BASE, above the kernel and the DMA pool, and bypasses the
+// buffer cache since it already is memory.
+//
+// The size comes from "ramdisk=<MiB>" on the kernel command line
+// (RAMDISK_DEFAULT_MB otherwise). If GRUB loaded a module, the first one
+// is copied in as the initial contents, e.g. a FAT32 image:
+//
+//     multiboot /boot/kernel.elf ramdisk=64
+//     module /boot/ramdisk.img
+//
+// The disk grows to fit the image and shrinks to fit installed memory.
+
+#define RAMDISK_BASE        0x1000000   // 16 MiB
+#define RAMDISK_DEFAULT_MB  16
+#define RAMDISK_SECTOR_SIZE 512
+
+// Must run before anything allocates from the DMA pool: GRUB may have put
+// the module there. Returns 0 if ram0 was registered.
+int ramdisk_init(uint32_t magic, const MULTIBOOT_INFO* info);
+
+#endif
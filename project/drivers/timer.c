@@ -0,0 +1,64 @@
+#include "timer.h"
+#include "interrupts.h"
+#include "port_io.h"
+
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND  0x43
+#define PIT_FREQ     1193182
+#define TIMER_HZ     1000
+
+static volatile uint32_t ticks = 0;
+static int running = 0;
+static uint32_t tsc_per_us = 1;
+
+static void timer_irq(uint8_t irq) {
+    (void)irq;
+    ticks++;
+}
+
+uint64_t timer_rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void timer_init(void) {
+    uint16_t divisor = PIT_FREQ / TIMER_HZ;
+
+    outb(PIT_COMMAND, 0x34);            // channel 0, lo/hi, rate generator
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+
+    irq_register_handler(0, timer_irq);
+    running = 1;
+
+    // Calibrate the TSC over 10 ticks.
+    uint32_t start = ticks;
+    while (ticks == start) irq_wait();
+    uint64_t tsc0 = timer_rdtsc();
+    start = ticks;
+    while (ticks - start < 10) irq_wait();
+    uint64_t tsc1 = timer_rdtsc();
+
+    // 10 ms of cycles fits in 32 bits; avoids pulling in 64-bit division.
+    uint32_t per_us = (uint32_t)(tsc1 - tsc0) / 10000;
+    tsc_per_us = per_us ? per_us : 1;
+}
+
+int timer_running(void) {
+    return running;
+}
+
+uint32_t timer_ms(void) {
+    return ticks;
+}
+
+uint32_t timer_tsc_per_us(void) {
+    return tsc_per_us;
+}
+
+uint32_t timer_elapsed_us(uint64_t start_tsc) {
+    uint64_t delta = timer_rdtsc() - start_tsc;
+    if (delta >> 32) return 0xFFFFFFFF;     // saturate; also avoids 64-bit division
+    return (uint32_t)delta / tsc_per_us;
+}
@@ -0,0 +1,20 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Program the PIT for a 1 kHz tick on IRQ0 and calibrate the TSC against it.
+// Requires interrupts_init() first.
+void timer_init(void);
+int timer_running(void);
+
+// Milliseconds since timer_init.
+uint32_t timer_ms(void);
+
+uint64_t timer_rdtsc(void);
+uint32_t timer_tsc_per_us(void);
+
+// Microseconds since a timer_rdtsc() reading, saturating at 0xFFFFFFFF.
+uint32_t timer_elapsed_us(uint64_t start_tsc);
+
+#endif
@@ -0,0 +1,583 @@
+// virtio_blk.c
+
+#include "virtio_blk.h"
+#include "port_io.h"
+#include "print.h"
+#include "pci.h"
+#include "interrupts.h"
+#include "timer.h"
+#include "mem.h"
+#include "dma.h"
+
+#define VIRTIO_VENDOR_ID           0x1AF4
+#define VIRTIO_BLK_LEGACY_ID       0x1001
+#define VIRTIO_BLK_MODERN_ID       0x1042
+
+// Legacy virtio PCI registers, from BAR0
+#define VIRTIO_REG_DEVICE_FEATURES 0x00
+#define VIRTIO_REG_GUEST_FEATURES  0x04
+#define VIRTIO_REG_QUEUE_PFN       0x08
+#define VIRTIO_REG_QUEUE_SIZE      0x0C
+#define VIRTIO_REG_QUEUE_SELECT    0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY    0x10
+#define VIRTIO_REG_STATUS          0x12
+#define VIRTIO_REG_ISR             0x13
+#define VIRTIO_REG_CONFIG          0x14    // without MSI-X
+
+#define VIRTIO_STATUS_ACK          0x01
+#define VIRTIO_STATUS_DRIVER       0x02
+#define VIRTIO_STATUS_DRIVER_OK    0x04
+#define VIRTIO_STATUS_FAILED       0x80
+
+// virtio-blk config space
+#define VIRTIO_BLK_CFG_CAPACITY    0x00    // 64-bit, in 512-byte units
+#define VIRTIO_BLK_CFG_SIZE_MAX    0x08
+#define VIRTIO_BLK_CFG_SEG_MAX     0x0C
+#define VIRTIO_BLK_CFG_BLK_SIZE    0x14
+#define VIRTIO_BLK_CFG_MAX_DISCARD_SECTORS 0x24
+#define VIRTIO_BLK_CFG_MAX_DISCARD_SEG     0x28
+
+#define VIRTIO_BLK_F_SIZE_MAX      (1u << 1)
+#define VIRTIO_BLK_F_SEG_MAX       (1u << 2)
+#define VIRTIO_BLK_F_RO            (1u << 5)
+#define VIRTIO_BLK_F_BLK_SIZE      (1u << 6)
+#define VIRTIO_BLK_F_FLUSH         (1u << 9)
+#define VIRTIO_BLK_F_DISCARD       (1u << 13)
+#define VIRTIO_F_INDIRECT_DESC     (1u << 28)
+
+#define VIRTIO_BLK_FEATURES (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | \
+                             VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_DISCARD | \
+                             VIRTIO_F_INDIRECT_DESC)
+
+#define VIRTIO_BLK_T_IN            0
+#define VIRTIO_BLK_T_OUT           1
+#define VIRTIO_BLK_T_FLUSH         4
+#define VIRTIO_BLK_T_DISCARD       11
+
+#define VIRTIO_BLK_S_OK            0
+#define VIRTIO_BLK_S_PENDING       0xFF    // not yet written by the device
+
+#define VRING_DESC_F_NEXT          1
+#define VRING_DESC_F_WRITE         2       // device writes this buffer
+#define VRING_DESC_F_INDIRECT      4
+#define VRING_USED_F_NO_NOTIFY     1
+#define VRING_ALIGN                4096
+
+// Each disk allocates its virtqueue (legacy rings live in one physically
+// contiguous, page-aligned block) and its per-request headers and
+// descriptor tables from the DMA pool.
+#define VIRTIO_BLK_RING_SIZE       0x8000  // room for a 1024-entry queue
+#define VIRTIO_MAX_QUEUE           1024
+#define VIRTIO_BLK_MAX_DISCARD     32      // ranges per discard request
+
+#define VIRTIO_BLK_TIMEOUT_MS      5000
+#define VIRTIO_BLK_SPIN_TIMEOUT    1000000
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) VRING_DESC;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} __attribute__((packed)) VRING_AVAIL;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed)) VRING_USED_ELEM;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    VRING_USED_ELEM ring[];
+} __attribute__((packed)) VRING_USED;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) VIRTIO_BLK_HEADER;
+
+typedef struct {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} __attribute__((packed)) VIRTIO_BLK_DISCARD_RANGE;
+
+// Device-visible state of one request.
+typedef struct {
+    VIRTIO_BLK_HEADER header;
+    volatile uint8_t status;
+    uint8_t pad[15];
+    VRING_DESC table[VIRTIO_BLK_MAX_SEGS + 2];  // header, data..., status
+    VIRTIO_BLK_DISCARD_RANGE discard[VIRTIO_BLK_MAX_DISCARD];
+} __attribute__((packed)) VIRTIO_BLK_SLOT;
+
+typedef struct {
+    PCI_DEVICE pci;
+    uint16_t io;
+    int irq;
+    uint32_t features;
+
+    // Virtqueue 0
+    DMA_BUFFER ring_dma;
+    uint16_t queue_size;
+    VRING_DESC* desc;
+    volatile VRING_AVAIL* avail;
+    volatile VRING_USED* used;
+    uint16_t avail_idx;         // next free avail entry, published on notify
+    uint16_t used_idx;          // next used entry to reap
+
+    // Each slot owns a fixed run of ring descriptors: one with indirect
+    // descriptors, header + data + status without.
+    VIRTIO_BLK_SLOT* slots;
+    DMA_BUFFER slots_dma;
+    uint32_t inflight;          // usable slots
+    uint32_t descs_per_slot;
+    uint32_t busy;              // slot bitmask
+
+    // Limits
+    uint32_t sector_shift;      // log2(sector size / 512)
+    uint32_t max_segs;
+    uint32_t size_max;          // bytes per data descriptor
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+
+    BLOCK_DEVICE blockdev;
+} VIRTIO_BLK_STATE;
+
+static VIRTIO_BLK_STATE virtio_blks[VIRTIO_BLK_MAX_DEVICES];
+static int virtio_blk_count = 0;
+
+static uint32_t virtio_cfg32(VIRTIO_BLK_STATE* vb, uint16_t offset) {
+    return inl(vb->io + VIRTIO_REG_CONFIG + offset);
+}
+
+static void virtio_blk_irq_handler(uint8_t irq) {
+    // Reading the ISR acknowledges the (level-triggered) interrupt. The
+    // waiter finds completions in the used ring itself.
+    for (int i = 0; i < virtio_blk_count; i++) {
+        if (virtio_blks[i].irq == irq) inb(virtio_blks[i].io + VIRTIO_REG_ISR);
+    }
+}
+
+// Reset the device and bring up virtqueue 0. Returns 0 on success.
+static int virtio_blk_start(VIRTIO_BLK_STATE* vb) {
+    outb(vb->io + VIRTIO_REG_STATUS, 0);
+    outb(vb->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK);
+    outb(vb->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    vb->features = inl(vb->io + VIRTIO_REG_DEVICE_FEATURES) & VIRTIO_BLK_FEATURES;
+    outl(vb->io + VIRTIO_REG_GUEST_FEATURES, vb->features);
+
+    outw(vb->io + VIRTIO_REG_QUEUE_SELECT, 0);
+    uint16_t size = inw(vb->io + VIRTIO_REG_QUEUE_SIZE);
+    if (size == 0 || size > VIRTIO_MAX_QUEUE) {
+        outb(vb->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+
+    // Legacy layout: descriptors, available ring, then the used ring on
+    // the next VRING_ALIGN boundary.
+    uintptr_t ring = (uintptr_t)vb->ring_dma.virt;
+    uintptr_t used = ring + size * sizeof(VRING_DESC) + 6 + size * 2;
+    used = (used + VRING_ALIGN - 1) & ~(uintptr_t)(VRING_ALIGN - 1);
+    memset(vb->ring_dma.virt, 0, VIRTIO_BLK_RING_SIZE);
+
+    vb->queue_size = size;
+    vb->desc = (VRING_DESC*)ring;
+    vb->avail = (volatile VRING_AVAIL*)(ring + size * sizeof(VRING_DESC));
+    vb->used = (volatile VRING_USED*)used;
+    vb->avail_idx = 0;
+    vb->used_idx = 0;
+    vb->busy = 0;
+
+    if (vb->features & VIRTIO_F_INDIRECT_DESC) {
+        vb->inflight = size < VIRTIO_BLK_MAX_INFLIGHT ? size : VIRTIO_BLK_MAX_INFLIGHT;
+        vb->descs_per_slot = 1;
+        vb->max_segs = VIRTIO_BLK_MAX_SEGS;
+    } else {
+        vb->inflight = size / 3 < VIRTIO_BLK_MAX_INFLIGHT ? size / 3 : VIRTIO_BLK_MAX_INFLIGHT;
+        if (vb->inflight == 0) return -1;
+        vb->descs_per_slot = size / vb->inflight;
+        vb->max_segs = vb->descs_per_slot - 2;
+        if (vb->max_segs > VIRTIO_BLK_MAX_SEGS) vb->max_segs = VIRTIO_BLK_MAX_SEGS;
+    }
+    if (vb->features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t seg_max = virtio_cfg32(vb, VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max && seg_max < vb->max_segs) vb->max_segs = seg_max;
+    }
+
+    outl(vb->io + VIRTIO_REG_QUEUE_PFN, vb->ring_dma.phys / VRING_ALIGN);
+    outb(vb->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    return 0;
+}
+
+static int virtio_blk_alloc_slot(VIRTIO_BLK_STATE* vb) {
+    for (uint32_t i = 0; i < vb->inflight; i++) {
+        if (!(vb->busy & (1u << i))) return i;
+    }
+    return -1;
+}
+
+// Put a request on the available ring; s->table[1..data_count] must hold
+// its data descriptors. It is not visible to the device until the next
+// virtio_blk_notify.
+static void virtio_blk_queue(VIRTIO_BLK_STATE* vb, int slot, uint32_t type, uint64_t sector, uint32_t data_count) {
+    VIRTIO_BLK_SLOT* s = &vb->slots[slot];
+    uint16_t head = slot * vb->descs_per_slot;
+
+    s->header.type = type;
+    s->header.reserved = 0;
+    s->header.sector = sector;
+    s->status = VIRTIO_BLK_S_PENDING;
+
+    uint32_t n = data_count + 2;
+    s->table[0].addr = dma_phys(&s->header);
+    s->table[0].len = sizeof(VIRTIO_BLK_HEADER);
+    s->table[n - 1].addr = dma_phys((const void*)&s->status);
+    s->table[n - 1].len = 1;
+    s->table[n - 1].flags = VRING_DESC_F_WRITE;
+
+    // Chain the table; indirect tables are numbered from 0, direct chains
+    // use the slot's own run of ring descriptors.
+    uint16_t base = 0;
+    VRING_DESC* chain = s->table;
+    if (vb->descs_per_slot > 1) {
+        base = head;
+        chain = &vb->desc[head];
+        for (uint32_t i = 0; i < n; i++) chain[i] = s->table[i];
+    }
+    chain[0].flags = VRING_DESC_F_NEXT;
+    chain[0].next = base + 1;
+    for (uint32_t i = 1; i < n - 1; i++) {
+        chain[i].flags |= VRING_DESC_F_NEXT;
+        chain[i].next = base + i + 1;
+    }
+
+    if (vb->descs_per_slot == 1) {
+        vb->desc[head].addr = dma_phys(s->table);
+        vb->desc[head].len = n * sizeof(VRING_DESC);
+        vb->desc[head].flags = VRING_DESC_F_INDIRECT;
+        vb->desc[head].next = 0;
+    }
+
+    vb->avail->ring[vb->avail_idx % vb->queue_size] = head;
+    vb->avail_idx++;
+    vb->busy |= 1u << slot;
+}
+
+// Publish everything queued since the last call with one doorbell write.
+static void virtio_blk_notify(VIRTIO_BLK_STATE* vb) {
+    __asm__ volatile ("" ::: "memory");
+    vb->avail->idx = vb->avail_idx;
+
+    // The store above must be visible before used->flags is sampled.
+    __sync_synchronize();
+    if (!(vb->used->flags & VRING_USED_F_NO_NOTIFY)) {
+        outw(vb->io + VIRTIO_REG_QUEUE_NOTIFY, 0);
+    }
+}
+
+// Collect completed requests; returns their slots.
+static uint32_t virtio_blk_reap(VIRTIO_BLK_STATE* vb) {
+    uint32_t done = 0;
+    while (vb->used_idx != vb->used->idx) {
+        __asm__ volatile ("" ::: "memory");
+        uint32_t id = vb->used->ring[vb->used_idx % vb->queue_size].id;
+        uint32_t slot = id / vb->descs_per_slot;
+        if (slot < vb->inflight) done |= 1u << slot;
+        vb->used_idx++;
+    }
+    vb->busy &= ~done;
+    return done;
+}
+
+// Wait until at least one request in flight has finished and return the
+// finished slots. On timeout the device is reset, which fails everything
+// in flight.
+static uint32_t virtio_blk_wait(VIRTIO_BLK_STATE* vb) {
+    uint32_t start_ms = timer_ms();
+    uint32_t spins = 0;
+
+    while (1) {
+        uint32_t flags = irq_save();
+        uint32_t done = virtio_blk_reap(vb);
+        if (done) {
+            irq_restore(flags);
+            return done;
+        }
+
+        if ((flags & (1 << 9)) && vb->irq >= 0) {
+            irq_wait();
+        } else {
+            irq_restore(flags);
+        }
+
+        if (timer_running() ? (timer_ms() - start_ms > VIRTIO_BLK_TIMEOUT_MS) : (++spins > VIRTIO_BLK_SPIN_TIMEOUT)) {
+            break;
+        }
+    }
+
+    print("virtio-blk request timed out\n");
+    uint32_t lost = vb->busy;
+    virtio_blk_start(vb);
+    return lost;    // their status bytes still read VIRTIO_BLK_S_PENDING
+}
+
+static int virtio_blk_failed(VIRTIO_BLK_STATE* vb, uint32_t done) {
+    for (uint32_t i = 0; i < vb->inflight; i++) {
+        if ((done & (1u << i)) && vb->slots[i].status != VIRTIO_BLK_S_OK) return 1;
+    }
+    return 0;
+}
+
+// Run a request with no data or a single data descriptor to completion.
+static int virtio_blk_sync_request(VIRTIO_BLK_STATE* vb, uint32_t type, uint64_t sector, uint32_t data_count) {
+    int slot = 0;   // callers own the whole queue
+    virtio_blk_queue(vb, slot, type, sector, data_count);
+    virtio_blk_notify(vb);
+
+    int error = 0;
+    while (vb->busy) {
+        if (virtio_blk_failed(vb, virtio_blk_wait(vb))) error = 1;
+    }
+    return error ? -1 : 0;
+}
+
+// Split the segment list into requests of at most max_segs descriptors
+// and size_max bytes per descriptor, each a whole number of sectors.
+// Requests are queued while slots are free, published together, and the
+// next batch goes out as soon as any of them completes.
+static int virtio_blk_rw(VIRTIO_BLK_STATE* vb, int write, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    if (write && (vb->features & VIRTIO_BLK_F_RO)) return -1;
+
+    uint32_t seg = 0;
+    uint32_t off = 0;
+    uint64_t sector = lba << vb->sector_shift;
+    int error = 0;
+
+    while ((seg < seg_count && !error) || vb->busy) {
+        int queued = 0;
+        while (seg < seg_count && !error) {
+            int slot = virtio_blk_alloc_slot(vb);
+            if (slot < 0) break;
+
+            VIRTIO_BLK_SLOT* s = &vb->slots[slot];
+            uint32_t piece_seg[VIRTIO_BLK_MAX_SEGS];
+            uint32_t piece_off[VIRTIO_BLK_MAX_SEGS];
+            uint32_t n = 0;
+            uint32_t bytes = 0;
+
+            while (seg < seg_count && n < vb->max_segs) {
+                if (segs[seg].length == 0) {
+                    seg++;
+                    continue;
+                }
+                uint32_t len = segs[seg].length - off;
+                if (len > vb->size_max) len = vb->size_max;
+
+                piece_seg[n] = seg;
+                piece_off[n] = off;
+                s->table[1 + n].addr = dma_phys((uint8_t*)segs[seg].buffer + off);
+                s->table[1 + n].len = len;
+                s->table[1 + n].flags = write ? 0 : VRING_DESC_F_WRITE;
+                n++;
+                bytes += len;
+
+                off += len;
+                if (off == segs[seg].length) {
+                    seg++;
+                    off = 0;
+                }
+            }
+
+            // Cut back to a sector boundary; the rest starts the next request.
+            uint32_t excess = bytes & 511;
+            while (excess && n) {
+                uint32_t len = s->table[n].len;
+                if (len > excess) {
+                    s->table[n].len = len - excess;
+                    seg = piece_seg[n - 1];
+                    off = piece_off[n - 1] + len - excess;
+                    bytes -= excess;
+                    excess = 0;
+                } else {
+                    seg = piece_seg[n - 1];
+                    off = piece_off[n - 1];
+                    bytes -= len;
+                    excess -= len;
+                    n--;
+                }
+            }
+            if (n == 0) {
+                error = 1;
+                break;
+            }
+
+            virtio_blk_queue(vb, slot, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, sector, n);
+            sector += bytes >> 9;
+            queued++;
+        }
+
+        if (queued) virtio_blk_notify(vb);
+        if (vb->busy && virtio_blk_failed(vb, virtio_blk_wait(vb))) error = 1;
+    }
+    return error ? -1 : 0;
+}
+
+static VIRTIO_BLK_STATE* virtio_blk_state(BLOCK_DEVICE* dev) {
+    return (VIRTIO_BLK_STATE*)dev->driver_data;
+}
+
+static int virtio_blk_readv(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    return virtio_blk_rw(virtio_blk_state(dev), 0, lba, segs, seg_count);
+}
+
+static int virtio_blk_writev(BLOCK_DEVICE* dev, uint64_t lba, const BLOCK_SEGMENT* segs, uint32_t seg_count) {
+    return virtio_blk_rw(virtio_blk_state(dev), 1, lba, segs, seg_count);
+}
+
+static int virtio_blk_read(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, void* buffer) {
+    BLOCK_SEGMENT seg = { buffer, count * dev->sector_size };
+    return virtio_blk_readv(dev, lba, &seg, 1);
+}
+
+static int virtio_blk_write(BLOCK_DEVICE* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    BLOCK_SEGMENT seg = { (void*)buffer, count * dev->sector_size };
+    return virtio_blk_writev(dev, lba, &seg, 1);
+}
+
+static int virtio_blk_flush(BLOCK_DEVICE* dev) {
+    VIRTIO_BLK_STATE* vb = virtio_blk_state(dev);
+    if (!(vb->features & VIRTIO_BLK_F_FLUSH)) return 0;    // no volatile cache
+    return virtio_blk_sync_request(vb, VIRTIO_BLK_T_FLUSH, 0, 0);
+}
+
+static int virtio_blk_discard(BLOCK_DEVICE* dev, const BLOCK_RANGE* ranges, uint32_t range_count) {
+    VIRTIO_BLK_STATE* vb = virtio_blk_state(dev);
+    if (!(vb->features & VIRTIO_BLK_F_DISCARD)) return 0;
+
+    uint32_t per_request = vb->max_discard_seg;
+    if (per_request == 0 || per_request > VIRTIO_BLK_MAX_DISCARD) per_request = VIRTIO_BLK_MAX_DISCARD;
+    uint32_t max_len = vb->max_discard_sectors >> vb->sector_shift;
+    if (max_len == 0) max_len = 0xFFFFFFFF >> vb->sector_shift;
+
+    VIRTIO_BLK_SLOT* s = &vb->slots[0];
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < range_count; i++) {
+        uint64_t lba = ranges[i].lba;
+        uint32_t count = ranges[i].count;
+        while (count) {
+            uint32_t len = count < max_len ? count : max_len;
+            s->discard[n].sector = lba << vb->sector_shift;
+            s->discard[n].num_sectors = len << vb->sector_shift;
+            s->discard[n].flags = 0;
+            n++;
+            lba += len;
+            count -= len;
+
+            int last = count == 0 && i == range_count - 1;
+            if (n == per_request || last) {
+                s->table[1].addr = dma_phys(s->discard);
+                s->table[1].len = n * sizeof(VIRTIO_BLK_DISCARD_RANGE);
+                s->table[1].flags = 0;
+                if (virtio_blk_sync_request(vb, VIRTIO_BLK_T_DISCARD, 0, 1) != 0) return -1;
+                n = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static const BLOCK_DEVICE_OPS virtio_blk_ops = {
+    virtio_blk_read,
+    virtio_blk_write,
+    virtio_blk_readv,
+    virtio_blk_writev,
+    virtio_blk_flush,
+    0,
+    virtio_blk_discard,
+};
+
+static void virtio_blk_probe(const PCI_DEVICE* pci) {
+    uint32_t bar0 = pci_read_bar(pci, 0);
+    if (!(bar0 & 1)) return;    // the legacy interface is I/O space
+
+    VIRTIO_BLK_STATE* vb = &virtio_blks[virtio_blk_count];
+    vb->pci = *pci;
+    vb->io = (uint16_t)(bar0 & ~3);
+    vb->irq = pci->irq_line < IRQ_COUNT ? pci->irq_line : -1;
+    if (dma_alloc(&vb->ring_dma, VIRTIO_BLK_RING_SIZE, VRING_ALIGN) != 0 ||
+        dma_alloc(&vb->slots_dma, VIRTIO_BLK_MAX_INFLIGHT * sizeof(VIRTIO_BLK_SLOT), 16) != 0) {
+        print("virtio-blk: out of DMA memory\n");
+        dma_free(&vb->ring_dma);
+        return;
+    }
+    vb->slots = vb->slots_dma.virt;
+
+    pci_enable_bus_master(pci);
+    if (virtio_blk_start(vb) != 0) {
+        print("virtio-blk: unusable queue\n");
+        dma_free(&vb->ring_dma);
+        dma_free(&vb->slots_dma);
+        return;
+    }
+
+    uint32_t sector_size = 512;
+    if (vb->features & VIRTIO_BLK_F_BLK_SIZE) {
+        uint32_t blk_size = virtio_cfg32(vb, VIRTIO_BLK_CFG_BLK_SIZE);
+        if (blk_size >= 512 && blk_size <= 4096 && !(blk_size & (blk_size - 1))) sector_size = blk_size;
+    }
+    vb->sector_shift = 0;
+    while ((512u << vb->sector_shift) < sector_size) vb->sector_shift++;
+
+    vb->size_max = 0xFFFFFFFF;
+    if (vb->features & VIRTIO_BLK_F_SIZE_MAX) {
+        uint32_t size_max = virtio_cfg32(vb, VIRTIO_BLK_CFG_SIZE_MAX) & ~511u;
+        if (size_max) vb->size_max = size_max;
+    }
+    if (vb->features & VIRTIO_BLK_F_DISCARD) {
+        vb->max_discard_sectors = virtio_cfg32(vb, VIRTIO_BLK_CFG_MAX_DISCARD_SECTORS);
+        vb->max_discard_seg = virtio_cfg32(vb, VIRTIO_BLK_CFG_MAX_DISCARD_SEG);
+    }
+
+    uint64_t capacity = virtio_cfg32(vb, VIRTIO_BLK_CFG_CAPACITY) |
+                        ((uint64_t)virtio_cfg32(vb, VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+
+    if (vb->irq >= 0) irq_register_handler(vb->irq, virtio_blk_irq_handler);
+
+    BLOCK_DEVICE* dev = &vb->blockdev;
+    blockdev_set_name(dev, "virtio", virtio_blk_count);
+    dev->ops = &virtio_blk_ops;
+    dev->unit = virtio_blk_count;
+    dev->driver_data = vb;
+    dev->sector_size = sector_size;
+    dev->sector_count = capacity >> vb->sector_shift;
+    dev->max_sectors = 0;   // requests are split internally
+    blockdev_register(dev);
+    virtio_blk_count++;
+
+    print(dev->name);
+    print(": ");
+    print_uint((uint32_t)(capacity >> 11));
+    print(" MiB, queue ");
+    print_uint(vb->queue_size);
+    print((vb->features & VIRTIO_F_INDIRECT_DESC) ? ", indirect" : ", direct");
+    print("\n");
+}
+
+void virtio_blk_init(void) {
+    PCI_DEVICE pci;
+    for (int i = 0; virtio_blk_count < VIRTIO_BLK_MAX_DEVICES && pci_find_id(VIRTIO_VENDOR_ID, VIRTIO_BLK_LEGACY_ID, i, &pci); i++) {
+        virtio_blk_probe(&pci);
+    }
+    if (pci_find_id(VIRTIO_VENDOR_ID, VIRTIO_BLK_MODERN_ID, 0, &pci)) {
+        print("virtio-blk: modern-only device ignored, use disable-legacy=off\n");
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include "blockdev.h"
+
+// virtio-blk over the legacy (transitional) PCI interface: I/O BAR0, one
+// split virtqueue per disk. Requests use indirect descriptors when the
+// device offers them, so each one takes a single ring entry. A transfer
+// is split into as many requests as the device limits need; all of them
+// are put on the ring before a single doorbell write, which is skipped
+// while the device says it is still processing the queue.
+//
+// Every disk found is registered as block device "virtio<n>".
+
+#define VIRTIO_BLK_MAX_DEVICES  4
+#define VIRTIO_BLK_MAX_INFLIGHT 16      // requests on the ring per disk
+#define VIRTIO_BLK_MAX_SEGS     128     // data descriptors per request
+
+void virtio_blk_init(void);
+
+#endif
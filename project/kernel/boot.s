@@ -2,6 +2,9 @@
 .global _start
 
 _start:
+    # Multiboot: eax = magic, ebx = boot information
+    push %ebx
+    push %eax
     call kernel_main
 
 hang:
@@ -6,6 +6,14 @@
 #include "../drivers/gui.h"
 #include "../drivers/pci.h"
 #include "../drivers/ahci.h"
+#include "../drivers/interrupts.h"
+#include "../drivers/timer.h"
+#include "../drivers/ide_dma.h"
+#include "../drivers/ata_pio.h"
+#include "../drivers/ramdisk.h"
+#include "../drivers/virtio_blk.h"
+#include "../drivers/nvme.h"
+#include "../drivers/dma.h"
 
 //#include "../system/terminal.h"
 
@@ -69,10 +77,19 @@ void print_hex(uint8_t* buffer, int length) {
     }
 }
 
-void startup_sequence()
+void startup_sequence(uint32_t multiboot_magic, const MULTIBOOT_INFO* multiboot_info)
 {
+    interrupts_init();
+    timer_init();
+    // Before the DMA pool is handed out: a boot module may overlap it.
+    ramdisk_init(multiboot_magic, multiboot_info);
+    dma_init();
     print("scanning PCI Ports\n");
     pci_scan();
+    ide_dma_init();
+    ata_register_block_devices();
+    virtio_blk_init();
+    nvme_init();
     print("attempting to read cluster 0 of SATA drive\n");
     ahci_init(0);
     print("read SATA disk!!!\n");
@@ -142,8 +159,8 @@ void run()
     terminal_run();
 }
 
-void kernel_main() {
-    startup_sequence();
+void kernel_main(uint32_t multiboot_magic, uint32_t multiboot_info) {
+    startup_sequence(multiboot_magic, (const MULTIBOOT_INFO*)multiboot_info);
 
     start();
 
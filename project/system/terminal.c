@@ -4,6 +4,10 @@
 #include "../drivers/fat32.h"
 #include <stdint.h>
 #include "../drivers/drive_tools.h"
+#include "../drivers/bcache.h"
+#include "../drivers/iosched.h"
+#include "../drivers/ahci.h"
+#include "../drivers/raid.h"
 typedef uint32_t size_t;
 
 
@@ -90,6 +94,30 @@ char* trim_front(char* str, int n) {
 
 
 static char path[512] = "/";
+
+static BLOCK_DEVICE* selected_disk = 0;
+
+// FAT32 only handles 512-byte sectors, and RAID members belong to their
+// volume.
+static int terminal_usable(BLOCK_DEVICE* dev) {
+    return dev && dev->sector_size == 512 && !(dev->flags & BLOCKDEV_CLAIMED);
+}
+
+// The volume the shell works on: whatever "disk" selected, otherwise an
+// NVMe namespace, a virtio disk, the SATA disk, or whatever was found first.
+static BLOCK_DEVICE* terminal_disk(void) {
+    if (selected_disk) return selected_disk;
+    static const char* preferred[] = { "nvme0n1", "virtio0", "ahci0" };
+    for (int i = 0; i < 3; i++) {
+        BLOCK_DEVICE* dev = blockdev_find(preferred[i]);
+        if (terminal_usable(dev)) return dev;
+    }
+    for (int i = 0; i < blockdev_count(); i++) {
+        if (terminal_usable(blockdev_get(i))) return blockdev_get(i);
+    }
+    return 0;
+}
+
 void cd_command(const char* arg) {
     char new_path[512];
 
@@ -129,20 +157,72 @@ void cd_command(const char* arg) {
     }
 
     // Check if the directory exists
-    if (fat32_dir_exists(0, new_path)) {
+    if (fat32_dir_exists(terminal_disk(), new_path)) {
         strcpy(path, new_path);
     } else {
         print("Directory does not exist.\n");
     }
 }
 
+// "raid0 [chunk KiB] <disk> <disk>..." or "raid1 <disk> <disk>..."
+static void raid_command(char* args, int level) {
+    BLOCK_DEVICE* members[RAID_MAX_MEMBERS];
+    uint32_t count = 0;
+    uint32_t chunk_kb = 0;
+    BLOCK_DEVICE* mounted = terminal_disk();
 
+    while (*args) {
+        while (*args == ' ') args++;
+        if (!*args) break;
+        char* word = args;
+        while (*args && *args != ' ') args++;
+        if (*args) *args++ = '\0';
+
+        if (*word >= '0' && *word <= '9') {
+            chunk_kb = 0;
+            for (char* p = word; *p >= '0' && *p <= '9'; p++) {
+                if (chunk_kb <= RAID_MAX_CHUNK_KB) chunk_kb = chunk_kb * 10 + (*p - '0');    // too big stays too big
+            }
+            continue;
+        }
+
+        BLOCK_DEVICE* dev = blockdev_find(word);
+        if (!dev || count == RAID_MAX_MEMBERS) {
+            print("bad disk: ");
+            print(word);
+            print("\n");
+            return;
+        }
+        if (dev == mounted) fat32_sync(dev);
+        members[count++] = dev;
+    }
+
+    BLOCK_DEVICE* vol = raid_create(level, chunk_kb, members, count);
+    if (!vol) {
+        print("could not create RAID volume\n");
+        return;
+    }
+
+    // The shell's disk is a member now: carry on with the volume.
+    if (mounted && (mounted->flags & BLOCKDEV_CLAIMED)) {
+        selected_disk = vol;
+        strcpy(path, "/");
+        print("switched to ");
+        print(vol->name);
+        print("\n");
+        if (!fat32_init(vol)) print("no FAT32 volume on disk\n");
+    }
+}
 
 
 void terminal_run()
 {
     char text[512];
     char* prefix[512];
+
+    // The shell is about to go idle: let queued background write-back go.
+    iosched_run(0);
+
     str_concat_into(prefix, 512, path, "> ");
     input(prefix, text, 512);
 
@@ -155,13 +235,86 @@ void terminal_run()
     }
     else if(starts_with_n(text, "ls", 2))
     {
-        fat32_list_directory(0, path);
+        fat32_list_directory(terminal_disk(), path);
         print("\n");
     }
     else if(starts_with_n(text, "shutdown", 8))
     {
+        fat32_sync(terminal_disk());
         outw(0x604, 0x2000);
     }
+    else if(starts_with_n(text, "sync", 4))
+    {
+        fat32_sync(terminal_disk());
+        print("\n");
+    }
+    else if(starts_with_n(text, "disk ", 5))
+    {
+        BLOCK_DEVICE* dev = blockdev_find(trim_front(text, 5));
+        if (dev && (dev->flags & BLOCKDEV_CLAIMED)) {
+            print("disk is part of a RAID volume");
+        } else if (dev && !terminal_usable(dev)) {
+            print("disk does not use 512-byte sectors");
+        } else if (dev) {
+            fat32_sync(terminal_disk());
+            selected_disk = dev;
+            strcpy(path, "/");
+            if (!fat32_init(dev)) print("no FAT32 volume on disk");
+        } else {
+            print("no such disk");
+        }
+        print("\n");
+    }
+    else if(starts_with_n(text, "raid0 ", 6))
+    {
+        raid_command(trim_front(text, 6), RAID_LEVEL_STRIPE);
+        print("\n");
+    }
+    else if(starts_with_n(text, "raid1 ", 6))
+    {
+        raid_command(trim_front(text, 6), RAID_LEVEL_MIRROR);
+        print("\n");
+    }
+    else if(starts_with_n(text, "iostat", 6))
+    {
+        for (int i = 0; i < blockdev_count(); i++) {
+            BLOCK_DEVICE* dev = blockdev_get(i);
+            iostat_print(dev->name, &dev->stats);
+        }
+        for (uint32_t port = 0; port < 32; port++) {
+            const IO_STATS* stats = ahci_port_stats(port);
+            if (!stats) continue;
+            print("ahci port ");
+            print_uint(port);
+            iostat_print("", stats);
+        }
+        print("\n");
+    }
+    else if(starts_with_n(text, "df", 2))
+    {
+        // Kept by the FAT32 allocator; nothing is read from disk.
+        // In bytes: a 512-byte cluster is half a KiB.
+        uint64_t cluster_bytes = (uint64_t)bpb.sectorsPerCluster * bpb.bytesPerSector;
+        print("free: ");
+        print_uint((uint32_t)((fat32_free_clusters() * cluster_bytes) >> 10));
+        print(" KiB of ");
+        print_uint((uint32_t)((fat32_total_clusters() * cluster_bytes) >> 10));
+        print(" KiB\n\n");
+    }
+    else if(starts_with_n(text, "bcache", 6))
+    {
+        BCACHE_STATS stats;
+        bcache_get_stats(&stats);
+        print("hits: ");
+        print_uint(stats.hits);
+        print(", misses: ");
+        print_uint(stats.misses);
+        print(", evictions: ");
+        print_uint(stats.evictions);
+        print(", writebacks: ");
+        print_uint(stats.writebacks);
+        print("\n\n");
+    }
     else if (starts_with_n(text, "cd ", 3)) {
         char* arg = trim_front(text, 3);
         cd_command(arg);
@@ -172,7 +325,7 @@ void terminal_run()
         char* arg = trim_front(text, 6);
         char mkdir_path[512];
         str_concat_into(mkdir_path, 512, path, arg);
-        if (fat32_create_dir(0, mkdir_path) == true)
+        if (fat32_create_dir(terminal_disk(), mkdir_path) == true)
         {
             char res[512];
             str_concat_into(res, 512, "created directory ", mkdir_path);
@@ -192,7 +345,7 @@ void terminal_run()
         char* arg = trim_front(text, 6);
         char rmdir_path[512];
         str_concat_into(rmdir_path, 512, path, arg);
-        if (fat32_delete_dir(0, rmdir_path) == true)
+        if (fat32_delete_dir(terminal_disk(), rmdir_path) == true)
         {
             char res[512];
             str_concat_into(res, 512, "created directory ", rmdir_path);
@@ -210,7 +363,7 @@ void terminal_run()
     }
     else if (starts_with_n(text, "test", 4)) {
         char* arg = trim_front(text, 4);
-        fat32_list_root_dir(0);
+        fat32_list_root_dir(terminal_disk());
         print("\n");
         
     }